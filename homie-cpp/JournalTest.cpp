@@ -0,0 +1,256 @@
+#include <gtest/gtest.h>
+#include <homie-cpp/master.h>
+#include <homie-cpp/journal.h>
+#include <homie-cpp/change_log.h>
+#include <cstdio>
+#include <thread>
+
+using namespace homie;
+
+namespace {
+	struct test_mqtt_client : public homie::mqtt_client {
+		homie::mqtt_event_handler* handler = nullptr;
+
+		virtual void set_event_handler(homie::mqtt_event_handler * evt) override { handler = evt; }
+		virtual void open(const std::string& will_topic, const std::string& will_payload, int will_qos, bool will_retain) override { FAIL(); }
+		virtual void open() override {
+			if (handler)
+				handler->on_connect(false, false);
+		}
+		virtual void publish(const std::string & topic, const std::string & payload, int qos, bool retain) override {}
+		virtual void subscribe(const std::string & topic, int qos) override {}
+		virtual void unsubscribe(const std::string & topic) override {}
+		virtual bool is_connected() const override { return true; }
+	};
+
+	void remove_journal(const std::string& base) {
+		for (size_t i = 0; file_exists(journal::segment_path(base, i)); i++)
+			std::remove(journal::segment_path(base, i).c_str());
+	}
+
+	void append_values(journal_writer& wr, int from, int to) {
+		for (int i = from; i < to; i++) {
+			int64_t idx = i;
+			wr.append(change_kind::property_value, "dev", "node", "prop", i % 2 ? &idx : nullptr, "", std::to_string(i));
+		}
+	}
+}
+
+TEST(JournalTest, WriteAndTail) {
+	const std::string base = "homie_journal_test";
+	remove_journal(base);
+	{
+		// Small segments to force several switches
+		journal_writer wr(base, 256);
+		append_values(wr, 0, 50);
+		ASSERT_EQ(wr.last_sequence(), 50);
+		ASSERT_GT(wr.current_segment(), 2);
+
+		journal_reader rd(base);
+		change_record rec;
+		for (int i = 0; i < 50; i++) {
+			ASSERT_TRUE(rd.next(rec));
+			ASSERT_EQ(rec.seq, i + 1);
+			ASSERT_EQ(rec.kind, change_kind::property_value);
+			ASSERT_EQ(rec.device, "dev");
+			ASSERT_EQ(rec.node, "node");
+			ASSERT_EQ(rec.property, "prop");
+			ASSERT_EQ(rec.indexed, i % 2 == 1);
+			if (rec.indexed) {
+				ASSERT_EQ(rec.idx, i);
+			}
+			ASSERT_EQ(rec.value, std::to_string(i));
+			ASSERT_GT(rec.time, 0);
+		}
+		ASSERT_FALSE(rd.next(rec));
+
+		// Picks up records written later, including new segments
+		append_values(wr, 50, 60);
+		for (int i = 50; i < 60; i++) {
+			ASSERT_TRUE(rd.next(rec));
+			ASSERT_EQ(rec.seq, i + 1);
+		}
+		ASSERT_FALSE(rd.next(rec));
+
+		// Start in the middle
+		journal_reader mid(base, 42);
+		ASSERT_TRUE(mid.next(rec));
+		ASSERT_EQ(rec.seq, 42);
+		ASSERT_EQ(rec.value, "41");
+	}
+	{
+		// Reopening continues the sequence
+		journal_writer wr(base, 256);
+		ASSERT_EQ(wr.last_sequence(), 60);
+		append_values(wr, 60, 61);
+		journal_reader rd(base, 60);
+		change_record rec;
+		ASSERT_TRUE(rd.next(rec));
+		ASSERT_EQ(rec.seq, 60);
+		ASSERT_TRUE(rd.next(rec));
+		ASSERT_EQ(rec.seq, 61);
+		ASSERT_FALSE(rd.next(rec));
+	}
+	remove_journal(base);
+}
+
+TEST(JournalTest, LargeRecord) {
+	const std::string base = "homie_journal_large";
+	remove_journal(base);
+	{
+		journal_writer wr(base, 128);
+		std::string big(1000, 'x');
+		wr.append(change_kind::device_attribute, "dev", "", "", nullptr, "name", big);
+		wr.append(change_kind::device_attribute, "dev", "", "", nullptr, "name", "small");
+		journal_reader rd(base);
+		change_record rec;
+		ASSERT_TRUE(rd.next(rec));
+		ASSERT_EQ(rec.value, big);
+		ASSERT_TRUE(rd.next(rec));
+		ASSERT_EQ(rec.value, "small");
+	}
+	remove_journal(base);
+}
+
+TEST(JournalTest, MasterChanges) {
+	const std::string base = "homie_journal_master";
+	remove_journal(base);
+	{
+		test_mqtt_client client;
+		master m(client);
+		m.open_journal(base);
+		client.handler->on_message("homie/dev1/$state", "init");
+		client.handler->on_message("homie/dev1/$nodes", "lamp,strip[]");
+		client.handler->on_message("homie/dev1/lamp/$type", "light");
+		client.handler->on_message("homie/dev1/lamp/on/$datatype", "boolean");
+		client.handler->on_message("homie/dev1/lamp/on", "true");
+		client.handler->on_message("homie/dev1/strip/$array", "0-1");
+		client.handler->on_message("homie/dev1/strip_1/$name", "Second");
+		client.handler->on_message("homie/dev1/strip_1/color", "255,0,0");
+		ASSERT_EQ(m.get_journal_sequence(), 8);
+		m.sync_journal();
+
+		journal_reader rd(base);
+		std::vector<change_record> records;
+		change_record rec;
+		while (rd.next(rec)) records.push_back(rec);
+		ASSERT_EQ(records.size(), 8);
+		ASSERT_EQ(records[0].kind, change_kind::device_attribute);
+		ASSERT_EQ(records[0].id, "state");
+		ASSERT_EQ(records[0].value, "init");
+		ASSERT_EQ(records[2].kind, change_kind::node_attribute);
+		ASSERT_EQ(records[2].node, "lamp");
+		ASSERT_EQ(records[3].kind, change_kind::property_attribute);
+		ASSERT_EQ(records[3].property, "on");
+		ASSERT_EQ(records[3].id, "datatype");
+		ASSERT_EQ(records[4].kind, change_kind::property_value);
+		ASSERT_EQ(records[4].value, "true");
+		ASSERT_FALSE(records[4].indexed);
+		ASSERT_TRUE(records[6].indexed);
+		ASSERT_EQ(records[6].idx, 1);
+		ASSERT_EQ(records[7].property, "color");
+		ASSERT_EQ(records[7].idx, 1);
+
+		m.close_journal();
+		client.handler->on_message("homie/dev1/lamp/on", "false");
+		ASSERT_EQ(m.get_journal_sequence(), 0);
+		ASSERT_FALSE(rd.next(rec));
+	}
+	remove_journal(base);
+}
+
+TEST(JournalTest, ChangeLog) {
+	change_log log(8, 4096);
+	auto delta = log.changes_since(0);
+	ASSERT_FALSE(delta.resync);
+	ASSERT_EQ(delta.sequence, 0);
+	ASSERT_TRUE(delta.changes.empty());
+
+	int64_t idx = 3;
+	log.append(change_kind::property_value, "dev", "node", "prop", &idx, "", "1");
+	log.append(change_kind::property_attribute, "dev", "node", "prop", nullptr, "unit", "%");
+	log.append(change_kind::device_attribute, "dev", "", "", nullptr, "state", "ready");
+	delta = log.changes_since(0);
+	ASSERT_FALSE(delta.resync);
+	ASSERT_EQ(delta.sequence, 3);
+	ASSERT_EQ(delta.changes.size(), 3);
+	ASSERT_EQ(delta.changes[0].seq, 1);
+	ASSERT_TRUE(delta.changes[0].indexed);
+	ASSERT_EQ(delta.changes[0].idx, 3);
+	ASSERT_EQ(delta.changes[1].id, "unit");
+	ASSERT_EQ(delta.changes[2].value, "ready");
+
+	delta = log.changes_since(1, 1);
+	ASSERT_EQ(delta.changes.size(), 1);
+	ASSERT_EQ(delta.sequence, 2);
+	ASSERT_TRUE(log.changes_since(3).changes.empty());
+	ASSERT_TRUE(log.changes_since(4).resync);
+
+	// Only the last 8 records are kept
+	for (int i = 0; i < 10; i++) log.append(change_kind::property_value, "dev", "node", "prop", nullptr, "", std::to_string(i));
+	ASSERT_TRUE(log.changes_since(0).resync);
+	delta = log.changes_since(5);
+	ASSERT_FALSE(delta.resync);
+	ASSERT_EQ(delta.changes.size(), 8);
+	ASSERT_EQ(delta.changes.back().value, "9");
+
+	// Storage overrun and records larger than the ring
+	log.append(change_kind::property_value, "dev", "node", "prop", nullptr, "", std::string(3800, 'x'));
+	ASSERT_TRUE(log.changes_since(5).resync);
+	delta = log.changes_since(13);
+	ASSERT_EQ(delta.changes.size(), 1);
+	ASSERT_EQ(delta.changes[0].value.size(), 3800);
+	log.append(change_kind::property_value, "dev", "node", "prop", nullptr, "", std::string(5000, 'x'));
+	ASSERT_TRUE(log.changes_since(13).resync);
+	log.append(change_kind::property_value, "dev", "node", "prop", nullptr, "", "small");
+	delta = log.changes_since(15);
+	ASSERT_EQ(delta.changes.size(), 1);
+	ASSERT_EQ(delta.changes[0].value, "small");
+}
+
+TEST(JournalTest, ChangeLogConcurrentPoller) {
+	change_log log(64, 2048);
+	const uint64_t total = 20000;
+	std::thread writer([&]() {
+		for (uint64_t i = 1; i <= total; i++)
+			log.append(change_kind::property_value, "dev", "node", "prop", nullptr, "", std::to_string(i));
+	});
+	uint64_t seq = 0;
+	size_t received = 0;
+	size_t resyncs = 0;
+	while (seq < total) {
+		auto delta = log.changes_since(seq);
+		if (delta.resync) {
+			resyncs++;
+			seq = delta.sequence;
+			continue;
+		}
+		for (auto& c : delta.changes) {
+			ASSERT_EQ(c.seq, ++seq);
+			ASSERT_EQ(c.value, std::to_string(c.seq));
+			received++;
+		}
+	}
+	writer.join();
+	ASSERT_GT(received + resyncs, 0);
+}
+
+TEST(JournalTest, MasterChangeLog) {
+	test_mqtt_client client;
+	master m(client);
+	ASSERT_TRUE(m.changes_since(0).resync);
+	m.enable_change_log();
+	client.handler->on_message("homie/dev1/$state", "init");
+	client.handler->on_message("homie/dev1/lamp/on", "true");
+	auto delta = m.changes_since(0);
+	ASSERT_FALSE(delta.resync);
+	ASSERT_EQ(delta.changes.size(), 2);
+	ASSERT_EQ(delta.changes[1].device, "dev1");
+	ASSERT_EQ(delta.changes[1].node, "lamp");
+	ASSERT_EQ(delta.changes[1].property, "on");
+	ASSERT_EQ(delta.changes[1].value, "true");
+	client.handler->on_message("homie/dev1/lamp/on", "false");
+	delta = m.changes_since(delta.sequence);
+	ASSERT_EQ(delta.changes.size(), 1);
+	ASSERT_EQ(delta.changes[0].value, "false");
+}
@@ -1,5 +1,13 @@
 #include <gtest/gtest.h>
 #include <homie-cpp/master.h>
+#include <homie-cpp/federation.h>
+#include <homie-cpp/partition.h>
+#include <chrono>
+#include <iostream>
+#include <atomic>
+#include <deque>
+#include <tuple>
+#include <thread>
 
 using namespace homie;
 
@@ -62,6 +70,14 @@ namespace {
 				steps.erase(steps.begin());
 		}
 
+		size_t batches = 0;
+
+		virtual void publish_batch(const homie::mqtt_batch& batch) override
+		{
+			batches++;
+			homie::mqtt_client::publish_batch(batch);
+		}
+
 		virtual void subscribe(const std::string & topic, int qos) override
 		{
 			ASSERT_TRUE(expect_subscribe.count(topic) != 0);
@@ -84,6 +100,32 @@ namespace {
 			return steps.back();
 		}
 	};
+
+	void publish_test_device(test_mqtt_client& client, const std::string& id) {
+		auto base = "homie/" + id + "/";
+		client.handler->on_message(base + "$state", "init");
+		client.handler->on_message(base + "$homie", "3.0.0");
+		client.handler->on_message(base + "$name", "Testdevice");
+		client.handler->on_message(base + "$nodes", "testnode,arraynode[]");
+		client.handler->on_message(base + "$stats/interval", "60");
+		client.handler->on_message(base + "testnode/$name", "Testnode");
+		client.handler->on_message(base + "testnode/$type", "light");
+		client.handler->on_message(base + "testnode/$properties", "intensity");
+		client.handler->on_message(base + "testnode/intensity", "100");
+		client.handler->on_message(base + "testnode/intensity/$name", "Intensity");
+		client.handler->on_message(base + "testnode/intensity/$settable", "true");
+		client.handler->on_message(base + "testnode/intensity/$unit", "%");
+		client.handler->on_message(base + "testnode/intensity/$datatype", "integer");
+		client.handler->on_message(base + "arraynode/$name", "Arraynode");
+		client.handler->on_message(base + "arraynode/$type", "switch");
+		client.handler->on_message(base + "arraynode/$array", "0-1");
+		client.handler->on_message(base + "arraynode/$properties", "on");
+		client.handler->on_message(base + "arraynode_0/$name", "First");
+		client.handler->on_message(base + "arraynode/on/$datatype", "boolean");
+		client.handler->on_message(base + "arraynode_0/on", "true");
+		client.handler->on_message(base + "arraynode_1/on", "false");
+		client.handler->on_message(base + "$state", "ready");
+	}
 }
 
 TEST(MasterTest, Init) {
@@ -442,4 +484,1913 @@ TEST(MasterTest, EventHandler) {
 	ASSERT_TRUE(test_client.steps.empty());
 	ASSERT_TRUE(test_client.expect_subscribe.empty());
 	ASSERT_TRUE(test_client.expect_unsubscribe.empty());
-}
\ No newline at end of file
+}
+
+TEST(MasterTest, DeviceCache) {
+	const std::string path = "homie_master_test.cache";
+	test_mqtt_client test_client;
+	test_client.expect_subscribe.insert("homie/#");
+	test_client.expect_unsubscribe.insert("homie/#");
+	{
+		master m(test_client);
+		publish_test_device(test_client, "cacheddevice");
+		publish_test_device(test_client, "gonedevice");
+		m.save_cache(path);
+	}
+
+	test_client.expect_subscribe.insert("homie/#");
+	test_client.expect_unsubscribe.insert("homie/#");
+	{
+		dummy_handler hdl;
+		master m(test_client);
+		m.set_event_handler(&hdl);
+		publish_test_device(test_client, "livedevice");
+		CHECK_CB(hdl, device_discovered);
+		m.load_cache(path);
+		CHECK_CB(hdl, device_discovered);
+		ASSERT_EQ(3, m.get_discovered_devices().size());
+
+		auto dev = m.get_discovered_device("cacheddevice");
+		ASSERT_NE(dev, nullptr);
+		ASSERT_EQ(dev->get_state(), device_state::ready);
+		ASSERT_EQ(dev->get_name(), "Testdevice");
+		ASSERT_EQ(dev->get_stats_interval().count(), 60);
+		ASSERT_EQ(dev->get_nodes().size(), 2);
+		auto node = dev->get_node("testnode");
+		ASSERT_EQ(node->get_type(), "light");
+		auto prop = node->get_property("intensity");
+		ASSERT_EQ(prop->get_value(), "100");
+		ASSERT_EQ(prop->get_unit(), "%");
+		ASSERT_EQ(prop->get_datatype(), datatype::integer);
+		auto arr = dev->get_node("arraynode");
+		ASSERT_TRUE(arr->is_array());
+		ASSERT_EQ(arr->array_range().first, 0);
+		ASSERT_EQ(arr->array_range().second, 1);
+		ASSERT_EQ(arr->get_name(0), "First");
+		ASSERT_EQ(arr->get_property("on")->get_value(0), "true");
+		ASSERT_EQ(arr->get_property("on")->get_value(1), "false");
+
+		// Live update confirms the device, the other one is dropped
+		test_client.handler->on_message("homie/cacheddevice/testnode/intensity", "50");
+		CHECK_CB(hdl, property_val_changed);
+		ASSERT_EQ(prop->get_value(), "50");
+		m.load_cache(path);
+		ASSERT_EQ(prop->get_value(), "50");
+		m.drop_unconfirmed_devices();
+		ASSERT_EQ(2, m.get_discovered_devices().size());
+		ASSERT_EQ(m.get_discovered_device("gonedevice"), nullptr);
+	}
+	std::remove(path.c_str());
+	ASSERT_TRUE(test_client.steps.empty());
+	ASSERT_TRUE(test_client.expect_subscribe.empty());
+	ASSERT_TRUE(test_client.expect_unsubscribe.empty());
+}
+
+TEST(MasterTest, SecondaryIndexes) {
+	test_mqtt_client test_client;
+	test_client.expect_subscribe.insert("homie/#");
+	test_client.expect_unsubscribe.insert("homie/#");
+	{
+		master m(test_client);
+		publish_test_device(test_client, "dev1");
+		publish_test_device(test_client, "dev2");
+		test_client.handler->on_message("homie/dev3/$state", "init");
+
+		ASSERT_EQ(m.get_devices_by_state(device_state::ready).size(), 2);
+		ASSERT_EQ(m.get_devices_by_state(device_state::init).size(), 1);
+		ASSERT_EQ((*m.get_devices_by_state(device_state::init).begin())->get_id(), "dev3");
+		ASSERT_TRUE(m.get_devices_by_state(device_state::alert).empty());
+
+		auto lights = m.get_nodes_by_type("light");
+		ASSERT_EQ(lights.size(), 2);
+		for (auto& n : lights) ASSERT_EQ(n->get_id(), "testnode");
+		ASSERT_EQ(m.get_nodes_by_type("switch").size(), 2);
+
+		ASSERT_EQ(m.get_properties_by_unit("%").size(), 2);
+		ASSERT_EQ(m.get_properties_by_settable(true).size(), 2);
+		ASSERT_EQ(m.get_properties_by_settable(false).size(), 2);
+		ASSERT_EQ(m.get_properties_by_datatype(datatype::integer).size(), 2);
+		ASSERT_EQ(m.get_properties_by_datatype(datatype::boolean).size(), 2);
+		ASSERT_TRUE(m.get_properties_by_datatype(datatype::number).empty());
+
+		// Incremental updates
+		test_client.handler->on_message("homie/dev1/$state", "alert");
+		ASSERT_EQ(m.get_devices_by_state(device_state::ready).size(), 1);
+		ASSERT_EQ((*m.get_devices_by_state(device_state::alert).begin())->get_id(), "dev1");
+		test_client.handler->on_message("homie/dev1/testnode/$type", "dimmer");
+		ASSERT_EQ(m.get_nodes_by_type("light").size(), 1);
+		ASSERT_EQ(m.get_nodes_by_type("dimmer").size(), 1);
+		test_client.handler->on_message("homie/dev2/testnode/intensity/$unit", "Cel");
+		test_client.handler->on_message("homie/dev2/testnode/intensity/$datatype", "float");
+		test_client.handler->on_message("homie/dev2/testnode/intensity/$settable", "false");
+		ASSERT_EQ(m.get_properties_by_unit("%").size(), 1);
+		ASSERT_EQ((*m.get_properties_by_unit("Cel").begin())->get_node()->get_device()->get_id(), "dev2");
+		ASSERT_EQ(m.get_properties_by_datatype(datatype::number).size(), 1);
+		ASSERT_EQ(m.get_properties_by_settable(true).size(), 1);
+
+		// New properties start with the defaults
+		test_client.handler->on_message("homie/dev3/node/prop", "1");
+		ASSERT_EQ(m.get_properties_by_datatype(datatype::string).size(), 1);
+		ASSERT_EQ(m.get_nodes_by_type("").size(), 1);
+	}
+	ASSERT_TRUE(test_client.expect_subscribe.empty());
+	ASSERT_TRUE(test_client.expect_unsubscribe.empty());
+}
+
+TEST(MasterTest, DiscoveryFilter) {
+	test_mqtt_client test_client;
+	test_client.expect_subscribe.insert("homie/#");
+	{
+		master m(test_client);
+		publish_test_device(test_client, "dev1");
+		publish_test_device(test_client, "other");
+
+		// Allowlist narrows subscriptions
+		discovery_filter filter;
+		filter.device_ids = { "dev1", "dev2" };
+		test_client.expect_subscribe.insert("homie/dev1/#");
+		test_client.expect_subscribe.insert("homie/dev2/#");
+		test_client.expect_subscribe.insert("homie/$broadcast/#");
+		test_client.expect_unsubscribe.insert("homie/#");
+		m.set_discovery_filter(filter);
+		ASSERT_TRUE(test_client.expect_subscribe.empty());
+		ASSERT_TRUE(test_client.expect_unsubscribe.empty());
+		ASSERT_EQ(m.get_discovered_devices().size(), 1);
+		ASSERT_EQ(m.get_discovered_device("other"), nullptr);
+
+		publish_test_device(test_client, "dev2");
+		publish_test_device(test_client, "dev3");
+		ASSERT_EQ(m.get_discovered_devices().size(), 2);
+		ASSERT_EQ(m.get_discovered_device("dev3"), nullptr);
+
+		// Patterns need a wildcard subscription, node types are filtered locally
+		filter.device_ids.clear();
+		filter.device_patterns = { "dev?", "sensor-*" };
+		filter.node_types = { "light" };
+		test_client.expect_subscribe.insert("homie/#");
+		test_client.expect_unsubscribe.insert("homie/dev1/#");
+		test_client.expect_unsubscribe.insert("homie/dev2/#");
+		test_client.expect_unsubscribe.insert("homie/$broadcast/#");
+		m.set_discovery_filter(filter);
+		ASSERT_TRUE(test_client.expect_subscribe.empty());
+		ASSERT_TRUE(test_client.expect_unsubscribe.empty());
+		ASSERT_EQ(m.get_discovered_device("dev1")->get_nodes().size(), 1);
+		ASSERT_EQ(m.get_nodes_by_type("switch").size(), 0);
+
+		publish_test_device(test_client, "sensor-1");
+		publish_test_device(test_client, "sensor1");
+		ASSERT_NE(m.get_discovered_device("sensor-1"), nullptr);
+		ASSERT_EQ(m.get_discovered_device("sensor1"), nullptr);
+		auto dev = m.get_discovered_device("sensor-1");
+		ASSERT_EQ(dev->get_nodes().size(), 1);
+		ASSERT_EQ(dev->get_node("arraynode"), nullptr);
+		test_client.handler->on_message("homie/sensor-1/arraynode_1/on", "true");
+		ASSERT_EQ(dev->get_node("arraynode"), nullptr);
+
+		// Changing the type brings the node back
+		test_client.handler->on_message("homie/sensor-1/arraynode/$type", "light");
+		test_client.handler->on_message("homie/sensor-1/arraynode_1/on", "true");
+		ASSERT_EQ(dev->get_node("arraynode")->get_property("on")->get_value(1), "true");
+		test_client.expect_unsubscribe.insert("homie/#");
+	}
+	ASSERT_TRUE(test_client.expect_subscribe.empty());
+	ASSERT_TRUE(test_client.expect_unsubscribe.empty());
+}
+
+TEST(MasterTest, LazyDiscovery) {
+	struct discovery_handler : dummy_handler {
+		std::vector<std::string> discovered;
+		virtual void on_device_discovered(device_ptr dev) override { discovered.push_back(dev->get_id()); }
+	};
+	test_mqtt_client test_client;
+	test_client.expect_subscribe.insert("homie/#");
+	{
+		discovery_handler hdl;
+		master m(test_client);
+		m.set_event_handler(&hdl);
+		test_client.expect_subscribe.insert("homie/+/$state");
+		test_client.expect_subscribe.insert("homie/$broadcast/#");
+		test_client.expect_unsubscribe.insert("homie/#");
+		m.set_discovery_mode(discovery_mode::lazy);
+		ASSERT_TRUE(test_client.expect_subscribe.empty());
+		ASSERT_TRUE(test_client.expect_unsubscribe.empty());
+
+		publish_test_device(test_client, "dev1");
+		publish_test_device(test_client, "dev2");
+		ASSERT_TRUE(m.get_discovered_devices().empty());
+		ASSERT_EQ(m.get_device_states().size(), 2);
+		ASSERT_EQ(m.get_device_states().at("dev1"), device_state::ready);
+		ASSERT_EQ(m.get_discovered_device("dev3"), nullptr);
+
+		// Materialize on access
+		test_client.expect_subscribe.insert("homie/dev1/#");
+		auto dev = m.get_discovered_device("dev1");
+		ASSERT_TRUE(test_client.expect_subscribe.empty());
+		ASSERT_NE(dev, nullptr);
+		// Not discovered before the retained subtree (and $state) arrived
+		ASSERT_EQ(dev->get_state(), device_state::init);
+		ASSERT_TRUE(dev->get_nodes().empty());
+		ASSERT_TRUE(hdl.discovered.empty());
+		publish_test_device(test_client, "dev1");
+		publish_test_device(test_client, "dev2");
+		ASSERT_EQ(dev->get_nodes().size(), 2);
+		ASSERT_EQ(dev->get_state(), device_state::ready);
+		ASSERT_EQ(std::vector<std::string>({ "dev1" }), hdl.discovered);
+		ASSERT_EQ(m.get_discovered_devices().size(), 1);
+		ASSERT_EQ(m.get_discovered_device("dev1"), dev);
+
+		// Idle subtrees are evicted, interest keeps them
+		test_client.expect_subscribe.insert("homie/dev2/#");
+		ASSERT_NE(m.register_interest("dev2"), nullptr);
+		m.tick(master::clock::now());
+		ASSERT_EQ(m.get_discovered_devices().size(), 2);
+		test_client.expect_unsubscribe.insert("homie/dev1/#");
+		m.tick(master::clock::now() + std::chrono::hours(1));
+		ASSERT_TRUE(test_client.expect_unsubscribe.empty());
+		ASSERT_EQ(m.get_discovered_devices().size(), 1);
+		ASSERT_EQ(m.get_device_states().size(), 2);
+
+		m.release_interest("dev2");
+		test_client.expect_unsubscribe.insert("homie/dev2/#");
+		m.tick(master::clock::now() + std::chrono::hours(1));
+		ASSERT_TRUE(m.get_discovered_devices().empty());
+
+		test_client.handler->on_message("homie/dev2/$state", "lost");
+		ASSERT_EQ(m.get_device_states().at("dev2"), device_state::lost);
+		test_client.expect_unsubscribe.insert("homie/+/$state");
+		test_client.expect_unsubscribe.insert("homie/$broadcast/#");
+	}
+	ASSERT_TRUE(test_client.expect_subscribe.empty());
+	ASSERT_TRUE(test_client.expect_unsubscribe.empty());
+}
+
+TEST(MasterTest, Eviction) {
+	struct removal_handler : dummy_handler {
+		std::vector<std::string> removed;
+		virtual void on_device_removed(device_ptr dev) override { removed.push_back(dev->get_id()); }
+	};
+	test_mqtt_client test_client;
+	test_client.expect_subscribe.insert("homie/#");
+	test_client.expect_unsubscribe.insert("homie/#");
+	{
+		removal_handler hdl;
+		master m(test_client);
+		m.set_event_handler(&hdl);
+		eviction_policy policy;
+		policy.offline_ttl = std::chrono::hours(1);
+		policy.init_ttl = std::chrono::minutes(10);
+		m.set_eviction_policy(policy);
+
+		publish_test_device(test_client, "dev1");
+		publish_test_device(test_client, "dev2");
+		test_client.handler->on_message("homie/dev2/$state", "lost");
+		test_client.handler->on_message("homie/junk/foo/bar", "baz");
+		ASSERT_EQ(m.get_discovered_devices().size(), 3);
+
+		auto now = master::clock::now();
+		m.tick(now);
+		ASSERT_EQ(m.get_discovered_devices().size(), 3);
+		m.tick(now + std::chrono::minutes(30));
+		ASSERT_EQ(hdl.removed, std::vector<std::string>({ "junk" }));
+		m.tick(now + std::chrono::hours(2));
+		ASSERT_EQ(hdl.removed, std::vector<std::string>({ "junk", "dev2" }));
+		ASSERT_EQ(m.get_devices_by_state(device_state::lost).size(), 0);
+		ASSERT_NE(m.get_discovered_device("dev1"), nullptr);
+
+		// LRU limit
+		hdl.removed.clear();
+		policy.max_devices = 2;
+		m.set_eviction_policy(policy);
+		publish_test_device(test_client, "dev3");
+		ASSERT_TRUE(hdl.removed.empty());
+		publish_test_device(test_client, "dev4");
+		ASSERT_EQ(hdl.removed, std::vector<std::string>({ "dev1" }));
+		test_client.handler->on_message("homie/dev3/testnode/intensity", "10");
+		publish_test_device(test_client, "dev5");
+		ASSERT_EQ(hdl.removed, std::vector<std::string>({ "dev1", "dev4" }));
+		ASSERT_EQ(m.get_discovered_devices().size(), 2);
+		ASSERT_NE(m.get_discovered_device("dev3"), nullptr);
+		ASSERT_NE(m.get_discovered_device("dev5"), nullptr);
+
+		policy.max_devices = 1;
+		m.set_eviction_policy(policy);
+		ASSERT_EQ(hdl.removed.back(), "dev3");
+	}
+	ASSERT_TRUE(test_client.expect_subscribe.empty());
+	ASSERT_TRUE(test_client.expect_unsubscribe.empty());
+}
+
+TEST(MasterTest, EvictionKeepsInterest) {
+	struct removal_handler : dummy_handler {
+		std::vector<std::string> removed;
+		virtual void on_device_removed(device_ptr dev) override { removed.push_back(dev->get_id()); }
+	};
+	test_mqtt_client test_client;
+	test_client.expect_subscribe.insert("homie/#");
+	{
+		removal_handler hdl;
+		master m(test_client);
+		m.set_event_handler(&hdl);
+		test_client.expect_subscribe.insert("homie/+/$state");
+		test_client.expect_subscribe.insert("homie/$broadcast/#");
+		test_client.expect_unsubscribe.insert("homie/#");
+		m.set_discovery_mode(discovery_mode::lazy);
+		eviction_policy policy;
+		policy.offline_ttl = std::chrono::hours(1);
+		policy.max_devices = 1;
+		m.set_eviction_policy(policy);
+		publish_test_device(test_client, "dev1");
+		publish_test_device(test_client, "dev2");
+		publish_test_device(test_client, "dev3");
+
+		test_client.expect_subscribe.insert("homie/dev1/#");
+		ASSERT_NE(m.register_interest("dev1"), nullptr);
+		ASSERT_NE(m.register_interest("dev1"), nullptr);
+		publish_test_device(test_client, "dev1");
+		test_client.handler->on_message("homie/dev1/$state", "lost");
+
+		// The LRU limit skips dev1 and evicts the idle dev2 instead
+		test_client.expect_subscribe.insert("homie/dev2/#");
+		ASSERT_NE(m.get_discovered_device("dev2"), nullptr);
+		ASSERT_TRUE(hdl.removed.empty());
+		test_client.expect_subscribe.insert("homie/dev3/#");
+		test_client.expect_unsubscribe.insert("homie/dev2/#");
+		ASSERT_NE(m.get_discovered_device("dev3"), nullptr);
+		ASSERT_EQ(hdl.removed, std::vector<std::string>({ "dev2" }));
+		ASSERT_NE(m.get_discovered_device("dev1"), nullptr);
+
+		// Materializing again does not drop the count, one interest is still held
+		ASSERT_NE(m.get_discovered_device("dev1"), nullptr);
+		m.release_interest("dev1");
+		test_client.expect_unsubscribe.insert("homie/dev3/#");
+		m.tick(master::clock::now() + std::chrono::hours(2));
+		ASSERT_EQ(hdl.removed, std::vector<std::string>({ "dev2", "dev3" }));
+
+		m.release_interest("dev1");
+		test_client.expect_unsubscribe.insert("homie/dev1/#");
+		m.tick(master::clock::now() + std::chrono::hours(2));
+		ASSERT_EQ(hdl.removed, std::vector<std::string>({ "dev2", "dev3", "dev1" }));
+		ASSERT_TRUE(m.get_discovered_devices().empty());
+		test_client.expect_unsubscribe.insert("homie/+/$state");
+		test_client.expect_unsubscribe.insert("homie/$broadcast/#");
+	}
+	ASSERT_TRUE(test_client.expect_subscribe.empty());
+	ASSERT_TRUE(test_client.expect_unsubscribe.empty());
+}
+
+TEST(MasterTest, ResourceLimits) {
+	test_mqtt_client test_client;
+	test_client.expect_subscribe.insert("homie/#");
+	test_client.expect_unsubscribe.insert("homie/#");
+	{
+		master m(test_client);
+		master_limits limits;
+		limits.max_devices = 2;
+		limits.max_nodes_per_device = 2;
+		limits.max_properties_per_node = 1;
+		limits.max_attribute_bytes = 24;
+		limits.max_array_span = 4;
+		m.set_limits(limits);
+
+		publish_test_device(test_client, "dev1");
+		publish_test_device(test_client, "dev2");
+		publish_test_device(test_client, "dev3");
+		ASSERT_EQ(m.get_discovered_devices().size(), 2);
+		ASSERT_EQ(m.get_rejection_count(rejection_reason::device_limit), 22);
+
+		auto dev = m.get_discovered_device("dev1");
+		test_client.handler->on_message("homie/dev1/random/prop", "1");
+		ASSERT_EQ(m.get_rejection_count(rejection_reason::node_limit), 1);
+		test_client.handler->on_message("homie/dev1/testnode/other", "1");
+		ASSERT_EQ(m.get_rejection_count(rejection_reason::property_limit), 1);
+		ASSERT_EQ(dev->get_nodes().size(), 2);
+		ASSERT_EQ(dev->get_node("testnode")->get_properties().size(), 1);
+
+		test_client.handler->on_message("homie/dev1/$name", std::string(25, 'x'));
+		ASSERT_EQ(m.get_rejection_count(rejection_reason::attribute_size), 1);
+		ASSERT_EQ(dev->get_name(), "Testdevice");
+		// Values are not attributes
+		test_client.handler->on_message("homie/dev1/testnode/intensity", std::string(25, '1'));
+		ASSERT_EQ(dev->get_node("testnode")->get_property("intensity")->get_value(), std::string(25, '1'));
+
+		test_client.handler->on_message("homie/dev1/arraynode/$array", "0-1000");
+		test_client.handler->on_message("homie/dev1/arraynode_2/on", "true");
+		ASSERT_EQ(m.get_rejection_count(rejection_reason::array_span), 2);
+		ASSERT_EQ(dev->get_node("arraynode")->array_range().second, 1);
+		test_client.handler->on_message("homie/dev1/arraynode_x/on", "true");
+		test_client.handler->on_message("homie/dev2/arraynode_99999999999999999999/on", "true");
+		ASSERT_EQ(m.get_rejection_count(rejection_reason::malformed), 2);
+		// A span that does not fit into int64_t must not wrap around the limit
+		test_client.handler->on_message("homie/dev2/arraynode/$array", "0-9223372036854775807");
+		ASSERT_EQ(m.get_rejection_count(rejection_reason::array_span), 3);
+		test_client.handler->on_message("homie/dev2/arraynode_5/on", "true");
+		ASSERT_EQ(m.get_rejection_count(rejection_reason::array_span), 4);
+		ASSERT_EQ(m.get_discovered_device("dev2")->get_node("arraynode")->array_range().second, 1);
+	}
+	ASSERT_TRUE(test_client.expect_subscribe.empty());
+	ASSERT_TRUE(test_client.expect_unsubscribe.empty());
+}
+
+TEST(MasterTest, ResourceLimitsLazy) {
+	test_mqtt_client test_client;
+	test_client.expect_subscribe.insert("homie/#");
+	{
+		master m(test_client);
+		master_limits limits;
+		limits.max_devices = 2;
+		m.set_limits(limits);
+		test_client.expect_subscribe.insert("homie/+/$state");
+		test_client.expect_subscribe.insert("homie/$broadcast/#");
+		test_client.expect_unsubscribe.insert("homie/#");
+		m.set_discovery_mode(discovery_mode::lazy);
+
+		// The registry is bounded, not only the materialized devices
+		for (int i = 0; i < 100; i++) test_client.handler->on_message("homie/flood" + std::to_string(i) + "/$state", "ready");
+		ASSERT_EQ(m.get_device_states().size(), 2);
+		ASSERT_EQ(m.get_rejection_count(rejection_reason::device_limit), 98);
+
+		// Materialized devices at the limit do not block state updates of the registry
+		test_client.expect_subscribe.insert("homie/flood0/#");
+		test_client.expect_subscribe.insert("homie/flood1/#");
+		ASSERT_NE(m.register_interest("flood0"), nullptr);
+		ASSERT_NE(m.register_interest("flood1"), nullptr);
+		test_client.handler->on_message("homie/flood1/$state", "lost");
+		ASSERT_EQ(m.get_device_states().at("flood1"), device_state::lost);
+		ASSERT_EQ(m.get_discovered_device("flood1")->get_state(), device_state::lost);
+		ASSERT_EQ(m.get_rejection_count(rejection_reason::device_limit), 98);
+		test_client.expect_unsubscribe.insert("homie/flood0/#");
+		test_client.expect_unsubscribe.insert("homie/flood1/#");
+		test_client.expect_unsubscribe.insert("homie/+/$state");
+		test_client.expect_unsubscribe.insert("homie/$broadcast/#");
+	}
+	ASSERT_TRUE(test_client.expect_subscribe.empty());
+	ASSERT_TRUE(test_client.expect_unsubscribe.empty());
+}
+
+TEST(MasterTest, Handles) {
+	struct handle_handler : dummy_handler {
+		std::vector<std::pair<property_handle, std::string>> values;
+		std::vector<std::pair<property_handle, int64_t>> indexed;
+		virtual void on_value_changed(property_handle prop, const std::string& value) override { values.push_back({ prop, value }); }
+		virtual void on_value_changed(property_handle prop, int64_t idx, const std::string& value) override { indexed.push_back({ prop, idx }); }
+	};
+	test_mqtt_client test_client;
+	test_client.expect_subscribe.insert("homie/#");
+	test_client.expect_unsubscribe.insert("homie/#");
+	{
+		handle_handler hdl;
+		master m(test_client);
+		m.set_event_handler(&hdl);
+		publish_test_device(test_client, "dev1");
+		publish_test_device(test_client, "dev2");
+
+		auto dev = m.find_device("dev1");
+		ASSERT_TRUE(dev.valid());
+		ASSERT_FALSE(m.find_device("dev3").valid());
+		auto node = m.find_node(dev, "testnode");
+		ASSERT_TRUE(m.is_valid(node));
+		ASSERT_FALSE(m.find_node(dev, "missing").valid());
+		auto prop = m.find_property(node, "intensity");
+		ASSERT_EQ(prop, m.find_property("dev1", "testnode", "intensity"));
+		ASSERT_NE(prop, m.find_property("dev2", "testnode", "intensity"));
+		ASSERT_EQ(m.get_handle(m.get_discovered_device("dev1")->get_node("testnode")->get_property("intensity")), prop);
+		ASSERT_EQ(m.get_device(dev)->get_id(), "dev1");
+		ASSERT_EQ(m.get_property(prop)->get_id(), "intensity");
+		ASSERT_EQ(m.value(prop), "100");
+		ASSERT_EQ(m.attribute(prop, "unit"), "%");
+
+		auto on = m.find_property("dev1", "arraynode", "on");
+		ASSERT_EQ(m.value(on, 0), "true");
+		ASSERT_EQ(m.value(on, 1), "false");
+		ASSERT_EQ(m.value(on, 2), "");
+
+		hdl.values.clear();
+		test_client.handler->on_message("homie/dev1/testnode/intensity", "42");
+		test_client.handler->on_message("homie/dev1/arraynode_1/on", "true");
+		ASSERT_EQ(m.value(prop), "42");
+		ASSERT_EQ(hdl.values.size(), 1);
+		ASSERT_EQ(hdl.values[0].first, prop);
+		ASSERT_EQ(hdl.values[0].second, "42");
+		ASSERT_EQ(hdl.indexed.back().first, on);
+		ASSERT_EQ(hdl.indexed.back().second, 1);
+
+		// Handles of removed devices become stale and are not reused
+		test_client.handler->on_message("homie/dev2/testnode/intensity", "1");
+		eviction_policy policy;
+		policy.max_devices = 1;
+		m.set_eviction_policy(policy);
+		ASSERT_FALSE(m.is_valid(dev));
+		ASSERT_FALSE(m.is_valid(node));
+		ASSERT_FALSE(m.is_valid(prop));
+		ASSERT_EQ(m.get_property(prop), nullptr);
+		ASSERT_EQ(m.value(prop), "");
+		policy.max_devices = 0;
+		m.set_eviction_policy(policy);
+		publish_test_device(test_client, "dev1");
+		ASSERT_FALSE(m.is_valid(prop));
+		auto reused = m.find_property("dev1", "testnode", "intensity");
+		ASSERT_TRUE(m.is_valid(reused));
+		ASSERT_NE(reused, prop);
+	}
+	ASSERT_TRUE(test_client.expect_subscribe.empty());
+	ASSERT_TRUE(test_client.expect_unsubscribe.empty());
+}
+
+TEST(MasterTest, ColumnStore) {
+	test_mqtt_client test_client;
+	test_client.expect_subscribe.insert("homie/#");
+	test_client.expect_unsubscribe.insert("homie/#");
+	{
+		master m(test_client);
+		publish_test_device(test_client, "dev1");
+		publish_test_device(test_client, "dev2");
+		test_client.handler->on_message("homie/dev2/testnode/intensity", "20");
+		ASSERT_EQ(m.get_column("light", "intensity"), nullptr);
+
+		// Existing values are loaded when enabled
+		m.set_column_store_enabled(true);
+		auto col = m.get_column("light", "intensity");
+		ASSERT_NE(col, nullptr);
+		ASSERT_EQ(col->get_type(), datatype::integer);
+		ASSERT_EQ(col->size(), 2);
+		auto stats = col->aggregate();
+		ASSERT_EQ(stats.count, 2);
+		ASSERT_EQ(stats.sum, 120);
+		ASSERT_EQ(stats.min, 20);
+		ASSERT_EQ(stats.max, 100);
+		ASSERT_EQ(stats.mean(), 60);
+		// Booleans are not stored
+		ASSERT_EQ(m.get_column("switch", "on"), nullptr);
+
+		publish_test_device(test_client, "dev3");
+		test_client.handler->on_message("homie/dev3/testnode/intensity", "55");
+		ASSERT_EQ(col->size(), 3);
+		ASSERT_EQ(col->count(compare_op::greater, 50), 2);
+		ASSERT_EQ(col->count(compare_op::greater, 55), 1);
+		ASSERT_EQ(col->count(compare_op::greater_equal, 54.5), 2);
+		ASSERT_EQ(col->count(compare_op::less, 55), 1);
+		ASSERT_EQ(col->count(compare_op::less_equal, 55), 2);
+		ASSERT_EQ(col->count(compare_op::equal, 55), 1);
+		ASSERT_EQ(col->count(compare_op::equal, 55.5), 0);
+		auto rows = col->select(compare_op::less, 50);
+		ASSERT_EQ(rows.size(), 1);
+		ASSERT_EQ(rows[0].prop, m.find_property("dev2", "testnode", "intensity"));
+		ASSERT_FALSE(rows[0].is_indexed());
+
+		// Unparsable values leave the column, removed devices as well
+		test_client.handler->on_message("homie/dev1/testnode/intensity", "bright");
+		ASSERT_EQ(col->size(), 2);
+		ASSERT_EQ(col->aggregate().max, 55);
+		ASSERT_EQ(m.get_column_store().rejected_values(), 1);
+		test_client.handler->on_message("homie/dev3/testnode/intensity", "55");
+		eviction_policy policy;
+		policy.max_devices = 1;
+		m.set_eviction_policy(policy);
+		ASSERT_EQ(col->size(), 1);
+		ASSERT_EQ(col->aggregate().sum, 55);
+		ASSERT_EQ(m.get_column_store().rows(), 1);
+
+		// Float columns, array nodes and datatype changes
+		policy.max_devices = 0;
+		m.set_eviction_policy(policy);
+		test_client.handler->on_message("homie/dev3/arraynode/$properties", "on,level");
+		test_client.handler->on_message("homie/dev3/arraynode/level/$datatype", "float");
+		test_client.handler->on_message("homie/dev3/arraynode_0/level", "1.5");
+		test_client.handler->on_message("homie/dev3/arraynode_1/level", "-2.25");
+		auto level = m.get_column("switch", "level");
+		ASSERT_NE(level, nullptr);
+		ASSERT_EQ(level->get_type(), datatype::number);
+		ASSERT_EQ(level->aggregate().sum, -0.75);
+		ASSERT_EQ(level->aggregate().min, -2.25);
+		ASSERT_EQ(level->count(compare_op::greater, 1.5), 0);
+		ASSERT_EQ(level->count(compare_op::less, 1.5), 1);
+		ASSERT_EQ(level->select(compare_op::greater, 0)[0].idx, 0);
+		test_client.handler->on_message("homie/dev3/arraynode/level/$datatype", "string");
+		ASSERT_EQ(level->size(), 0);
+
+		// The same property declared as float by another device gets a column of its own
+		publish_test_device(test_client, "dev4");
+		test_client.handler->on_message("homie/dev4/testnode/intensity/$datatype", "float");
+		test_client.handler->on_message("homie/dev4/testnode/intensity", "12.5");
+		auto real = m.get_column("light", "intensity", datatype::number);
+		ASSERT_NE(real, nullptr);
+		ASSERT_EQ(real->size(), 1);
+		ASSERT_EQ(real->aggregate().sum, 12.5);
+		ASSERT_EQ(m.get_column("light", "intensity"), col);
+		ASSERT_EQ(col->size(), 1);
+		ASSERT_EQ(m.get_column_store().rejected_values(), 1);
+
+		m.set_column_store_enabled(false);
+		ASSERT_EQ(m.get_column("light", "intensity"), nullptr);
+	}
+	ASSERT_TRUE(test_client.expect_subscribe.empty());
+	ASSERT_TRUE(test_client.expect_unsubscribe.empty());
+}
+
+// Run with --gtest_also_run_disabled_tests
+TEST(MasterTest, DISABLED_ColumnStoreThroughput) {
+	test_mqtt_client test_client;
+	test_client.expect_subscribe.insert("homie/#");
+	test_client.expect_unsubscribe.insert("homie/#");
+	master m(test_client);
+	for (int i = 0; i < 10000; i++) {
+		auto id = "device" + std::to_string(i);
+		publish_test_device(test_client, id);
+		test_client.handler->on_message("homie/" + id + "/testnode/intensity", std::to_string(i % 101));
+	}
+	m.set_column_store_enabled(true);
+
+	const int rounds = 100;
+	double naive_sum = 0;
+	size_t naive_count = 0;
+	auto start = std::chrono::steady_clock::now();
+	for (int r = 0; r < rounds; r++) {
+		for (auto& dev : m.get_discovered_devices()) {
+			auto node = dev->get_node("testnode");
+			if (node == nullptr || node->get_type() != "light") continue;
+			auto prop = node->get_property("intensity");
+			if (prop == nullptr) continue;
+			auto v = std::stod(prop->get_value());
+			naive_sum += v;
+			if (v > 50) naive_count++;
+		}
+	}
+	auto naive = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+	double column_sum = 0;
+	size_t column_count = 0;
+	start = std::chrono::steady_clock::now();
+	for (int r = 0; r < rounds; r++) {
+		auto col = m.get_column("light", "intensity");
+		column_sum += col->aggregate().sum;
+		column_count += col->count(compare_op::greater, 50);
+	}
+	auto columnar = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+	ASSERT_EQ(naive_sum, column_sum);
+	ASSERT_EQ(naive_count, column_count);
+	std::cout << "naive walk: " << naive / rounds * 1e6 << " us/query" << std::endl;
+	std::cout << "columnar:   " << columnar / rounds * 1e6 << " us/query" << std::endl;
+}
+
+TEST(MasterTest, FleetAggregates) {
+	struct threshold_handler : dummy_handler {
+		std::vector<std::pair<aggregate_id, bool>> crossed;
+		virtual void on_aggregate_threshold(aggregate_id id, aggregate_field field, double threshold, bool above) override { crossed.push_back({ id, above }); }
+	};
+	test_mqtt_client test_client;
+	test_client.expect_subscribe.insert("homie/#");
+	test_client.expect_unsubscribe.insert("homie/#");
+	{
+		threshold_handler hdl;
+		master m(test_client);
+		m.set_event_handler(&hdl);
+		publish_test_device(test_client, "dev1");
+
+		auto intensity = m.add_aggregate("light", "intensity");
+		auto ready = m.add_state_aggregate(device_state::ready);
+		auto agg = m.get_aggregate(intensity);
+		ASSERT_NE(agg, nullptr);
+		ASSERT_EQ(agg->count(), 1);
+		ASSERT_EQ(agg->sum(), 100);
+		ASSERT_EQ(m.get_aggregate(ready)->count(), 1);
+		m.add_aggregate_threshold(intensity, aggregate_field::mean, 50);
+		m.add_aggregate_threshold(ready, aggregate_field::count, 1);
+
+		publish_test_device(test_client, "dev2");
+		test_client.handler->on_message("homie/dev2/testnode/intensity", "20");
+		ASSERT_EQ(agg->count(), 2);
+		ASSERT_EQ(agg->sum(), 120);
+		ASSERT_EQ(agg->min(), 20);
+		ASSERT_EQ(agg->max(), 100);
+		ASSERT_EQ(m.get_device_count(device_state::ready), 2);
+		ASSERT_EQ(m.get_aggregate(ready)->count(), 2);
+		ASSERT_EQ(hdl.crossed, (std::vector<std::pair<aggregate_id, bool>>{ { ready, true } }));
+
+		// Mean drops to 30
+		hdl.crossed.clear();
+		test_client.handler->on_message("homie/dev1/testnode/intensity", "40");
+		ASSERT_EQ(agg->max(), 40);
+		ASSERT_EQ(agg->mean(), 30);
+		ASSERT_EQ(hdl.crossed, (std::vector<std::pair<aggregate_id, bool>>{ { intensity, false } }));
+
+		// State changes and node type changes are tracked
+		hdl.crossed.clear();
+		test_client.handler->on_message("homie/dev2/$state", "lost");
+		ASSERT_EQ(m.get_device_count(device_state::ready), 1);
+		ASSERT_EQ(m.get_device_count(device_state::lost), 1);
+		ASSERT_EQ(m.get_aggregate(ready)->count(), 1);
+		test_client.handler->on_message("homie/dev2/testnode/$type", "dimmer");
+		ASSERT_EQ(agg->count(), 1);
+		ASSERT_EQ(agg->sum(), 40);
+		ASSERT_EQ(hdl.crossed, (std::vector<std::pair<aggregate_id, bool>>{ { ready, false } }));
+
+		// Non numeric values and removed devices leave the aggregate
+		test_client.handler->on_message("homie/dev1/testnode/intensity", "off");
+		ASSERT_EQ(agg->count(), 0);
+		test_client.handler->on_message("homie/dev1/testnode/intensity", "70");
+		ASSERT_EQ(agg->count(), 1);
+		eviction_policy policy;
+		policy.max_devices = 1;
+		m.set_eviction_policy(policy);
+		ASSERT_EQ(agg->count(), 1);
+		ASSERT_EQ(m.get_device_count(device_state::lost), 0);
+
+		m.remove_aggregate(intensity);
+		ASSERT_EQ(m.get_aggregate(intensity), nullptr);
+		test_client.handler->on_message("homie/dev1/testnode/intensity", "10");
+	}
+	ASSERT_TRUE(test_client.expect_subscribe.empty());
+	ASSERT_TRUE(test_client.expect_unsubscribe.empty());
+}
+
+TEST(MasterTest, History) {
+	test_mqtt_client test_client;
+	test_client.expect_subscribe.insert("homie/#");
+	test_client.expect_unsubscribe.insert("homie/#");
+	{
+		master m(test_client);
+		history_policy policy;
+		policy.default_capacity = 2;
+		policy.datatype_capacity[datatype::integer] = 3;
+		policy.pattern_capacity.push_back({ "dev2/*", 0 });
+		m.set_history_policy(policy);
+		publish_test_device(test_client, "dev1");
+		publish_test_device(test_client, "dev2");
+
+		auto start = master::clock::now();
+		auto intensity = m.find_property("dev1", "testnode", "intensity");
+		for (int i = 1; i <= 5; i++)
+			test_client.handler->on_message("homie/dev1/testnode/intensity", std::to_string(i * 10));
+		test_client.handler->on_message("homie/dev1/testnode/intensity", "invalid");
+		auto end = master::clock::now();
+
+		// Only the last 3 samples are kept, the unparsable one is skipped
+		auto samples = m.get_history(intensity, master::clock::time_point::min(), master::clock::time_point::max());
+		ASSERT_EQ(samples.size(), 3);
+		ASSERT_EQ(samples[0].value, 30);
+		ASSERT_EQ(samples[2].value, 50);
+		ASSERT_TRUE(samples[0].time >= start);
+		ASSERT_TRUE(samples[2].time <= end);
+		ASSERT_TRUE(m.get_history(intensity, end + std::chrono::seconds(1), master::clock::time_point::max()).empty());
+		ASSERT_EQ(m.get_history(intensity, samples[1].time, samples[1].time).size(), samples[1].time == samples[2].time ? 2 : 1);
+
+		// Booleans use the default capacity and are stored as text
+		auto on = m.find_property("dev1", "arraynode", "on");
+		test_client.handler->on_message("homie/dev1/arraynode_1/on", "true");
+		auto text = m.get_text_history(on, master::clock::time_point::min(), master::clock::time_point::max(), 1);
+		ASSERT_EQ(text.size(), 2);
+		ASSERT_EQ(text[0].value, "false");
+		ASSERT_EQ(text[1].value, "true");
+		ASSERT_TRUE(m.get_history(on, master::clock::time_point::min(), master::clock::time_point::max(), 1).empty());
+
+		// Excluded by pattern
+		test_client.handler->on_message("homie/dev2/testnode/intensity", "1");
+		ASSERT_TRUE(m.get_history(m.find_property("dev2", "testnode", "intensity"), master::clock::time_point::min(), master::clock::time_point::max()).empty());
+
+		// dev1: intensity + 2 array indices
+		auto& store = m.get_history_store();
+		ASSERT_EQ(store.size(), 3);
+		ASSERT_EQ(store.reserved_memory(), history_ring<double>::reserved_bytes(3) + 2 * history_ring<std::string>::reserved_bytes(2));
+		ASSERT_GE(store.memory(), store.reserved_memory());
+
+		// Memory bound
+		policy.max_bytes = history_ring<double>::reserved_bytes(3);
+		m.set_history_policy(policy);
+		test_client.handler->on_message("homie/dev1/testnode/intensity", "1");
+		test_client.handler->on_message("homie/dev1/arraynode_0/on", "false");
+		ASSERT_EQ(store.size(), 1);
+		ASSERT_EQ(store.rejected_count(), 1);
+		ASSERT_LE(store.reserved_memory(), policy.max_bytes);
+		// A rejected buffer is counted once, not per message
+		for (int i = 0; i < 4; i++)
+			test_client.handler->on_message("homie/dev1/arraynode_0/on", i % 2 == 0 ? "true" : "false");
+		ASSERT_EQ(store.rejected_count(), 1);
+		ASSERT_EQ(store.size(), 1);
+
+		// Removed properties release their history
+		eviction_policy eviction;
+		eviction.max_devices = 1;
+		test_client.handler->on_message("homie/dev2/testnode/intensity", "2");
+		m.set_eviction_policy(eviction);
+		ASSERT_EQ(store.size(), 0);
+		ASSERT_EQ(store.reserved_memory(), 0);
+		ASSERT_TRUE(m.get_history(intensity, master::clock::time_point::min(), master::clock::time_point::max()).empty());
+	}
+	ASSERT_TRUE(test_client.expect_subscribe.empty());
+	ASSERT_TRUE(test_client.expect_unsubscribe.empty());
+}
+
+TEST(MasterTest, HistoryTextBound) {
+	test_mqtt_client test_client;
+	test_client.expect_subscribe.insert("homie/#");
+	test_client.expect_unsubscribe.insert("homie/#");
+	{
+		master m(test_client);
+		history_policy policy;
+		policy.default_capacity = 4;
+		policy.max_bytes = 1024;
+		m.set_history_policy(policy);
+		publish_test_device(test_client, "dev1");
+		test_client.handler->on_message("homie/dev1/testnode/intensity/$datatype", "string");
+
+		// Payloads count against the bound, samples which do not fit are dropped
+		auto& store = m.get_history_store();
+		for (int i = 0; i < 4; i++)
+			test_client.handler->on_message("homie/dev1/testnode/intensity", std::string(1024 * 1024, static_cast<char>('a' + i)));
+		ASSERT_LE(store.memory(), policy.max_bytes);
+		ASSERT_EQ(store.dropped_count(), 4);
+		test_client.handler->on_message("homie/dev1/testnode/intensity", "small");
+		auto text = m.get_text_history(m.find_property("dev1", "testnode", "intensity"), master::clock::time_point::min(), master::clock::time_point::max());
+		ASSERT_EQ(text.size(), 1);
+		ASSERT_EQ(text[0].value, "small");
+		ASSERT_LE(store.memory(), policy.max_bytes);
+		ASSERT_GT(store.memory(), store.reserved_memory());
+	}
+	ASSERT_TRUE(test_client.expect_subscribe.empty());
+	ASSERT_TRUE(test_client.expect_unsubscribe.empty());
+}
+
+TEST(MasterTest, DuplicateSuppression) {
+	struct counting_handler : dummy_handler {
+		size_t values = 0;
+		size_t devices = 0;
+		virtual void on_value_changed(property_handle prop, const std::string& value) override { values++; }
+		virtual void on_value_changed(property_handle prop, int64_t idx, const std::string& value) override { values++; }
+		virtual void on_device_changed(device_ptr dev, const std::string& attribute) override { devices++; }
+	};
+	test_mqtt_client test_client;
+	test_client.expect_subscribe.insert("homie/#");
+	test_client.expect_unsubscribe.insert("homie/#");
+	{
+		counting_handler hdl;
+		master m(test_client);
+		m.set_event_handler(&hdl);
+		ASSERT_TRUE(m.get_duplicate_suppression());
+		publish_test_device(test_client, "dev1");
+		ASSERT_EQ(m.get_suppressed_count(), 0);
+
+		// Republished after a reconnect
+		hdl.values = 0;
+		hdl.devices = 0;
+		publish_test_device(test_client, "dev1");
+		ASSERT_EQ(hdl.values, 0);
+		ASSERT_EQ(hdl.devices, 0);
+		ASSERT_EQ(m.get_suppressed_count(change_kind::property_value), 3);
+		// $state init and ready are real changes, $homie $name $nodes $stats/interval are not
+		ASSERT_EQ(m.get_suppressed_count(change_kind::device_attribute), 4);
+		ASSERT_EQ(m.get_suppressed_count(change_kind::node_attribute), 8);
+		ASSERT_EQ(m.get_suppressed_count(change_kind::property_attribute), 5);
+
+		test_client.handler->on_message("homie/dev1/testnode/intensity", "50");
+		test_client.handler->on_message("homie/dev1/testnode/intensity", "50");
+		ASSERT_EQ(hdl.values, 1);
+		ASSERT_EQ(m.get_suppressed_count(change_kind::property_value), 4);
+
+		m.set_duplicate_suppression(false);
+		test_client.handler->on_message("homie/dev1/testnode/intensity", "50");
+		test_client.handler->on_message("homie/dev1/arraynode_0/on", "true");
+		ASSERT_EQ(hdl.values, 3);
+		ASSERT_EQ(m.get_suppressed_count(), 21);
+	}
+	ASSERT_TRUE(test_client.expect_subscribe.empty());
+	ASSERT_TRUE(test_client.expect_unsubscribe.empty());
+}
+
+TEST(MasterTest, ValueFilters) {
+	struct filter_handler : dummy_handler {
+		std::vector<std::pair<filter_id, double>> reported;
+		std::vector<int64_t> indices;
+		master* m = nullptr;
+		bool remove = false;
+		std::vector<filter_id> remove_ids;
+		virtual void on_filtered_value(filter_id id, property_handle prop, double value) override {
+			reported.push_back({ id, value });
+			if (remove) {
+				for (auto f : remove_ids) m->remove_value_filter(f);
+			}
+		}
+		virtual void on_filtered_value(filter_id id, property_handle prop, int64_t idx, double value) override {
+			reported.push_back({ id, value });
+			indices.push_back(idx);
+		}
+	};
+	typedef std::vector<std::pair<filter_id, double>> reports;
+	test_mqtt_client test_client;
+	test_client.expect_subscribe.insert("homie/#");
+	test_client.expect_unsubscribe.insert("homie/#");
+	{
+		filter_handler hdl;
+		master m(test_client);
+		m.set_event_handler(&hdl);
+		hdl.m = &m;
+		auto deadband = m.add_value_filter(value_filter::deadband("dev1/testnode/intensity", 5));
+		publish_test_device(test_client, "dev1");
+		publish_test_device(test_client, "dev2");
+		// Bound to existing properties as well
+		auto threshold = m.add_value_filter(value_filter::threshold("", 80, "light"));
+		ASSERT_TRUE(hdl.reported.empty());
+
+		test_client.handler->on_message("homie/dev1/testnode/intensity", "97");
+		ASSERT_TRUE(hdl.reported.empty());
+		test_client.handler->on_message("homie/dev1/testnode/intensity", "94");
+		ASSERT_EQ(hdl.reported, (reports{ { deadband, 94 } }));
+		test_client.handler->on_message("homie/dev1/testnode/intensity", "80");
+		ASSERT_EQ(hdl.reported, (reports{ { deadband, 94 }, { deadband, 80 }, { threshold, 80 } }));
+		hdl.reported.clear();
+		test_client.handler->on_message("homie/dev2/testnode/intensity", "90");
+		test_client.handler->on_message("homie/dev2/testnode/intensity", "79.5");
+		test_client.handler->on_message("homie/dev2/testnode/intensity", "off");
+		test_client.handler->on_message("homie/dev2/testnode/intensity", "81");
+		ASSERT_EQ(hdl.reported, (reports{ { threshold, 79.5 }, { threshold, 81 } }));
+
+		// Node type changes recompile the filter list
+		hdl.reported.clear();
+		test_client.handler->on_message("homie/dev2/testnode/$type", "dimmer");
+		test_client.handler->on_message("homie/dev2/testnode/intensity", "10");
+		ASSERT_TRUE(hdl.reported.empty());
+
+		// Array nodes keep the state per index
+		auto on = m.add_value_filter(value_filter::threshold("*/arraynode/on", 0.5));
+		test_client.handler->on_message("homie/dev1/arraynode/on/$datatype", "integer");
+		test_client.handler->on_message("homie/dev1/arraynode_0/on", "0");
+		test_client.handler->on_message("homie/dev1/arraynode_1/on", "1");
+		test_client.handler->on_message("homie/dev1/arraynode_1/on", "0");
+		ASSERT_EQ(hdl.reported, (reports{ { on, 0 } }));
+		ASSERT_EQ(hdl.indices, std::vector<int64_t>({ 1 }));
+
+		m.remove_value_filter(deadband);
+		m.remove_value_filter(threshold);
+		hdl.reported.clear();
+		test_client.handler->on_message("homie/dev1/testnode/intensity", "0");
+		ASSERT_TRUE(hdl.reported.empty());
+
+		// Removing filters from within the callback, including one not reported yet
+		hdl.remove = true;
+		auto first = m.add_value_filter(value_filter::threshold("dev1/testnode/intensity", 50));
+		auto second = m.add_value_filter(value_filter::threshold("dev1/testnode/intensity", 50));
+		hdl.remove_ids = { first, second };
+		test_client.handler->on_message("homie/dev1/testnode/intensity", "40");
+		test_client.handler->on_message("homie/dev1/testnode/intensity", "60");
+		ASSERT_EQ(hdl.reported, (reports{ { first, 60 } }));
+		test_client.handler->on_message("homie/dev1/testnode/intensity", "30");
+		ASSERT_EQ(hdl.reported, (reports{ { first, 60 } }));
+	}
+	ASSERT_TRUE(test_client.expect_subscribe.empty());
+	ASSERT_TRUE(test_client.expect_unsubscribe.empty());
+}
+
+TEST(MasterTest, Watchers) {
+	typedef std::vector<std::pair<int64_t, std::string>> calls;
+	test_mqtt_client test_client;
+	test_client.expect_subscribe.insert("homie/#");
+	test_client.expect_unsubscribe.insert("homie/#");
+	{
+		master m(test_client);
+		publish_test_device(test_client, "dev1");
+		calls exact, any, none, array;
+		std::vector<std::string> devices;
+		auto w_exact = m.watch("dev1", "testnode", "intensity", [&](const property_ptr& p, int64_t idx, const std::string& v) { exact.push_back({ idx, v }); });
+		m.watch("*", "testnode", "*", [&](const property_ptr& p, int64_t idx, const std::string& v) {
+			any.push_back({ idx, v });
+			devices.push_back(p->get_node()->get_device()->get_id());
+		});
+		m.watch("dev*", "othernode", "*", [&](const property_ptr& p, int64_t idx, const std::string& v) { none.push_back({ idx, v }); });
+		m.watch("dev1", "arraynode", "on", [&](const property_ptr& p, int64_t idx, const std::string& v) { array.push_back({ idx, v }); });
+
+		test_client.handler->on_message("homie/dev1/testnode/intensity", "50");
+		ASSERT_EQ(exact, (calls{ { no_index, "50" } }));
+		ASSERT_EQ(any, (calls{ { no_index, "50" } }));
+		test_client.handler->on_message("homie/dev1/arraynode_1/on", "true");
+		test_client.handler->on_message("homie/dev1/arraynode_0/on", "false");
+		ASSERT_EQ(array, (calls{ { 1, "true" }, { 0, "false" } }));
+
+		// Bound to devices discovered after the watch call
+		publish_test_device(test_client, "dev2");
+		test_client.handler->on_message("homie/dev2/testnode/intensity", "20");
+		ASSERT_EQ(exact.size(), 1);
+		ASSERT_EQ(any.size(), 2);
+		ASSERT_EQ(devices, (std::vector<std::string>{ "dev1", "dev2" }));
+		ASSERT_TRUE(none.empty());
+
+		// Removing watchers from within a callback
+		watch_token self = 0;
+		int self_calls = 0;
+		self = m.watch("dev1", "testnode", "intensity", [&](const property_ptr&, int64_t, const std::string&) {
+			self_calls++;
+			m.unwatch(self);
+			m.unwatch(w_exact);
+		});
+		test_client.handler->on_message("homie/dev1/testnode/intensity", "60");
+		test_client.handler->on_message("homie/dev1/testnode/intensity", "70");
+		ASSERT_EQ(self_calls, 1);
+		ASSERT_EQ(exact.size(), 2);
+		ASSERT_EQ(any.size(), 4);
+		m.unwatch(12345);
+
+		// Properties removed and recreated while watched, unwatch only visits live bindings
+		int dev2_calls = 0;
+		auto w_dev2 = m.watch("dev2", "*", "*", [&](const property_ptr&, int64_t, const std::string&) { dev2_calls++; });
+		eviction_policy eviction;
+		eviction.offline_ttl = std::chrono::minutes(1);
+		m.set_eviction_policy(eviction);
+		test_client.handler->on_message("homie/dev2/$state", "lost");
+		m.tick(master::clock::now() + std::chrono::hours(1));
+		ASSERT_EQ(m.get_discovered_device("dev2"), nullptr);
+		publish_test_device(test_client, "dev2");
+		test_client.handler->on_message("homie/dev2/testnode/intensity", "30");
+		ASSERT_EQ(dev2_calls, 1);
+		m.unwatch(w_dev2);
+		test_client.handler->on_message("homie/dev2/testnode/intensity", "40");
+		ASSERT_EQ(dev2_calls, 1);
+		ASSERT_EQ(any.size(), 6);
+	}
+	ASSERT_TRUE(test_client.expect_subscribe.empty());
+	ASSERT_TRUE(test_client.expect_unsubscribe.empty());
+}
+
+TEST(MasterTest, SetValueAsync) {
+	test_mqtt_client test_client;
+	test_client.expect_subscribe.insert("homie/#");
+	test_client.expect_unsubscribe.insert("homie/#");
+	{
+		master m(test_client);
+		publish_test_device(test_client, "dev1");
+		auto intensity = m.find_property("dev1", "testnode", "intensity");
+		auto on = m.find_property("dev1", "arraynode", "on");
+
+		test_client.add_step().add_message("homie/dev1/testnode/intensity/set", "50");
+		auto confirmed = m.set_value_async(intensity, "50", std::chrono::seconds(5));
+		ASSERT_EQ(m.get_pending_set_count(), 1);
+		// Other values do not confirm the request
+		test_client.handler->on_message("homie/dev1/testnode/intensity", "70");
+		ASSERT_EQ(confirmed.wait_for(std::chrono::seconds(0)), std::future_status::timeout);
+		test_client.handler->on_message("homie/dev1/testnode/intensity", "50");
+		ASSERT_EQ(confirmed.wait_for(std::chrono::seconds(0)), std::future_status::ready);
+		confirmed.get();
+
+		// Array index has to match
+		std::vector<set_status> results;
+		test_client.add_step().add_message("homie/dev1/arraynode_1/on/set", "true");
+		m.set_value_async(on, 1, "true", std::chrono::seconds(5), [&](set_status s) { results.push_back(s); });
+		test_client.handler->on_message("homie/dev1/arraynode_0/on", "false");
+		ASSERT_TRUE(results.empty());
+		test_client.handler->on_message("homie/dev1/arraynode_1/on", "true");
+		ASSERT_EQ(results, std::vector<set_status>({ set_status::confirmed }));
+
+		// Already the current value, confirmed right away
+		test_client.add_step().add_message("homie/dev1/testnode/intensity/set", "50");
+		m.set_value_async(intensity, "50", std::chrono::seconds(5)).get();
+
+		// Timeout, driven by tick
+		test_client.add_step().add_message("homie/dev1/testnode/intensity/set", "10");
+		auto timed_out = m.set_value_async(intensity, "10", std::chrono::seconds(5));
+		m.tick(master::clock::now() + std::chrono::seconds(1));
+		ASSERT_EQ(timed_out.wait_for(std::chrono::seconds(0)), std::future_status::timeout);
+		m.tick(master::clock::now() + std::chrono::seconds(6));
+		try {
+			timed_out.get();
+			FAIL();
+		}
+		catch (const set_error& e) {
+			ASSERT_EQ(e.status(), set_status::timeout);
+		}
+
+		// Removed devices fail their requests, stale handles fail immediately
+		test_client.add_step().add_message("homie/dev1/testnode/intensity/set", "20");
+		m.set_value_async(intensity, "20", std::chrono::seconds(5), [&](set_status s) { results.push_back(s); });
+		eviction_policy policy;
+		policy.offline_ttl = std::chrono::seconds(1);
+		m.set_eviction_policy(policy);
+		test_client.handler->on_message("homie/dev1/$state", "lost");
+		m.tick(master::clock::now() + std::chrono::seconds(2));
+		m.set_value_async(intensity, "20", std::chrono::seconds(5), [&](set_status s) { results.push_back(s); });
+		ASSERT_EQ(results, std::vector<set_status>({ set_status::confirmed, set_status::removed, set_status::removed }));
+		ASSERT_EQ(m.get_pending_set_count(), 0);
+
+		ASSERT_EQ(m.get_set_count(set_status::confirmed), 3);
+		ASSERT_EQ(m.get_set_count(set_status::timeout), 1);
+		ASSERT_EQ(m.get_set_count(set_status::removed), 1);
+		ASSERT_EQ(m.get_set_latency().count(), 3);
+		ASSERT_LE(m.get_set_latency().min(), m.get_set_latency().percentile(0.5));
+		ASSERT_LE(m.get_set_latency().percentile(0.5), m.get_set_latency().max());
+		ASSERT_EQ(m.get_set_latency("light", "intensity")->count(), 2);
+		ASSERT_EQ(m.get_set_latency("switch", "on")->count(), 1);
+		ASSERT_EQ(m.get_set_latency("switch", "intensity"), nullptr);
+		ASSERT_TRUE(test_client.steps.empty());
+	}
+	ASSERT_TRUE(test_client.expect_subscribe.empty());
+	ASSERT_TRUE(test_client.expect_unsubscribe.empty());
+}
+
+TEST(MasterTest, LatencyHistogram) {
+	latency_histogram h;
+	ASSERT_EQ(h.percentile(0.5), latency_histogram::duration::zero());
+	for (int i = 0; i < 90; i++) h.record(std::chrono::microseconds(100));
+	for (int i = 0; i < 10; i++) h.record(std::chrono::milliseconds(10));
+	ASSERT_EQ(h.count(), 100);
+	ASSERT_EQ(h.min(), std::chrono::microseconds(100));
+	ASSERT_EQ(h.max(), std::chrono::milliseconds(10));
+	ASSERT_EQ(h.mean(), std::chrono::microseconds(1090));
+	ASSERT_EQ(h.percentile(0.5), std::chrono::microseconds(128));
+	ASSERT_EQ(h.percentile(0.99), std::chrono::milliseconds(10));
+	ASSERT_EQ(h.bucket(6), 0);
+	ASSERT_EQ(h.bucket(7), 90);
+}
+
+TEST(MasterTest, BulkSet) {
+	test_mqtt_client test_client;
+	test_client.expect_subscribe.insert("homie/#");
+	test_client.expect_unsubscribe.insert("homie/#");
+	{
+		master m(test_client);
+		publish_test_device(test_client, "dev1");
+		publish_test_device(test_client, "dev2");
+		auto on = m.find_property("dev1", "arraynode", "on");
+		auto intensity1 = m.find_property("dev1", "testnode", "intensity");
+		auto intensity2 = m.find_property("dev2", "testnode", "intensity");
+
+		test_client.handler->on_message("homie/dev1/arraynode/$array", "0-511");
+		auto& range = test_client.add_step();
+		for (int i = 0; i < 512; i++) range.add_message("homie/dev1/arraynode_" + std::to_string(i) + "/on/set", "true");
+		ASSERT_EQ(m.set_values(on, 0, 511, "true"), 512);
+		ASSERT_EQ(test_client.batches, 1);
+		ASSERT_EQ(m.set_values(on, 5, 4, "true"), 0);
+
+		// Clamped to the declared range, no overflow for extreme arguments, nothing for non array nodes
+		auto on2 = m.find_property("dev2", "arraynode", "on");
+		test_client.add_step()
+			.add_message("homie/dev2/arraynode_0/on/set", "false")
+			.add_message("homie/dev2/arraynode_1/on/set", "false");
+		ASSERT_EQ(m.set_values(on2, std::numeric_limits<int64_t>::min(), std::numeric_limits<int64_t>::max(), "false"), 2);
+		test_client.add_step().add_message("homie/dev2/arraynode_1/on/set", "true");
+		ASSERT_EQ(m.set_values(on2, 1, 2, "true"), 1);
+		ASSERT_EQ(m.set_values(on2, 2, 5, "true"), 0);
+		ASSERT_EQ(m.set_values(m.find_property("dev1", "testnode", "intensity"), 0, 1, "1"), 0);
+		ASSERT_EQ(test_client.batches, 3);
+
+		test_client.add_step()
+			.add_message("homie/dev1/testnode/intensity/set", "10")
+			.add_message("homie/dev2/testnode/intensity/set", "10");
+		ASSERT_EQ(m.set_values({ intensity1, intensity2, property_handle() }, "10"), 2);
+		ASSERT_EQ(test_client.batches, 4);
+
+		test_client.add_step()
+			.add_message("homie/dev1/testnode/intensity/set", "20")
+			.add_message("homie/dev2/testnode/intensity/set", "30");
+		ASSERT_EQ(m.set_values(std::vector<std::pair<property_handle, std::string>>{ { intensity1, "20" }, { intensity2, "30" } }), 2);
+		ASSERT_EQ(test_client.batches, 5);
+
+		test_client.add_step()
+			.add_message("homie/dev1/testnode/intensity/set", "40")
+			.add_message("homie/dev2/testnode/intensity/set", "40")
+			.add_message("homie/dev3/testnode/intensity/set", "40");
+		ASSERT_EQ(m.set_values({ "dev1", "dev2", "dev3" }, "testnode", "intensity", "40"), 3);
+		ASSERT_EQ(test_client.batches, 6);
+		ASSERT_TRUE(test_client.steps.empty());
+	}
+	ASSERT_TRUE(test_client.expect_subscribe.empty());
+	ASSERT_TRUE(test_client.expect_unsubscribe.empty());
+}
+
+TEST(MasterTest, MqttBatch) {
+	mqtt_batch batch(0, false);
+	batch.add("a/b", "1");
+	batch.add("a/c_", 42, "/d", "");
+	ASSERT_EQ(batch.size(), 2);
+	ASSERT_EQ(batch.qos(), 0);
+	ASSERT_FALSE(batch.retain());
+	ASSERT_EQ(batch.topic(0), "a/b");
+	ASSERT_EQ(batch.payload(0), "1");
+	ASSERT_EQ(batch.topic(1), "a/c_42/d");
+	ASSERT_EQ(batch.payload(1), "");
+	ASSERT_EQ(std::string(batch.topic_data(1), batch.topic_size(1)), "a/c_42/d");
+	batch.clear();
+	ASSERT_TRUE(batch.empty());
+}
+
+TEST(MasterTest, PropertySetTopics) {
+	test_mqtt_client test_client;
+	test_client.expect_subscribe.insert("homie/#");
+	test_client.expect_unsubscribe.insert("homie/#");
+	{
+		master m(test_client);
+		publish_test_device(test_client, "dev1");
+		auto dev = m.get_discovered_device("dev1");
+		test_client.add_step().add_message("homie/dev1/testnode/intensity/set", "5");
+		dev->get_node("testnode")->get_property("intensity")->set_value("5");
+		auto on = dev->get_node("arraynode")->get_property("on");
+		test_client.add_step().add_message("homie/dev1/arraynode_1/on/set", "true");
+		on->set_value(1, "true");
+		test_client.add_step().add_message("homie/dev1/arraynode_12345/on/set", "false");
+		on->set_value(12345, "false");
+		test_client.add_step().add_message("homie/dev1/arraynode/on/set", "false");
+		on->set_value("false");
+		ASSERT_TRUE(test_client.steps.empty());
+	}
+	ASSERT_TRUE(test_client.expect_subscribe.empty());
+	ASSERT_TRUE(test_client.expect_unsubscribe.empty());
+}
+
+TEST(MasterTest, SleepQueue) {
+	test_mqtt_client test_client;
+	test_client.expect_subscribe.insert("homie/#");
+	test_client.expect_unsubscribe.insert("homie/#");
+	{
+		master m(test_client);
+		publish_test_device(test_client, "dev1");
+		publish_test_device(test_client, "dev2");
+		auto dev1 = m.get_discovered_device("dev1");
+		auto intensity = dev1->get_node("testnode")->get_property("intensity");
+		auto on = m.find_property("dev1", "arraynode", "on");
+		test_client.handler->on_message("homie/dev1/$state", "sleeping");
+
+		// Disabled by default
+		ASSERT_FALSE(m.get_sleep_queue());
+		test_client.add_step().add_message("homie/dev1/testnode/intensity/set", "1");
+		intensity->set_value("1");
+
+		m.set_sleep_queue(true);
+		intensity->set_value("2");
+		intensity->set_value("3");
+		ASSERT_EQ(m.set_values(on, 0, 1, "false"), 0);
+		dev1->get_node("arraynode")->get_property("on")->set_value(1, "true");
+		test_client.add_step().add_message("homie/dev2/testnode/intensity/set", "4");
+		ASSERT_EQ(m.set_values({ "dev1", "dev2" }, "testnode", "intensity", "4"), 1);
+		ASSERT_EQ(m.get_queued_set_count("dev1"), 3);
+		ASSERT_EQ(m.get_queued_set_count("dev2"), 0);
+		ASSERT_TRUE(test_client.steps.empty());
+
+		auto batches = test_client.batches;
+		test_client.add_step()
+			.add_message("homie/dev1/testnode/intensity/set", "4")
+			.add_message("homie/dev1/arraynode_0/on/set", "false")
+			.add_message("homie/dev1/arraynode_1/on/set", "true");
+		test_client.handler->on_message("homie/dev1/$state", "ready");
+		ASSERT_TRUE(test_client.steps.empty());
+		ASSERT_EQ(test_client.batches, batches + 1);
+		ASSERT_EQ(m.get_queued_set_count("dev1"), 0);
+
+		// Cleared queues are not published, disabling flushes the rest
+		test_client.handler->on_message("homie/dev1/$state", "sleeping");
+		test_client.handler->on_message("homie/dev2/$state", "sleeping");
+		intensity->set_value("5");
+		m.clear_queued_sets("dev1");
+		m.set_values({ "dev2" }, "testnode", "intensity", "6");
+		test_client.add_step().add_message("homie/dev2/testnode/intensity/set", "6");
+		m.set_sleep_queue(false);
+		ASSERT_TRUE(test_client.steps.empty());
+		test_client.handler->on_message("homie/dev1/$state", "ready");
+
+		// A property kept past the removal of its sleeping device publishes directly
+		m.set_sleep_queue(true);
+		eviction_policy eviction;
+		eviction.offline_ttl = std::chrono::minutes(1);
+		m.set_eviction_policy(eviction);
+		test_client.handler->on_message("homie/dev1/$state", "sleeping");
+		test_client.handler->on_message("homie/dev1/$state", "lost");
+		m.tick(master::clock::now() + std::chrono::hours(1));
+		ASSERT_EQ(m.get_discovered_device("dev1"), nullptr);
+		test_client.add_step().add_message("homie/dev1/testnode/intensity/set", "7");
+		intensity->set_value("7");
+		ASSERT_TRUE(test_client.steps.empty());
+	}
+	ASSERT_TRUE(test_client.expect_subscribe.empty());
+	ASSERT_TRUE(test_client.expect_unsubscribe.empty());
+}
+
+TEST(MasterTest, DiscoveryCompleteness) {
+	struct complete_handler : dummy_handler {
+		std::vector<std::string> complete;
+		std::vector<device_completeness> reported;
+		virtual void on_device_complete(device_ptr dev, const device_completeness& c) override {
+			complete.push_back(dev->get_id());
+			reported.push_back(c);
+		}
+	};
+	test_mqtt_client test_client;
+	test_client.expect_subscribe.insert("homie/#");
+	test_client.expect_unsubscribe.insert("homie/#");
+	{
+		complete_handler hdl;
+		master m(test_client);
+		m.set_event_handler(&hdl);
+		publish_test_device(test_client, "dev1");
+		ASSERT_EQ(hdl.complete, std::vector<std::string>({ "dev1" }));
+		ASSERT_TRUE(m.get_completeness("dev1").is_complete());
+		ASSERT_EQ(m.get_completeness("dev1").declared, 6);
+		ASSERT_FALSE(m.get_completeness("unknown").is_complete());
+
+		// Ready before the structure arrived
+		auto base = std::string("homie/dev2/");
+		test_client.handler->on_message(base + "$state", "init");
+		test_client.handler->on_message(base + "$state", "ready");
+		ASSERT_EQ(m.get_completeness("dev2").ratio(), 0.0);
+		test_client.handler->on_message(base + "$nodes", "lamp,strip[]");
+		ASSERT_EQ(m.get_completeness("dev2").ratio(), 0.25);
+		test_client.handler->on_message(base + "lamp/$properties", "on,level:settable");
+		test_client.handler->on_message(base + "lamp/on/$datatype", "boolean");
+		test_client.handler->on_message(base + "strip/$properties", "color");
+		test_client.handler->on_message(base + "strip/color/$datatype", "color");
+		test_client.handler->on_message(base + "lamp/level/$datatype", "integer");
+		ASSERT_EQ(m.get_completeness("dev2").present, 6);
+		ASSERT_EQ(m.get_completeness("dev2").declared, 7);
+		ASSERT_EQ(hdl.complete.size(), 1);
+		test_client.handler->on_message(base + "strip/$array", "0-9");
+		ASSERT_EQ(hdl.complete, std::vector<std::string>({ "dev1", "dev2" }));
+		ASSERT_EQ(m.get_completeness("dev2").ratio(), 1.0);
+
+		// Declaring more makes it incomplete until that arrived
+		test_client.handler->on_message(base + "lamp/$properties", "on,level,mode");
+		ASSERT_FALSE(m.get_completeness("dev2").is_complete());
+		test_client.handler->on_message(base + "lamp/mode/$datatype", "enum");
+		ASSERT_EQ(hdl.complete, std::vector<std::string>({ "dev1", "dev2", "dev2" }));
+		ASSERT_EQ(hdl.reported.back().declared, 8);
+		ASSERT_EQ(hdl.reported.back().ratio(), 1.0);
+
+		// Removing a node takes its properties out of both counts
+		test_client.handler->on_message(base + "$nodes", "lamp");
+		ASSERT_EQ(m.get_completeness("dev2").declared, 5);
+		ASSERT_TRUE(m.get_completeness("dev2").is_complete());
+	}
+	ASSERT_TRUE(test_client.expect_subscribe.empty());
+	ASSERT_TRUE(test_client.expect_unsubscribe.empty());
+}
+
+TEST(MasterTest, StaleNodeReconciliation) {
+	struct removal_handler : dummy_handler {
+		std::vector<std::string> removed;
+		virtual void on_node_removed(node_ptr node) override { removed.push_back(node->get_id()); }
+		virtual void on_property_removed(property_ptr prop) override { removed.push_back(prop->get_node()->get_id() + "/" + prop->get_id()); }
+	};
+	test_mqtt_client test_client;
+	test_client.expect_subscribe.insert("homie/#");
+	test_client.expect_unsubscribe.insert("homie/#");
+	{
+		removal_handler hdl;
+		master m(test_client);
+		m.set_event_handler(&hdl);
+		publish_test_device(test_client, "dev1");
+		auto on = m.find_property("dev1", "arraynode", "on");
+		auto base = std::string("homie/dev1/");
+		test_client.handler->on_message(base + "testnode/$properties", "intensity,mode:settable");
+		test_client.handler->on_message(base + "testnode/mode/$datatype", "enum");
+		// Undeclared nodes and properties are dropped once $nodes / $properties are known
+		test_client.handler->on_message(base + "extra/$type", "extra");
+		test_client.handler->on_message(base + "testnode/extra", "1");
+		ASSERT_EQ(m.get_discovered_device("dev1")->get_nodes(), std::set<std::string>({ "arraynode", "testnode" }));
+		ASSERT_EQ(m.get_discovered_device("dev1")->get_node("testnode")->get_properties(), std::set<std::string>({ "intensity", "mode" }));
+
+		test_client.handler->on_message(base + "$nodes", "testnode");
+		ASSERT_EQ(hdl.removed, std::vector<std::string>({ "arraynode" }));
+		ASSERT_EQ(m.get_discovered_device("dev1")->get_nodes(), std::set<std::string>({ "testnode" }));
+		ASSERT_FALSE(m.is_valid(on));
+		ASSERT_EQ(m.get_nodes_by_type("switch").size(), 0);
+
+		auto intensity = m.find_property("dev1", "testnode", "intensity");
+		test_client.handler->on_message(base + "testnode/$properties", "mode");
+		ASSERT_EQ(hdl.removed, std::vector<std::string>({ "arraynode", "testnode/intensity" }));
+		ASSERT_FALSE(m.is_valid(intensity));
+		ASSERT_EQ(m.get_discovered_device("dev1")->get_node("testnode")->get_properties(), std::set<std::string>({ "mode" }));
+		// The counters follow the removals: $nodes, testnode/$properties and mode/$datatype
+		ASSERT_EQ(m.get_completeness("dev1").declared, 3);
+		ASSERT_TRUE(m.get_completeness("dev1").is_complete());
+
+		// Declaring it again starts from scratch
+		test_client.handler->on_message(base + "$nodes", "testnode,arraynode[]");
+		test_client.handler->on_message(base + "arraynode/on/$datatype", "boolean");
+		ASSERT_TRUE(m.is_valid(m.find_property("dev1", "arraynode", "on")));
+		ASSERT_EQ(m.value(m.find_property("dev1", "arraynode", "on"), 0), "");
+		ASSERT_EQ(m.get_completeness("dev1").declared, 5);
+		ASSERT_EQ(m.get_completeness("dev1").present, 3);
+	}
+	ASSERT_TRUE(test_client.expect_subscribe.empty());
+	ASSERT_TRUE(test_client.expect_unsubscribe.empty());
+}
+
+TEST(MasterTest, StaleRetainedTopics) {
+	test_mqtt_client test_client;
+	test_client.expect_subscribe.insert("homie/#");
+	test_client.expect_unsubscribe.insert("homie/#");
+	{
+		// A fresh master replays the retained topics of a device after a firmware update,
+		// the topics of the removed node and property arrive in any order
+		master m(test_client);
+		auto base = std::string("homie/dev1/");
+		test_client.handler->on_message(base + "old/$properties", "value");
+		test_client.handler->on_message(base + "old/value", "1");
+		test_client.handler->on_message(base + "a/gone", "1");
+		test_client.handler->on_message(base + "$nodes", "a");
+		test_client.handler->on_message(base + "old/$type", "legacy");
+		test_client.handler->on_message(base + "a/$properties", "p");
+		test_client.handler->on_message(base + "a/p/$datatype", "integer");
+		test_client.handler->on_message(base + "a/gone/$datatype", "integer");
+		test_client.handler->on_message(base + "a/p", "5");
+		test_client.handler->on_message(base + "$state", "ready");
+
+		auto dev = m.get_discovered_device("dev1");
+		ASSERT_EQ(dev->get_nodes(), std::set<std::string>({ "a" }));
+		ASSERT_EQ(dev->get_node("a")->get_properties(), std::set<std::string>({ "p" }));
+		ASSERT_EQ(m.get_nodes_by_type("legacy").size(), 0);
+		ASSERT_TRUE(m.get_completeness("dev1").is_complete());
+	}
+	ASSERT_TRUE(test_client.expect_subscribe.empty());
+	ASSERT_TRUE(test_client.expect_unsubscribe.empty());
+}
+
+TEST(MasterTest, LivenessMonitor) {
+	struct stale_handler : dummy_handler {
+		std::vector<std::string> stale;
+		virtual void on_device_stale(device_ptr dev) override { stale.push_back(dev->get_id()); }
+	};
+	test_mqtt_client test_client;
+	{
+		test_client.expect_subscribe.insert("homie/#");
+		test_client.expect_unsubscribe.insert("homie/#");
+		stale_handler hdl;
+		master m(test_client);
+		m.set_event_handler(&hdl);
+		publish_test_device(test_client, "dev1");
+		m.enable_liveness_monitor(2.5);
+		publish_test_device(test_client, "dev2");
+		publish_test_device(test_client, "dev3");
+		test_client.handler->on_message("homie/dev2/$stats/interval", "120");
+		test_client.handler->on_message("homie/dev3/$state", "sleeping");
+		// No $stats/interval, not monitored
+		test_client.handler->on_message("homie/dev4/$state", "ready");
+		auto start = master::clock::now();
+
+		m.tick(start + std::chrono::seconds(100));
+		ASSERT_TRUE(hdl.stale.empty());
+		m.tick(start + std::chrono::seconds(151));
+		ASSERT_EQ(hdl.stale, std::vector<std::string>({ "dev1" }));
+		ASSERT_TRUE(m.is_device_stale("dev1"));
+		ASSERT_FALSE(m.is_device_stale("dev2"));
+		m.tick(start + std::chrono::seconds(200));
+		ASSERT_EQ(hdl.stale.size(), 1);
+
+		// Any message revives it
+		test_client.handler->on_message("homie/dev1/$stats/uptime", "1234");
+		ASSERT_FALSE(m.is_device_stale("dev1"));
+		m.tick(start + std::chrono::seconds(301));
+		ASSERT_EQ(hdl.stale, std::vector<std::string>({ "dev1", "dev1", "dev2" }));
+		ASSERT_FALSE(m.is_device_stale("dev3"));
+		ASSERT_FALSE(m.is_device_stale("dev4"));
+
+		m.disable_liveness_monitor();
+		ASSERT_FALSE(m.is_device_stale("dev1"));
+		m.tick(master::clock::now() + std::chrono::hours(24));
+		ASSERT_EQ(hdl.stale.size(), 3);
+	}
+	{
+		// A shorter interval takes effect right away
+		test_client.expect_subscribe.insert("homie/#");
+		test_client.expect_unsubscribe.insert("homie/#");
+		stale_handler hdl;
+		master m(test_client);
+		m.set_event_handler(&hdl);
+		m.enable_liveness_monitor();
+		publish_test_device(test_client, "dev1");
+		test_client.handler->on_message("homie/dev1/$stats/interval", "10");
+		m.tick(master::clock::now() + std::chrono::seconds(24));
+		ASSERT_TRUE(hdl.stale.empty());
+		m.tick(master::clock::now() + std::chrono::seconds(27));
+		ASSERT_EQ(hdl.stale, std::vector<std::string>({ "dev1" }));
+		m.tick(master::clock::now() + std::chrono::seconds(200));
+		ASSERT_EQ(hdl.stale.size(), 1);
+	}
+	ASSERT_TRUE(test_client.expect_subscribe.empty());
+	ASSERT_TRUE(test_client.expect_unsubscribe.empty());
+}
+
+TEST(MasterTest, TimerWheel) {
+	auto start = timer_wheel<int>::clock::now();
+	timer_wheel<int> wheel(std::chrono::seconds(1), 8, start);
+	wheel.schedule(1, start + std::chrono::milliseconds(2500));
+	wheel.schedule(2, start);
+	// Beyond one revolution, fires early
+	wheel.schedule(3, start + std::chrono::seconds(20));
+	ASSERT_EQ(wheel.size(), 3);
+	std::vector<int> fired;
+	auto collect = [&](int k) { fired.push_back(k); };
+	wheel.advance(start + std::chrono::milliseconds(900), collect);
+	ASSERT_TRUE(fired.empty());
+	wheel.advance(start + std::chrono::seconds(1), collect);
+	ASSERT_EQ(fired, std::vector<int>({ 2 }));
+	wheel.advance(start + std::chrono::seconds(3), collect);
+	ASSERT_EQ(fired, std::vector<int>({ 2, 1 }));
+	// Large jumps visit every slot once
+	wheel.advance(start + std::chrono::hours(1), collect);
+	ASSERT_EQ(fired, std::vector<int>({ 2, 1, 3 }));
+	ASSERT_EQ(wheel.size(), 0);
+	wheel.schedule(4, start + std::chrono::hours(1) + std::chrono::seconds(2));
+	wheel.advance(start + std::chrono::hours(1) + std::chrono::seconds(2), collect);
+	ASSERT_EQ(fired.size(), 3);
+	wheel.advance(start + std::chrono::hours(1) + std::chrono::seconds(3), collect);
+	ASSERT_EQ(fired.back(), 4);
+}
+
+TEST(MasterTest, Federation) {
+	test_mqtt_client site1;
+	test_mqtt_client site2;
+	site1.expect_subscribe.insert("homie/#");
+	site1.expect_unsubscribe.insert("homie/#");
+	site2.expect_subscribe.insert("devices/#");
+	site2.expect_unsubscribe.insert("devices/#");
+	{
+		federated_master fed;
+		std::vector<std::string> seen;
+		auto all = fed.watch("*", "testnode", "intensity", [&](const std::string& dev, const property_ptr&, int64_t, const std::string& value) { seen.push_back(dev + "=" + value); });
+		std::vector<std::string> seen2;
+		fed.watch("site2/*", "arraynode", "on", [&](const std::string& dev, const property_ptr&, int64_t idx, const std::string& value) { seen2.push_back(dev + "_" + std::to_string(idx) + "=" + value); });
+
+		fed.add_member("site1", site1);
+		fed.add_member("site2", site2, "devices/");
+		ASSERT_THROW(fed.add_member("site1", site1), std::invalid_argument);
+		ASSERT_THROW(fed.add_member("a/b", site1), std::invalid_argument);
+		ASSERT_EQ(fed.get_namespaces(), std::vector<std::string>({ "site1", "site2" }));
+
+		publish_test_device(site1, "lamp");
+		// Same id on another broker and base topic
+		site2.handler->on_message("devices/lamp/$state", "init");
+		site2.handler->on_message("devices/lamp/$nodes", "testnode,arraynode[]");
+		site2.handler->on_message("devices/lamp/testnode/intensity/$datatype", "integer");
+		site2.handler->on_message("devices/lamp/arraynode/$array", "0-1");
+		site2.handler->on_message("devices/lamp/$state", "ready");
+		ASSERT_EQ(fed.get_device_ids(), std::vector<std::string>({ "site1/lamp", "site2/lamp" }));
+		ASSERT_EQ(fed.get_device_count(device_state::ready), 2);
+		ASSERT_EQ(fed.get_device_ids(device_state::ready).size(), 2);
+
+		site1.handler->on_message("homie/lamp/testnode/intensity", "10");
+		site2.handler->on_message("devices/lamp/testnode/intensity", "20");
+		site1.handler->on_message("homie/lamp/arraynode_1/on", "true");
+		site2.handler->on_message("devices/lamp/arraynode_1/on", "true");
+		ASSERT_EQ(seen, std::vector<std::string>({ "site1/lamp=10", "site2/lamp=20" }));
+		ASSERT_EQ(seen2, std::vector<std::string>({ "site2/lamp_1=true" }));
+		ASSERT_EQ(fed.get_value("site1/lamp", "testnode", "intensity"), "10");
+		ASSERT_EQ(fed.get_value("site2/lamp", "testnode", "intensity"), "20");
+		ASSERT_EQ(fed.get_value("site2/lamp", "arraynode", 1, "on"), "true");
+		ASSERT_EQ(fed.get_value("site3/lamp", "testnode", "intensity"), "");
+		ASSERT_EQ(fed.get_value("lamp", "testnode", "intensity"), "");
+
+		site2.add_step().add_message("devices/lamp/testnode/intensity/set", "30");
+		ASSERT_TRUE(fed.set_value("site2/lamp", "testnode", "intensity", "30"));
+		site1.add_step().add_message("homie/lamp/arraynode_0/on/set", "false");
+		ASSERT_TRUE(fed.set_value("site1/lamp", "arraynode", 0, "on", "false"));
+		ASSERT_FALSE(fed.set_value("site1/other", "testnode", "intensity", "30"));
+		ASSERT_TRUE(site1.steps.empty());
+		ASSERT_TRUE(site2.steps.empty());
+
+		size_t count = 0;
+		ASSERT_TRUE(fed.visit("site1", [&](master& m) { count = m.get_discovered_devices().size(); }));
+		ASSERT_EQ(count, 1);
+
+		fed.unwatch(all);
+		site1.handler->on_message("homie/lamp/testnode/intensity", "11");
+		ASSERT_EQ(seen.size(), 2);
+
+		fed.remove_member("site1");
+		ASSERT_EQ(fed.get_device_ids(), std::vector<std::string>({ "site2/lamp" }));
+		ASSERT_FALSE(fed.visit("site1", [](master&) {}));
+	}
+	ASSERT_TRUE(site1.expect_subscribe.empty());
+	ASSERT_TRUE(site1.expect_unsubscribe.empty());
+	ASSERT_TRUE(site2.expect_subscribe.empty());
+	ASSERT_TRUE(site2.expect_unsubscribe.empty());
+}
+
+TEST(MasterTest, FederationParallelConnections) {
+	test_mqtt_client clients[2];
+	federated_master fed;
+	std::atomic<size_t> changes{ 0 };
+	for (int i = 0; i < 2; i++) {
+		clients[i].expect_subscribe.insert("homie/#");
+		clients[i].expect_unsubscribe.insert("homie/#");
+		fed.add_member("site" + std::to_string(i), clients[i]);
+	}
+	fed.watch("*/*", "node", "value", [&](const std::string&, const property_ptr&, int64_t, const std::string&) { changes++; });
+	std::atomic<bool> stop{ false };
+	std::atomic<int> finished{ 0 };
+	std::vector<std::thread> threads;
+	for (int i = 0; i < 2; i++) {
+		threads.emplace_back([&clients, &stop, &finished, i]() {
+			for (int d = 0; d < 20; d++) {
+				auto base = "homie/dev" + std::to_string(d) + "/";
+				clients[i].handler->on_message(base + "$state", "ready");
+				for (int v = 0; v < 50; v++) clients[i].handler->on_message(base + "node/value", std::to_string(v));
+			}
+			// Keep ingesting (duplicates, no changes) until the queries are done
+			while (!stop) clients[i].handler->on_message("homie/dev0/node/value", "49");
+			finished++;
+		});
+	}
+	// Queries complete while both connection threads are still ingesting
+	while (fed.get_device_count(device_state::ready) < 40) std::this_thread::yield();
+	for (int q = 0; q < 100; q++) ASSERT_EQ(fed.get_device_ids().size(), 40);
+	ASSERT_EQ(finished, 0);
+	stop = true;
+	for (auto& t : threads) t.join();
+	ASSERT_EQ(changes, 2 * 20 * 50);
+	ASSERT_EQ(fed.get_value("site1/dev19", "node", "value"), "49");
+	fed.remove_member("site0");
+	fed.remove_member("site1");
+	ASSERT_TRUE(clients[0].expect_unsubscribe.empty());
+}
+
+TEST(MasterTest, FederationQueriesFromCallbacks) {
+	test_mqtt_client clients[2];
+	federated_master fed;
+	for (int i = 0; i < 2; i++) {
+		clients[i].expect_subscribe.insert("homie/#");
+		clients[i].expect_unsubscribe.insert("homie/#");
+		fed.add_member("site" + std::to_string(i), clients[i]);
+		clients[i].handler->on_message("homie/dev/$state", "ready");
+	}
+	// Every callback locks both members, from both connection threads at the same time
+	std::atomic<size_t> queries{ 0 };
+	std::atomic<int> entered{ 0 };
+	fed.watch("*/dev", "node", "value", [&](const std::string& device, const property_ptr&, int64_t, const std::string& value) {
+		// Both threads are inside a callback before the first query
+		if (value == "0") {
+			entered++;
+			auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(1);
+			while (entered < 2 && std::chrono::steady_clock::now() < deadline) std::this_thread::yield();
+		}
+		auto other = device == "site0/dev" ? "site1/dev" : "site0/dev";
+		fed.get_value(other, "node", "value");
+		if (fed.get_device_ids().size() == 2 && fed.get_value(device, "node", "value") == value) queries++;
+	});
+	std::vector<std::thread> threads;
+	for (int i = 0; i < 2; i++) {
+		threads.emplace_back([&clients, i]() {
+			for (int v = 0; v < 2000; v++) clients[i].handler->on_message("homie/dev/node/value", std::to_string(v));
+		});
+	}
+	for (auto& t : threads) t.join();
+	ASSERT_EQ(queries, 2 * 2000);
+	fed.remove_member("site0");
+	fed.remove_member("site1");
+}
+
+namespace {
+	// Minimal in process broker: wildcards, retained messages and wills. Deliveries are queued
+	// and only dispatched by run(), like messages arriving on the connection threads.
+	struct test_broker {
+		struct connection : public homie::mqtt_client {
+			test_broker& broker;
+			homie::mqtt_event_handler* handler = nullptr;
+			std::set<std::string> filters;
+			std::vector<std::string> received;
+			std::string will_topic;
+			std::string will_payload;
+			bool will_retain = false;
+			bool connected = false;
+
+			explicit connection(test_broker& b) : broker(b) {}
+			~connection() { broker.disconnect(this, false); }
+
+			virtual void set_event_handler(homie::mqtt_event_handler* evt) override { handler = evt; }
+			virtual void open(const std::string& topic, const std::string& payload, int, bool retain) override {
+				will_topic = topic;
+				will_payload = payload;
+				will_retain = retain;
+				open();
+			}
+			virtual void open() override {
+				connected = true;
+				broker.connections.push_back(this);
+				if (handler) handler->on_connect(false, false);
+			}
+			virtual void publish(const std::string& topic, const std::string& payload, int, bool retain) override {
+				broker.publish(topic, payload, retain);
+			}
+			virtual void subscribe(const std::string& topic, int) override { broker.subscribe(this, topic); }
+			virtual void unsubscribe(const std::string& topic) override { filters.erase(topic); }
+			virtual bool is_connected() const override { return connected; }
+
+			// Connection loss without disconnect, the broker publishes the will
+			void crash() { broker.disconnect(this, true); }
+		};
+
+		std::vector<connection*> connections;
+		std::map<std::string, std::string> retained;
+		std::deque<std::tuple<connection*, std::string, std::string>> queue;
+
+		static bool matches(const std::string& filter, const std::string& topic) {
+			auto f = utils::split(filter, std::string("/"));
+			auto t = utils::split(topic, std::string("/"));
+			for (size_t i = 0; i < f.size(); i++) {
+				if (f[i] == "#") return true;
+				if (i >= t.size()) return false;
+				if (f[i] != "+" && f[i] != t[i]) return false;
+			}
+			return f.size() == t.size();
+		}
+
+		void publish(const std::string& topic, const std::string& payload, bool retain) {
+			if (retain) {
+				if (payload.empty()) retained.erase(topic);
+				else retained[topic] = payload;
+			}
+			for (auto c : connections) {
+				for (auto& f : c->filters) {
+					if (matches(f, topic)) {
+						queue.emplace_back(c, topic, payload);
+						break;
+					}
+				}
+			}
+		}
+
+		void subscribe(connection* c, const std::string& filter) {
+			c->filters.insert(filter);
+			for (auto& e : retained) {
+				if (matches(filter, e.first)) queue.emplace_back(c, e.first, e.second);
+			}
+		}
+
+		void disconnect(connection* c, bool send_will) {
+			auto it = std::find(connections.begin(), connections.end(), c);
+			if (it == connections.end()) return;
+			connections.erase(it);
+			c->connected = false;
+			c->filters.clear();
+			if (send_will && !c->will_topic.empty()) publish(c->will_topic, c->will_payload, c->will_retain);
+		}
+
+		void run() {
+			while (!queue.empty()) {
+				auto msg = queue.front();
+				queue.pop_front();
+				auto c = std::get<0>(msg);
+				if (std::find(connections.begin(), connections.end(), c) == connections.end()) continue;
+				c->received.push_back(std::get<1>(msg));
+				if (c->handler) c->handler->on_message(std::get<1>(msg), std::get<2>(msg));
+			}
+		}
+
+		void publish_device(const std::string& id, const std::string& value) {
+			auto base = "homie/" + id + "/";
+			publish(base + "$homie", "3.0.0", true);
+			publish(base + "$name", id, true);
+			publish(base + "$nodes", "testnode", true);
+			publish(base + "testnode/$type", "light", true);
+			publish(base + "testnode/$properties", "intensity", true);
+			publish(base + "testnode/intensity/$datatype", "integer", true);
+			publish(base + "testnode/intensity/$settable", "true", true);
+			publish(base + "testnode/intensity", value, true);
+			publish(base + "$state", "ready", true);
+		}
+	};
+
+	std::set<std::string> device_ids(homie::master& m) {
+		std::set<std::string> res;
+		for (auto& d : m.get_discovered_devices()) res.insert(d->get_id());
+		return res;
+	}
+
+	partition_options partition_opts(const std::string& id) {
+		partition_options opts;
+		opts.instance_id = id;
+		opts.group = "grp";
+		opts.partitions = 16;
+		return opts;
+	}
+}
+
+TEST(MasterTest, DiscoveryFilterPartitions) {
+	discovery_filter f;
+	ASSERT_FALSE(f.restricts_devices());
+	// FNV-1a reference values
+	ASSERT_EQ(2166136261u, discovery_filter::hash_id("", 0));
+	ASSERT_EQ(0xe40c292cu, discovery_filter::hash_id("a", 1));
+	f.partition_count = 4;
+	ASSERT_TRUE(f.restricts_devices());
+	ASSERT_FALSE(f.match_device("dev1"));
+	f.partitions.insert(f.partition_of("dev1"));
+	ASSERT_TRUE(f.match_device("dev1"));
+	ASSERT_TRUE(f.match_device("homie/dev1/$state", 6, 4));
+	// Combined with the other rules
+	f.device_patterns.push_back("other*");
+	ASSERT_FALSE(f.match_device("dev1"));
+	f.device_patterns.push_back("dev*");
+	ASSERT_TRUE(f.match_device("dev1"));
+}
+
+TEST(MasterTest, PartitionedMasters) {
+	test_broker broker;
+	std::set<std::string> all;
+	for (int i = 0; i < 24; i++) {
+		auto id = "dev" + std::to_string(i);
+		broker.publish_device(id, "10");
+		all.insert(id);
+	}
+
+	test_broker::connection ca(broker), cb(broker), cc(broker);
+	partitioned_master a(ca, partition_opts("a"));
+	broker.run();
+	ASSERT_EQ(std::set<std::string>({ "a" }), a.get_members());
+	ASSERT_EQ(16u, a.get_owned_partitions().size());
+	ASSERT_EQ(all, device_ids(a.get_master()));
+
+	std::unique_ptr<partitioned_master> b(new partitioned_master(cb, partition_opts("b")));
+	broker.run();
+	ASSERT_EQ(std::set<std::string>({ "a", "b" }), a.get_members());
+	ASSERT_EQ(a.get_members(), b->get_members());
+	ASSERT_FALSE(a.get_owned_partitions().empty());
+	ASSERT_FALSE(b->get_owned_partitions().empty());
+	ASSERT_EQ(16u, a.get_owned_partitions().size() + b->get_owned_partitions().size());
+	auto da = device_ids(a.get_master());
+	auto db = device_ids(b->get_master());
+	ASSERT_FALSE(da.empty());
+	ASSERT_FALSE(db.empty());
+	ASSERT_EQ(all.size(), da.size() + db.size());
+	for (auto& id : all) {
+		// Exactly one owner, and the exchanged ownership map agrees on it
+		ASSERT_NE(a.owns(id), b->owns(id));
+		ASSERT_EQ(a.owns(id), da.count(id) != 0);
+		auto owner = a.owns(id) ? "a" : "b";
+		ASSERT_EQ(owner, a.get_owner(id));
+		ASSERT_EQ(owner, b->get_owner(id));
+	}
+
+	// Live updates only reach the owner
+	auto moved = *db.begin();
+	broker.publish("homie/" + moved + "/testnode/intensity", "42", true);
+	broker.run();
+	ASSERT_EQ("42", b->get_master().value(b->get_master().find_property(moved, "testnode", "intensity")));
+	ASSERT_FALSE(a.get_master().find_property(moved, "testnode", "intensity").valid());
+
+	// b dies, its will hands the partitions back and a fetches the retained state again,
+	// but only that of the devices it gained
+	ca.received.clear();
+	cb.crash();
+	broker.run();
+	size_t replayed = 0;
+	for (auto& t : ca.received) {
+		if (t.compare(0, 6, "homie/") != 0) continue;
+		ASSERT_EQ(0u, da.count(t.substr(6, t.find('/', 6) - 6))) << t;
+		replayed++;
+	}
+	ASSERT_EQ(9 * db.size(), replayed);
+	ASSERT_EQ(std::set<std::string>({ "homie/#", "homie-partition/grp/#" }), ca.filters);
+	ASSERT_EQ(std::set<std::string>({ "a" }), a.get_members());
+	ASSERT_EQ(16u, a.get_owned_partitions().size());
+	ASSERT_EQ(all, device_ids(a.get_master()));
+	ASSERT_EQ("42", a.get_master().value(a.get_master().find_property(moved, "testnode", "intensity")));
+	ASSERT_EQ("a", a.get_owner(moved));
+	b.reset();
+
+	// Graceful leave
+	{
+		partitioned_master c(cc, partition_opts("c"));
+		broker.run();
+		ASSERT_EQ(std::set<std::string>({ "a", "c" }), a.get_members());
+		ASSERT_EQ(all.size(), device_ids(a.get_master()).size() + device_ids(c.get_master()).size());
+		c.leave();
+		broker.run();
+		ASSERT_TRUE(device_ids(c.get_master()).empty());
+	}
+	broker.run();
+	ASSERT_EQ(std::set<std::string>({ "a" }), a.get_members());
+	ASSERT_EQ(all, device_ids(a.get_master()));
+	ASSERT_EQ(0u, broker.retained.count("homie-partition/grp/members/c"));
+	ASSERT_EQ(0u, broker.retained.count("homie-partition/grp/owners/c"));
+}
+
+namespace {
+	// Members list their devices in pointer order
+	std::set<std::string> federation_ids(const federated_master& fed) {
+		auto ids = fed.get_device_ids();
+		return std::set<std::string>(ids.begin(), ids.end());
+	}
+}
+
+TEST(MasterTest, FederationSharedClient) {
+	test_mqtt_client client;
+	client.expect_subscribe = { "homie/#", "other/#" };
+	client.expect_unsubscribe = { "homie/#", "other/#" };
+	{
+		federated_master fed;
+		fed.add_member("a", client);
+		fed.add_member("b", client, "other/");
+		ASSERT_TRUE(client.expect_subscribe.empty());
+		// Two members on one client and base topic would see the same devices
+		ASSERT_THROW(fed.add_member("c", client), std::invalid_argument);
+
+		client.handler->on_message("homie/d/$state", "ready");
+		client.handler->on_message("other/e/$state", "ready");
+		ASSERT_EQ(federation_ids(fed), std::set<std::string>({ "a/d", "b/e" }));
+
+		// The remaining member keeps receiving the events of the client
+		fed.remove_member("b");
+		ASSERT_EQ(client.expect_unsubscribe, std::set<std::string>({ "homie/#" }));
+		client.handler->on_message("homie/f/$state", "ready");
+		client.handler->on_message("other/g/$state", "ready");
+		ASSERT_EQ(federation_ids(fed), std::set<std::string>({ "a/d", "a/f" }));
+		fed.remove_member("a");
+		ASSERT_EQ(client.handler, nullptr);
+	}
+	ASSERT_TRUE(client.expect_subscribe.empty());
+	ASSERT_TRUE(client.expect_unsubscribe.empty());
+}
@@ -0,0 +1,281 @@
+#include <gtest/gtest.h>
+#include <homie-cpp/master.h>
+#include <homie-cpp/serialization.h>
+#include <chrono>
+#include <iostream>
+
+using namespace homie;
+
+namespace {
+	struct test_mqtt_client : public homie::mqtt_client {
+		homie::mqtt_event_handler* handler = nullptr;
+
+		virtual void set_event_handler(homie::mqtt_event_handler * evt) override { handler = evt; }
+		virtual void open(const std::string& will_topic, const std::string& will_payload, int will_qos, bool will_retain) override { FAIL(); }
+		virtual void open() override {
+			if (handler)
+				handler->on_connect(false, false);
+		}
+		virtual void publish(const std::string & topic, const std::string & payload, int qos, bool retain) override {}
+		virtual void subscribe(const std::string & topic, int qos) override {}
+		virtual void unsubscribe(const std::string & topic) override {}
+		virtual bool is_connected() const override { return true; }
+	};
+
+	void publish_test_device(test_mqtt_client& client, const std::string& id, size_t nnodes = 2, size_t nproperties = 1) {
+		auto base = "homie/" + id + "/";
+		client.handler->on_message(base + "$state", "init");
+		client.handler->on_message(base + "$homie", "3.0.0");
+		client.handler->on_message(base + "$name", "Testdevice");
+		client.handler->on_message(base + "$stats/interval", "60");
+		std::string nodes;
+		for (size_t n = 0; n < nnodes; n++) {
+			auto nid = "node" + std::to_string(n);
+			auto array = n % 2 == 1;
+			nodes += nid + (array ? "[]," : ",");
+			client.handler->on_message(base + nid + "/$name", "Node " + std::to_string(n));
+			client.handler->on_message(base + nid + "/$type", "light");
+			if (array) {
+				client.handler->on_message(base + nid + "/$array", "0-1");
+				client.handler->on_message(base + nid + "_0/$name", "First");
+			}
+			std::string properties;
+			for (size_t p = 0; p < nproperties; p++) {
+				auto pid = "prop" + std::to_string(p);
+				properties += pid + ",";
+				client.handler->on_message(base + nid + "/" + pid + "/$datatype", "integer");
+				client.handler->on_message(base + nid + "/" + pid + "/$unit", "%");
+				if (array) {
+					client.handler->on_message(base + nid + "_0/" + pid, std::to_string(p));
+					client.handler->on_message(base + nid + "_1/" + pid, std::to_string(p + 1));
+				}
+				else client.handler->on_message(base + nid + "/" + pid, std::to_string(p));
+			}
+			properties.pop_back();
+			client.handler->on_message(base + nid + "/$properties", properties);
+		}
+		nodes.pop_back();
+		client.handler->on_message(base + "$nodes", nodes);
+		client.handler->on_message(base + "$state", "ready");
+	}
+
+	void expect_same_tree(const_device_ptr a, const_device_ptr b) {
+		ASSERT_NE(a, nullptr);
+		ASSERT_NE(b, nullptr);
+		ASSERT_EQ(a->get_id(), b->get_id());
+		ASSERT_EQ(a->get_attributes(), b->get_attributes());
+		for (auto& e : a->get_attributes()) ASSERT_EQ(a->get_attribute(e), b->get_attribute(e));
+		ASSERT_EQ(a->get_nodes(), b->get_nodes());
+		for (auto& n : a->get_nodes()) {
+			auto na = a->get_node(n);
+			auto nb = b->get_node(n);
+			ASSERT_EQ(na->get_attributes(), nb->get_attributes());
+			for (auto& e : na->get_attributes()) ASSERT_EQ(na->get_attribute(e), nb->get_attribute(e));
+			ASSERT_EQ(na->is_array(), nb->is_array());
+			ASSERT_EQ(na->get_indices(), nb->get_indices());
+			for (auto i : na->get_indices()) {
+				ASSERT_EQ(na->get_attributes(i), nb->get_attributes(i));
+				for (auto& e : na->get_attributes(i)) ASSERT_EQ(na->get_attribute(e, i), nb->get_attribute(e, i));
+			}
+			ASSERT_EQ(na->get_properties(), nb->get_properties());
+			for (auto& p : na->get_properties()) {
+				auto pa = na->get_property(p);
+				auto pb = nb->get_property(p);
+				ASSERT_EQ(pa->get_attributes(), pb->get_attributes());
+				for (auto& e : pa->get_attributes()) ASSERT_EQ(pa->get_attribute(e), pb->get_attribute(e));
+				ASSERT_EQ(pa->get_value(), pb->get_value());
+				for (auto i : na->get_indices()) ASSERT_EQ(pa->get_value(i), pb->get_value(i));
+			}
+		}
+	}
+
+	struct counting_visitor : serialization::tree_visitor {
+		size_t devices = 0;
+		size_t nodes = 0;
+		size_t properties = 0;
+		size_t attributes = 0;
+		size_t values = 0;
+
+		virtual void on_device(const std::string& id) override { devices++; }
+		virtual void on_device_attribute(const std::string& id, const std::string& value) override { attributes++; }
+		virtual void on_node(const std::string& id) override { nodes++; }
+		virtual void on_node_attribute(const std::string& id, const std::string& value) override { attributes++; }
+		virtual void on_node_attribute(int64_t idx, const std::string& id, const std::string& value) override { attributes++; }
+		virtual void on_property(const std::string& id) override { properties++; }
+		virtual void on_property_attribute(const std::string& id, const std::string& value) override { attributes++; }
+		virtual void on_property_value(const std::string& value) override { if (!value.empty()) values++; }
+		virtual void on_property_value(int64_t idx, const std::string& value) override { values++; }
+		virtual void on_device_end() override {}
+	};
+}
+
+TEST(SerializationTest, MasterRoundTrip) {
+	test_mqtt_client client_a;
+	test_mqtt_client client_b;
+	master a(client_a);
+	master b(client_b);
+	publish_test_device(client_a, "dev1");
+	publish_test_device(client_a, "dev2", 3, 2);
+
+	std::string buf;
+	a.serialize(buf);
+	b.deserialize(buf.data(), buf.size());
+
+	ASSERT_EQ(2, b.get_discovered_devices().size());
+	expect_same_tree(a.get_discovered_device("dev1"), b.get_discovered_device("dev1"));
+	expect_same_tree(a.get_discovered_device("dev2"), b.get_discovered_device("dev2"));
+}
+
+TEST(SerializationTest, GenericDeviceRoundTrip) {
+	test_mqtt_client client_a;
+	test_mqtt_client client_b;
+	master a(client_a);
+	master b(client_b);
+	publish_test_device(client_a, "dev1", 4, 3);
+
+	std::string buf;
+	{
+		serialization::tree_writer wr(buf);
+		wr.write(*a.get_discovered_device("dev1"));
+	}
+	b.deserialize(buf.data(), buf.size());
+	expect_same_tree(a.get_discovered_device("dev1"), b.get_discovered_device("dev1"));
+
+	counting_visitor cnt;
+	serialization::tree_reader rd(buf.data(), buf.size());
+	ASSERT_TRUE(rd.next(cnt));
+	ASSERT_FALSE(rd.next(cnt));
+	ASSERT_EQ(cnt.devices, 1);
+	ASSERT_EQ(cnt.nodes, 4);
+	ASSERT_EQ(cnt.properties, 12);
+	// 2 plain nodes with 3 values each, 2 array nodes with 2 indices
+	ASSERT_EQ(cnt.values, 18);
+}
+
+TEST(SerializationTest, GenericDeviceDeclaredRange) {
+	test_mqtt_client client_a;
+	test_mqtt_client client_b;
+	master a(client_a);
+	master b(client_b);
+	// The declared ranges are not iterated, neither the huge nor the malformed one
+	client_a.handler->on_message("homie/dev1/$homie", "3.0.0");
+	client_a.handler->on_message("homie/dev1/huge/$array", "0-9223372036854775807");
+	client_a.handler->on_message("homie/dev1/huge_9223372036854775807/prop", "1");
+	client_a.handler->on_message("homie/dev1/huge_5/$name", "Five");
+	client_a.handler->on_message("homie/dev1/bad/$array", "x");
+	client_a.handler->on_message("homie/dev1/bad_1/prop", "2");
+	client_a.handler->on_message("homie/dev1/$state", "ready");
+
+	std::string buf;
+	{
+		serialization::tree_writer wr(buf);
+		wr.write(*a.get_discovered_device("dev1"));
+	}
+	b.deserialize(buf.data(), buf.size());
+	expect_same_tree(a.get_discovered_device("dev1"), b.get_discovered_device("dev1"));
+	ASSERT_EQ(std::set<int64_t>({ 5, INT64_MAX }), b.get_discovered_device("dev1")->get_node("huge")->get_indices());
+	ASSERT_EQ("2", b.get_discovered_device("dev1")->get_node("bad")->get_property("prop")->get_value(1));
+}
+
+TEST(SerializationTest, InvalidStream) {
+	counting_visitor cnt;
+	std::string buf = "XXXX";
+	buf.push_back(serialization::format_version);
+	ASSERT_THROW(serialization::tree_reader(buf.data(), buf.size()), std::runtime_error);
+
+	buf.clear();
+	{
+		serialization::tree_writer wr(buf);
+	}
+	buf[serialization::magic_size] = serialization::format_version + 1;
+	ASSERT_THROW(serialization::tree_reader(buf.data(), buf.size()), std::runtime_error);
+
+	test_mqtt_client client;
+	master m(client);
+	publish_test_device(client, "dev1");
+	buf.clear();
+	m.serialize(buf);
+	buf.resize(buf.size() - 3);
+	serialization::tree_reader rd(buf.data(), buf.size());
+	ASSERT_THROW(rd.next(cnt), std::runtime_error);
+}
+
+TEST(SerializationTest, TruncatedSnapshotChangesNothing) {
+	test_mqtt_client client;
+	master m(client);
+	publish_test_device(client, "dev1");
+	publish_test_device(client, "dev2");
+	std::string buf;
+	m.serialize(buf);
+	// The first device record is complete, the second one is cut off
+	buf.resize(buf.size() - 3);
+
+	test_mqtt_client other;
+	master b(other);
+	ASSERT_THROW(b.deserialize(buf.data(), buf.size()), std::runtime_error);
+	ASSERT_TRUE(b.get_discovered_devices().empty());
+}
+
+TEST(SerializationTest, FixedBufferWriter) {
+	test_mqtt_client client;
+	master m(client);
+	publish_test_device(client, "dev1");
+	auto dev = m.get_discovered_device("dev1");
+	std::string buf;
+	{
+		serialization::tree_writer wr(buf);
+		wr.write(*dev);
+	}
+
+	serialization::tree_writer counter;
+	counter.write(*dev);
+	ASSERT_EQ(counter.size(), buf.size());
+
+	std::vector<uint8_t> fixed(buf.size());
+	serialization::tree_writer wr(fixed.data(), fixed.size());
+	wr.write(*dev);
+	ASSERT_EQ(wr.size(), buf.size());
+	ASSERT_EQ(std::string(fixed.begin(), fixed.end()), buf);
+
+	serialization::tree_writer small(fixed.data(), fixed.size() - 1);
+	ASSERT_THROW(small.write(*dev), std::runtime_error);
+}
+
+// Run with --gtest_also_run_disabled_tests
+TEST(SerializationTest, DISABLED_Throughput) {
+	test_mqtt_client client;
+	master m(client);
+	for (int i = 0; i < 1000; i++)
+		publish_test_device(client, "device" + std::to_string(i), 5, 10);
+
+	const int rounds = 20;
+	std::string buf;
+	auto start = std::chrono::steady_clock::now();
+	for (int i = 0; i < rounds; i++) {
+		buf.clear();
+		m.serialize(buf);
+	}
+	auto encode = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+	counting_visitor cnt;
+	start = std::chrono::steady_clock::now();
+	for (int i = 0; i < rounds; i++) {
+		serialization::tree_reader rd(buf.data(), buf.size());
+		rd.read_all(cnt);
+	}
+	auto decode = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+	start = std::chrono::steady_clock::now();
+	for (int i = 0; i < rounds; i++) {
+		test_mqtt_client c;
+		master restored(c);
+		restored.deserialize(buf.data(), buf.size());
+	}
+	auto restore = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+	auto mb = static_cast<double>(buf.size()) * rounds / (1024 * 1024);
+	std::cout << "snapshot size: " << buf.size() << " bytes" << std::endl;
+	std::cout << "encode:  " << mb / encode << " MiB/s" << std::endl;
+	std::cout << "decode:  " << mb / decode << " MiB/s" << std::endl;
+	std::cout << "restore: " << mb / restore << " MiB/s" << std::endl;
+}
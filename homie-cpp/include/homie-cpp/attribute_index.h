@@ -0,0 +1,50 @@
+#pragma once
+#include "utils.h"
+#include <map>
+#include <set>
+
+namespace homie {
+	// Groups objects by the current value of one of their attributes.
+	// Lookups return iterator ranges into the index, which stay valid until the next update.
+	template<typename Key, typename Ptr>
+	class attribute_index {
+		typedef std::set<Ptr> bucket;
+		std::map<Key, bucket> buckets;
+
+		static const bucket& empty_bucket() {
+			static const bucket empty;
+			return empty;
+		}
+	public:
+		typedef typename bucket::const_iterator iterator;
+		typedef utils::range<iterator> range;
+
+		void insert(const Key& key, const Ptr& ptr) {
+			buckets[key].insert(ptr);
+		}
+
+		void erase(const Key& key, const Ptr& ptr) {
+			auto it = buckets.find(key);
+			if (it == buckets.end()) return;
+			it->second.erase(ptr);
+			if (it->second.empty()) buckets.erase(it);
+		}
+
+		void update(const Key& old_key, const Key& new_key, const Ptr& ptr) {
+			if (old_key == new_key) return;
+			erase(old_key, ptr);
+			insert(new_key, ptr);
+		}
+
+		range find(const Key& key) const {
+			auto it = buckets.find(key);
+			auto& b = it == buckets.end() ? empty_bucket() : it->second;
+			return range(b.begin(), b.end(), b.size());
+		}
+
+		size_t count(const Key& key) const {
+			auto it = buckets.find(key);
+			return it == buckets.end() ? 0 : it->second.size();
+		}
+	};
+}
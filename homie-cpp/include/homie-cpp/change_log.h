@@ -0,0 +1,136 @@
+#pragma once
+#include "journal.h"
+#include <atomic>
+#include <limits>
+#include <memory>
+#include <vector>
+
+namespace homie {
+	struct change_delta {
+		// The poller fell behind (or asked for an unknown sequence number) and has to
+		// rescan everything. changes is empty in this case.
+		bool resync = false;
+		// Pass this to the next changes_since call
+		uint64_t sequence = 0;
+		std::vector<change_record> changes;
+	};
+
+	// Bounded ring of recent change records with a single writer and any number of
+	// concurrent, lock free readers. Records are stored encoded in a ring of atomic words,
+	// readers validate after copying (seqlock style) and report a resync if the writer
+	// overwrote what they were reading.
+	class change_log {
+		size_t index_mask;
+		size_t word_capacity;
+		// Word offset (monotonic) of the record with a given sequence number
+		std::unique_ptr<std::atomic<uint64_t>[]> offsets;
+		std::unique_ptr<std::atomic<uint64_t>[]> words;
+		std::atomic<uint64_t> published_seq;
+		std::atomic<uint64_t> reserved_seq;
+		std::atomic<uint64_t> reserved_words;
+
+		// Writer only
+		uint64_t cursor;
+		std::string scratch;
+		change_record rec;
+
+		static size_t round_up_pow2(size_t v) {
+			size_t res = 1;
+			while (res < v) res <<= 1;
+			return res;
+		}
+	public:
+		// records: number of records kept at most, bytes: storage for their encoding
+		explicit change_log(size_t records = 4096, size_t bytes = 1024 * 1024)
+			: index_mask(round_up_pow2(records < 1 ? 1 : records) - 1), word_capacity(bytes < 64 ? 8 : bytes / 8),
+			offsets(new std::atomic<uint64_t>[index_mask + 1]), words(new std::atomic<uint64_t>[word_capacity]),
+			published_seq(0), reserved_seq(0), reserved_words(0), cursor(0)
+		{
+			for (size_t i = 0; i <= index_mask; i++) offsets[i].store(0, std::memory_order_relaxed);
+			for (size_t i = 0; i < word_capacity; i++) words[i].store(0, std::memory_order_relaxed);
+		}
+
+		change_log(const change_log&) = delete;
+		change_log& operator=(const change_log&) = delete;
+
+		// Must only be called from one thread at a time
+		uint64_t append(change_kind kind, const std::string& device, const std::string& node, const std::string& property, const int64_t* idx, const std::string& id, const std::string& value) {
+			auto s = published_seq.load(std::memory_order_relaxed) + 1;
+			rec.seq = s;
+			rec.kind = kind;
+			rec.time = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+			rec.device = device;
+			rec.node = node;
+			rec.property = property;
+			rec.indexed = idx != nullptr;
+			rec.idx = idx != nullptr ? *idx : 0;
+			rec.id = id;
+			rec.value = value;
+			scratch.clear();
+			journal::encode(rec, scratch);
+
+			auto nwords = 1 + (scratch.size() + 7) / 8;
+			auto start = cursor;
+			// Too large for the ring: skip a full ring, which invalidates it for every reader
+			auto end = nwords <= word_capacity ? start + nwords : start + word_capacity + 1;
+
+			reserved_seq.store(s, std::memory_order_relaxed);
+			reserved_words.store(end, std::memory_order_relaxed);
+			std::atomic_thread_fence(std::memory_order_release);
+
+			offsets[s & index_mask].store(start, std::memory_order_relaxed);
+			if (nwords <= word_capacity) {
+				words[start % word_capacity].store(scratch.size(), std::memory_order_relaxed);
+				for (size_t i = 1; i < nwords; i++) {
+					uint64_t w = 0;
+					auto pos = (i - 1) * 8;
+					for (size_t b = 0; b < 8 && pos + b < scratch.size(); b++)
+						w |= static_cast<uint64_t>(static_cast<uint8_t>(scratch[pos + b])) << (b * 8);
+					words[(start + i) % word_capacity].store(w, std::memory_order_relaxed);
+				}
+			}
+			cursor = end;
+			published_seq.store(s, std::memory_order_release);
+			return s;
+		}
+
+		uint64_t last_sequence() const { return published_seq.load(std::memory_order_acquire); }
+
+		// All changes after seq (at most max of them). Safe to call from any thread.
+		change_delta changes_since(uint64_t seq, size_t max = std::numeric_limits<size_t>::max()) const {
+			change_delta res;
+			auto latest = published_seq.load(std::memory_order_acquire);
+			res.sequence = latest;
+			if (seq > latest) {
+				res.resync = true;
+				return res;
+			}
+			std::string buf;
+			for (auto s = seq + 1; s <= latest && res.changes.size() < max; s++) {
+				auto off = offsets[s & index_mask].load(std::memory_order_relaxed);
+				auto len = words[off % word_capacity].load(std::memory_order_relaxed);
+				bool fits = len <= (word_capacity - 1) * 8;
+				if (fits) {
+					buf.resize(len);
+					for (size_t i = 0; i < len; i += 8) {
+						auto w = words[(off + 1 + i / 8) % word_capacity].load(std::memory_order_relaxed);
+						for (size_t b = 0; b < 8 && i + b < len; b++) buf[i + b] = static_cast<char>(w >> (b * 8));
+					}
+				}
+				std::atomic_thread_fence(std::memory_order_acquire);
+				auto rs = reserved_seq.load(std::memory_order_relaxed);
+				auto rw = reserved_words.load(std::memory_order_relaxed);
+				// Index slot or storage reused by a newer record
+				if (!fits || rs > s + index_mask || rw > off + word_capacity) {
+					res.changes.clear();
+					res.resync = true;
+					return res;
+				}
+				res.changes.emplace_back();
+				journal::decode(reinterpret_cast<const uint8_t*>(buf.data()), buf.size(), res.changes.back());
+				res.sequence = s;
+			}
+			return res;
+		}
+	};
+}
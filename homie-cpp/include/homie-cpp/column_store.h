@@ -0,0 +1,378 @@
+#pragma once
+#include "handle_table.h"
+#include "datatype.h"
+#include "utils.h"
+#include <map>
+#include <string>
+#include <tuple>
+#include <vector>
+#include <limits>
+#include <cmath>
+#include <algorithm>
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define HOMIE_COLUMN_SSE2
+#endif
+
+namespace homie {
+	enum class compare_op {
+		less,
+		less_equal,
+		greater,
+		greater_equal,
+		equal
+	};
+
+	struct column_stats {
+		size_t count = 0;
+		double sum = 0;
+		double min = 0;
+		double max = 0;
+
+		double mean() const { return count == 0 ? 0 : sum / static_cast<double>(count); }
+	};
+
+	// Row index used for values of non array nodes
+	constexpr int64_t no_index = std::numeric_limits<int64_t>::min();
+
+	struct column_row {
+		property_handle prop;
+		int64_t idx;
+
+		bool is_indexed() const { return idx != no_index; }
+	};
+
+	namespace detail {
+		inline column_stats aggregate(const double* v, size_t n) {
+			column_stats res;
+			if (n == 0) return res;
+			res.count = n;
+			size_t i = 0;
+			double sum = 0;
+			double mn = v[0];
+			double mx = v[0];
+#ifdef HOMIE_COLUMN_SSE2
+			if (n >= 4) {
+				__m128d s0 = _mm_setzero_pd(), s1 = _mm_setzero_pd();
+				__m128d mn0 = _mm_loadu_pd(v), mn1 = _mm_loadu_pd(v + 2);
+				__m128d mx0 = mn0, mx1 = mn1;
+				for (; i + 4 <= n; i += 4) {
+					auto a = _mm_loadu_pd(v + i);
+					auto b = _mm_loadu_pd(v + i + 2);
+					s0 = _mm_add_pd(s0, a);
+					s1 = _mm_add_pd(s1, b);
+					mn0 = _mm_min_pd(mn0, a);
+					mn1 = _mm_min_pd(mn1, b);
+					mx0 = _mm_max_pd(mx0, a);
+					mx1 = _mm_max_pd(mx1, b);
+				}
+				double tmp[2];
+				_mm_storeu_pd(tmp, _mm_add_pd(s0, s1));
+				sum = tmp[0] + tmp[1];
+				_mm_storeu_pd(tmp, _mm_min_pd(mn0, mn1));
+				mn = std::min(tmp[0], tmp[1]);
+				_mm_storeu_pd(tmp, _mm_max_pd(mx0, mx1));
+				mx = std::max(tmp[0], tmp[1]);
+			}
+#else
+			if (n >= 4) {
+				// Independent accumulators, lets the compiler vectorize the loop
+				double s[4] = { 0, 0, 0, 0 };
+				double lo[4] = { v[0], v[1], v[2], v[3] };
+				double hi[4] = { v[0], v[1], v[2], v[3] };
+				for (; i + 4 <= n; i += 4) {
+					for (size_t k = 0; k < 4; k++) {
+						s[k] += v[i + k];
+						lo[k] = v[i + k] < lo[k] ? v[i + k] : lo[k];
+						hi[k] = v[i + k] > hi[k] ? v[i + k] : hi[k];
+					}
+				}
+				sum = (s[0] + s[1]) + (s[2] + s[3]);
+				mn = std::min(std::min(lo[0], lo[1]), std::min(lo[2], lo[3]));
+				mx = std::max(std::max(hi[0], hi[1]), std::max(hi[2], hi[3]));
+			}
+#endif
+			for (; i < n; i++) {
+				sum += v[i];
+				mn = std::min(mn, v[i]);
+				mx = std::max(mx, v[i]);
+			}
+			res.sum = sum;
+			res.min = mn;
+			res.max = mx;
+			return res;
+		}
+
+		inline column_stats aggregate(const int64_t* v, size_t n) {
+			column_stats res;
+			if (n == 0) return res;
+			res.count = n;
+			size_t i = 0;
+			double s[4] = { 0, 0, 0, 0 };
+			int64_t lo[4] = { v[0], v[0], v[0], v[0] };
+			int64_t hi[4] = { v[0], v[0], v[0], v[0] };
+			for (; i + 4 <= n; i += 4) {
+				for (size_t k = 0; k < 4; k++) {
+					s[k] += static_cast<double>(v[i + k]);
+					lo[k] = v[i + k] < lo[k] ? v[i + k] : lo[k];
+					hi[k] = v[i + k] > hi[k] ? v[i + k] : hi[k];
+				}
+			}
+			for (; i < n; i++) {
+				s[0] += static_cast<double>(v[i]);
+				lo[0] = std::min(lo[0], v[i]);
+				hi[0] = std::max(hi[0], v[i]);
+			}
+			res.sum = (s[0] + s[1]) + (s[2] + s[3]);
+			res.min = static_cast<double>(std::min(std::min(lo[0], lo[1]), std::min(lo[2], lo[3])));
+			res.max = static_cast<double>(std::max(std::max(hi[0], hi[1]), std::max(hi[2], hi[3])));
+			return res;
+		}
+
+		// Branch free counting/selection of all values in [lo, hi]
+		template<typename T>
+		inline size_t count_range(const T* v, size_t n, T lo, T hi) {
+			size_t c[4] = { 0, 0, 0, 0 };
+			size_t i = 0;
+			for (; i + 4 <= n; i += 4) {
+				for (size_t k = 0; k < 4; k++)
+					c[k] += (v[i + k] >= lo) & (v[i + k] <= hi);
+			}
+			for (; i < n; i++) c[0] += (v[i] >= lo) & (v[i] <= hi);
+			return c[0] + c[1] + c[2] + c[3];
+		}
+
+		template<typename T>
+		inline void select_range(const T* v, size_t n, T lo, T hi, std::vector<size_t>& out) {
+			for (size_t i = 0; i < n; i++) {
+				if ((v[i] >= lo) & (v[i] <= hi)) out.push_back(i);
+			}
+		}
+
+		// Translate a threshold into an inclusive range, returns false if nothing can match
+		inline bool to_range(compare_op op, double t, double& lo, double& hi) {
+			lo = std::numeric_limits<double>::lowest();
+			hi = std::numeric_limits<double>::max();
+			switch (op) {
+			case compare_op::less: hi = std::nextafter(t, lo); break;
+			case compare_op::less_equal: hi = t; break;
+			case compare_op::greater: lo = std::nextafter(t, hi); break;
+			case compare_op::greater_equal: lo = t; break;
+			case compare_op::equal: lo = hi = t; break;
+			}
+			return lo <= hi;
+		}
+
+		inline bool to_range(compare_op op, double t, int64_t& lo, int64_t& hi) {
+			// 2^63, exactly representable
+			const double limit = 9223372036854775808.0;
+			lo = std::numeric_limits<int64_t>::min();
+			hi = std::numeric_limits<int64_t>::max();
+			double b;
+			switch (op) {
+			case compare_op::less:
+			case compare_op::less_equal:
+				b = op == compare_op::less ? std::ceil(t) - 1 : std::floor(t);
+				if (b < -limit) return false;
+				if (b < limit) hi = static_cast<int64_t>(b);
+				break;
+			case compare_op::greater:
+			case compare_op::greater_equal:
+				b = op == compare_op::greater ? std::floor(t) + 1 : std::ceil(t);
+				if (b >= limit) return false;
+				if (b > -limit) lo = static_cast<int64_t>(b);
+				break;
+			case compare_op::equal:
+				if (std::floor(t) != t || t >= limit || t < -limit) return false;
+				lo = hi = static_cast<int64_t>(t);
+				break;
+			}
+			return lo <= hi;
+		}
+	}
+
+	// Dense column holding the values of one property id across all nodes of a type.
+	// Integer columns store int64 values, number columns doubles. Row order is unspecified.
+	class numeric_column {
+		friend class column_store;
+
+		datatype type;
+		std::vector<int64_t> ints;
+		std::vector<double> reals;
+		std::vector<column_row> rows;
+
+		bool parse(const std::string& payload, int64_t& i, double& d) const {
+			if (type == datatype::integer) return utils::parse_int(payload, 0, payload.size(), i);
+			return utils::parse_double(payload, d);
+		}
+
+		bool assign(size_t pos, const std::string& payload) {
+			int64_t i = 0;
+			double d = 0;
+			if (!parse(payload, i, d)) return false;
+			if (type == datatype::integer) ints[pos] = i;
+			else reals[pos] = d;
+			return true;
+		}
+
+		bool push(const column_row& row, const std::string& payload) {
+			int64_t i = 0;
+			double d = 0;
+			if (!parse(payload, i, d)) return false;
+			if (type == datatype::integer) ints.push_back(i);
+			else reals.push_back(d);
+			rows.push_back(row);
+			return true;
+		}
+
+		// Swap remove, returns true if the last row was moved into pos
+		bool remove(size_t pos) {
+			auto last = rows.size() - 1;
+			if (type == datatype::integer) {
+				ints[pos] = ints[last];
+				ints.pop_back();
+			}
+			else {
+				reals[pos] = reals[last];
+				reals.pop_back();
+			}
+			rows[pos] = rows[last];
+			rows.pop_back();
+			return pos != last;
+		}
+
+		template<typename T>
+		size_t count_typed(const std::vector<T>& v, compare_op op, double threshold) const {
+			T lo, hi;
+			if (!detail::to_range(op, threshold, lo, hi)) return 0;
+			return detail::count_range(v.data(), v.size(), lo, hi);
+		}
+
+		template<typename T>
+		void select_typed(const std::vector<T>& v, compare_op op, double threshold, std::vector<size_t>& out) const {
+			T lo, hi;
+			if (!detail::to_range(op, threshold, lo, hi)) return;
+			detail::select_range(v.data(), v.size(), lo, hi, out);
+		}
+	public:
+		explicit numeric_column(datatype t)
+			: type(t)
+		{}
+
+		datatype get_type() const { return type; }
+		size_t size() const { return rows.size(); }
+		const column_row& row(size_t pos) const { return rows[pos]; }
+		double value(size_t pos) const { return type == datatype::integer ? static_cast<double>(ints[pos]) : reals[pos]; }
+
+		// Raw storage, only the one matching get_type() is filled
+		const std::vector<int64_t>& int_values() const { return ints; }
+		const std::vector<double>& real_values() const { return reals; }
+
+		column_stats aggregate() const {
+			if (type == datatype::integer) return detail::aggregate(ints.data(), ints.size());
+			return detail::aggregate(reals.data(), reals.size());
+		}
+
+		size_t count(compare_op op, double threshold) const {
+			if (type == datatype::integer) return count_typed(ints, op, threshold);
+			return count_typed(reals, op, threshold);
+		}
+
+		// Positions of all rows matching the threshold
+		std::vector<size_t> scan(compare_op op, double threshold) const {
+			std::vector<size_t> res;
+			if (type == datatype::integer) select_typed(ints, op, threshold, res);
+			else select_typed(reals, op, threshold, res);
+			return res;
+		}
+
+		std::vector<column_row> select(compare_op op, double threshold) const {
+			std::vector<column_row> res;
+			for (auto pos : scan(op, threshold)) res.push_back(rows[pos]);
+			return res;
+		}
+	};
+
+	// Columns keyed by (node type, property id, datatype), devices declaring the same property
+	// with different datatypes end up in different columns. Only integer and number properties
+	// are stored, values that fail to parse as their datatype are left out and counted.
+	class column_store {
+		typedef std::tuple<std::string, std::string, datatype> column_key;
+		struct location {
+			numeric_column* column;
+			size_t pos;
+		};
+
+		std::map<column_key, numeric_column> columns;
+		// Keyed by (handle index, array index)
+		std::map<std::pair<uint32_t, int64_t>, location> locations;
+		size_t rejected = 0;
+
+		void remove(std::map<std::pair<uint32_t, int64_t>, location>::iterator it) {
+			auto col = it->second.column;
+			auto pos = it->second.pos;
+			locations.erase(it);
+			if (col->remove(pos)) {
+				auto& moved = col->rows[pos];
+				locations[{ moved.prop.index, moved.idx }].pos = pos;
+			}
+		}
+	public:
+		void set(property_handle prop, int64_t idx, const std::string& node_type, const std::string& property, datatype type, const std::string& payload) {
+			auto it = locations.find({ prop.index, idx });
+			if (type != datatype::integer && type != datatype::number) {
+				if (it != locations.end()) remove(it);
+				return;
+			}
+			if (it != locations.end()) {
+				if (it->second.column->get_type() == type) {
+					if (it->second.column->assign(it->second.pos, payload)) return;
+					remove(it);
+					rejected++;
+					return;
+				}
+				// The datatype changed, the row moves to the column of the new type
+				remove(it);
+			}
+			column_key key{ node_type, property, type };
+			auto col = columns.find(key);
+			if (col == columns.end()) col = columns.emplace(key, numeric_column(type)).first;
+			if (col->second.push({ prop, idx }, payload))
+				locations[{ prop.index, idx }] = { &col->second, col->second.size() - 1 };
+			else rejected++;
+		}
+
+		// Remove all rows of a property
+		void erase(property_handle prop) {
+			auto it = locations.lower_bound({ prop.index, std::numeric_limits<int64_t>::min() });
+			while (it != locations.end() && it->first.first == prop.index) {
+				// remove() only erases it, other iterators stay valid
+				auto next = std::next(it);
+				remove(it);
+				it = next;
+			}
+		}
+
+		const numeric_column* find(const std::string& node_type, const std::string& property, datatype type) const {
+			auto it = columns.find(column_key{ node_type, property, type });
+			return it != columns.end() ? &it->second : nullptr;
+		}
+
+		// The integer column, or the number column if no device declared the property as integer
+		const numeric_column* find(const std::string& node_type, const std::string& property) const {
+			auto res = find(node_type, property, datatype::integer);
+			return res != nullptr ? res : find(node_type, property, datatype::number);
+		}
+
+		size_t size() const { return columns.size(); }
+		size_t rows() const { return locations.size(); }
+		// Values that did not parse as the datatype of their property
+		size_t rejected_values() const { return rejected; }
+
+		void clear() {
+			columns.clear();
+			locations.clear();
+			rejected = 0;
+		}
+	};
+}
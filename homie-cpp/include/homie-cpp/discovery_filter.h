@@ -0,0 +1,89 @@
+#pragma once
+#include "utils.h"
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <set>
+
+namespace homie {
+	// Restricts which devices and nodes a master discovers.
+	// Empty members do not restrict anything.
+	struct discovery_filter {
+		// Exact device ids, these are turned into dedicated subscriptions
+		std::set<std::string, utils::slice_less> device_ids;
+		// Glob patterns ('*' and '?') matched against the device id.
+		// Patterns can not be expressed in mqtt, so they require a wildcard subscription.
+		std::vector<std::string> device_patterns;
+		// Node types to keep, nodes with a different $type are dropped
+		std::set<std::string> node_types;
+		// Hash partitioning: if partition_count is not zero only devices whose partition_of(id)
+		// is in partitions are kept (in addition to the rules above)
+		uint32_t partition_count = 0;
+		std::set<uint32_t> partitions;
+
+		bool restricts_devices() const { return !device_ids.empty() || !device_patterns.empty() || partition_count != 0; }
+
+		// FNV-1a, stable across processes and platforms
+		static uint32_t hash_id(const char* id, size_t len) {
+			uint32_t h = 2166136261u;
+			for (size_t i = 0; i < len; i++) {
+				h ^= static_cast<uint8_t>(id[i]);
+				h *= 16777619u;
+			}
+			return h;
+		}
+
+		uint32_t partition_of(const char* id, size_t len) const {
+			return partition_count == 0 ? 0 : hash_id(id, len) % partition_count;
+		}
+
+		uint32_t partition_of(const std::string& id) const {
+			return partition_of(id.data(), id.size());
+		}
+
+		// Check the device id topic.substr(pos, len) without allocating
+		bool match_device(const std::string& topic, size_t pos, size_t len) const {
+			if (partition_count != 0 && partitions.count(partition_of(topic.data() + pos, len)) == 0) return false;
+			if (device_ids.empty() && device_patterns.empty()) return true;
+			if (device_ids.find(utils::string_slice{ topic, pos, len }) != device_ids.end()) return true;
+			for (auto& p : device_patterns) {
+				if (utils::glob_match(p.data(), p.size(), topic.data() + pos, len)) return true;
+			}
+			return false;
+		}
+
+		bool match_device(const std::string& id) const {
+			return match_device(id, 0, id.size());
+		}
+
+		bool match_node_type(const std::string& type) const {
+			return node_types.empty() || node_types.count(type) != 0;
+		}
+
+		// Topics a master needs to subscribe to below base_topic
+		std::vector<std::string> subscriptions(const std::string& base_topic) const {
+			std::vector<std::string> res;
+			if (device_ids.empty() || !device_patterns.empty()) {
+				res.push_back(base_topic + "#");
+			}
+			else {
+				for (auto& id : device_ids) res.push_back(base_topic + id + "/#");
+				res.push_back(base_topic + "$broadcast/#");
+			}
+			return res;
+		}
+
+		// Topics needed to follow only the $state of matching devices
+		std::vector<std::string> state_subscriptions(const std::string& base_topic) const {
+			std::vector<std::string> res;
+			if (device_ids.empty() || !device_patterns.empty()) {
+				res.push_back(base_topic + "+/$state");
+			}
+			else {
+				for (auto& id : device_ids) res.push_back(base_topic + id + "/$state");
+			}
+			res.push_back(base_topic + "$broadcast/#");
+			return res;
+		}
+	};
+}
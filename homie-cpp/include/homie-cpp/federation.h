@@ -0,0 +1,483 @@
+#pragma once
+#include "master.h"
+#include <algorithm>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+namespace homie {
+	// Receives value changes of watched properties of a federation, device is the namespaced id
+	typedef std::function<void(const std::string& device, const property_ptr& prop, int64_t idx, const std::string& value)> federated_watch_callback;
+
+	// Ingests several connections (brokers and/or base topics) into one registry. Every member
+	// is a master of its own, bound to its connection through a proxy that takes a per member
+	// lock for every event. Messages of different connections are therefore parsed in parallel
+	// on their connection threads, while queries of the federation are serialized per member.
+	// Members may share a connection with different base topics, its events are passed to all
+	// of them. Devices are addressed as "<namespace>/<device id>".
+	//
+	// Watch callbacks are queued while their member is locked and run on the same thread once the
+	// lock is released, so they may query the federation. The property passed to them is not
+	// locked anymore, values have to be taken from the callback arguments or through visit.
+	class federated_master {
+		struct member;
+		typedef std::shared_ptr<member> member_ptr;
+
+		struct member_sync {
+			std::recursive_mutex mutex;
+			// Guarded by mutex: nesting depth and the callbacks waiting for the outermost unlock
+			int depth = 0;
+			std::vector<std::function<void()>> deferred;
+		};
+
+		// Locks a member and runs the callbacks deferred meanwhile after unlocking, so no member
+		// lock is held while a callback locks other members
+		class member_lock {
+			member_sync& sync;
+		public:
+			explicit member_lock(member_sync& s)
+				: sync(s)
+			{
+				sync.mutex.lock();
+				sync.depth++;
+			}
+
+			~member_lock() {
+				std::vector<std::function<void()>> run;
+				if (--sync.depth == 0) run.swap(sync.deferred);
+				sync.mutex.unlock();
+				for (auto& f : run) f();
+			}
+
+			member_lock(const member_lock&) = delete;
+			member_lock& operator=(const member_lock&) = delete;
+		};
+
+		// Event handler of a real client, passes its events to every member using it. Members are
+		// copied under the connection lock and called without it, so the connection lock is never
+		// held while locking a member.
+		class shared_connection : private mqtt_event_handler {
+			mqtt_client& client;
+			std::mutex lock;
+			std::vector<std::weak_ptr<member>> members;
+			bool opened;
+			bool closed;
+
+			std::vector<member_ptr> snapshot() {
+				std::lock_guard<std::mutex> lck(lock);
+				std::vector<member_ptr> res;
+				for (auto& w : members) {
+					if (auto mb = w.lock()) res.push_back(std::move(mb));
+				}
+				return res;
+			}
+
+			virtual void on_connect(bool session_present, bool reconnected) override {
+				for (auto& mb : snapshot()) mb->client.on_connect(session_present, reconnected);
+			}
+			virtual void on_closing() override {
+				for (auto& mb : snapshot()) mb->client.on_closing();
+			}
+			virtual void on_closed() override {
+				for (auto& mb : snapshot()) mb->client.on_closed();
+			}
+			virtual void on_offline() override {
+				for (auto& mb : snapshot()) mb->client.on_offline();
+			}
+			virtual void on_message(const std::string& topic, const std::string& payload) override {
+				for (auto& mb : snapshot()) mb->client.on_message(topic, payload);
+			}
+		public:
+			explicit shared_connection(mqtt_client& c)
+				: client(c), opened(false), closed(false)
+			{
+				client.set_event_handler(this);
+			}
+
+			~shared_connection() {
+				close();
+			}
+
+			mqtt_client& get_client() const { return client; }
+
+			void attach(const member_ptr& mb) {
+				std::lock_guard<std::mutex> lck(lock);
+				members.push_back(mb);
+			}
+
+			// True if no member is left
+			bool detach(const member* mb) {
+				std::lock_guard<std::mutex> lck(lock);
+				members.erase(std::remove_if(members.begin(), members.end(), [mb](const std::weak_ptr<member>& w) {
+					auto p = w.lock();
+					return !p || p.get() == mb;
+				}), members.end());
+				return members.empty();
+			}
+
+			// The first member opens the client, later ones continue on the open connection
+			bool claim_open() {
+				std::lock_guard<std::mutex> lck(lock);
+				if (opened) return false;
+				opened = true;
+				return true;
+			}
+
+			// Releases the client once the last member is gone
+			void close() {
+				if (closed) return;
+				closed = true;
+				client.set_event_handler(nullptr);
+			}
+		};
+
+		// Client of a member master, locks the member for all events passed to it
+		class locked_client : public mqtt_client {
+			shared_connection& connection;
+			member_sync& lock;
+			mqtt_event_handler* handler;
+		public:
+			locked_client(shared_connection& c, member_sync& l)
+				: connection(c), lock(l), handler(nullptr)
+			{}
+
+			void on_connect(bool session_present, bool reconnected) {
+				member_lock lck(lock);
+				if (handler) handler->on_connect(session_present, reconnected);
+			}
+			void on_closing() {
+				member_lock lck(lock);
+				if (handler) handler->on_closing();
+			}
+			void on_closed() {
+				member_lock lck(lock);
+				if (handler) handler->on_closed();
+			}
+			void on_offline() {
+				member_lock lck(lock);
+				if (handler) handler->on_offline();
+			}
+			void on_message(const std::string& topic, const std::string& payload) {
+				member_lock lck(lock);
+				if (handler) handler->on_message(topic, payload);
+			}
+
+			virtual void set_event_handler(mqtt_event_handler* evt) override {
+				member_lock lck(lock);
+				handler = evt;
+			}
+			virtual void open(const std::string& will_topic, const std::string& will_payload, int will_qos, bool will_retain) override {
+				if (connection.claim_open()) connection.get_client().open(will_topic, will_payload, will_qos, will_retain);
+				else if (is_connected()) on_connect(false, false);
+			}
+			virtual void open() override {
+				if (connection.claim_open()) connection.get_client().open();
+				else if (is_connected()) on_connect(false, false);
+			}
+			virtual void publish(const std::string& topic, const std::string& payload, int qos, bool retain) override {
+				connection.get_client().publish(topic, payload, qos, retain);
+			}
+			virtual void publish_batch(const mqtt_batch& batch) override { connection.get_client().publish_batch(batch); }
+			virtual void subscribe(const std::string& topic, int qos) override { connection.get_client().subscribe(topic, qos); }
+			virtual void unsubscribe(const std::string& topic) override { connection.get_client().unsubscribe(topic); }
+			virtual bool is_connected() const override { return connection.get_client().is_connected(); }
+		};
+
+		struct member {
+			std::string ns;
+			std::string base_topic;
+			member_sync lock;
+			std::shared_ptr<shared_connection> connection;
+			locked_client client;
+			// Reset (under lock) when the member is removed
+			std::unique_ptr<homie::master> master;
+
+			member(const std::string& n, const std::string& base, const std::shared_ptr<shared_connection>& c)
+				: ns(n), base_topic(base), connection(c), client(*c, lock)
+			{}
+		};
+
+		struct federated_watch {
+			std::string ns;
+			std::string device;
+			std::string node;
+			std::string property;
+			federated_watch_callback callback;
+			std::vector<std::pair<member_ptr, watch_token>> tokens;
+		};
+
+		// Guards members, connections and watches. Never held while locking a member.
+		mutable std::mutex registry_lock;
+		std::map<std::string, member_ptr> members;
+		std::map<mqtt_client*, std::weak_ptr<shared_connection>> connections;
+		std::map<watch_token, std::shared_ptr<federated_watch>> watches;
+		watch_token next_watch;
+
+		std::vector<member_ptr> snapshot() const {
+			std::lock_guard<std::mutex> lck(registry_lock);
+			std::vector<member_ptr> res;
+			for (auto& e : members) res.push_back(e.second);
+			return res;
+		}
+
+		member_ptr find_member(const std::string& ns) const {
+			std::lock_guard<std::mutex> lck(registry_lock);
+			auto it = members.find(ns);
+			return it != members.end() ? it->second : nullptr;
+		}
+
+		// Master callbacks only run with the member locked, they are queued until it is released
+		static watch_token bind_watch(member& mb, const std::shared_ptr<federated_watch>& w) {
+			auto ns = mb.ns;
+			auto cb = w->callback;
+			auto sync = &mb.lock;
+			member_lock lck(mb.lock);
+			if (!mb.master) return 0;
+			return mb.master->watch(w->device, w->node, w->property, [ns, cb, sync](const property_ptr& prop, int64_t idx, const std::string& value) {
+				auto id = make_id(ns, prop->get_node()->get_device()->get_id());
+				sync->deferred.push_back([cb, id, prop, idx, value]() { cb(id, prop, idx, value); });
+			});
+		}
+
+		static void unbind_watch(member& mb, watch_token token) {
+			member_lock lck(mb.lock);
+			if (mb.master) mb.master->unwatch(token);
+		}
+
+		// Records the token, or drops it if the watch was removed in the meantime
+		void store_token(watch_token id, const member_ptr& mb, watch_token token) {
+			if (token == 0) return;
+			{
+				std::lock_guard<std::mutex> lck(registry_lock);
+				auto it = watches.find(id);
+				if (it != watches.end()) {
+					it->second->tokens.emplace_back(mb, token);
+					return;
+				}
+			}
+			unbind_watch(*mb, token);
+		}
+
+		template<typename F>
+		auto with_device(const std::string& id, F&& f) const -> decltype(f(std::declval<homie::master&>(), std::string())) {
+			std::string ns, dev;
+			if (!split_id(id, ns, dev)) return decltype(f(std::declval<homie::master&>(), std::string()))();
+			auto mb = find_member(ns);
+			if (!mb) return decltype(f(std::declval<homie::master&>(), std::string()))();
+			member_lock lck(mb->lock);
+			if (!mb->master) return decltype(f(std::declval<homie::master&>(), std::string()))();
+			return f(*mb->master, dev);
+		}
+
+		// Throws if ns or the combination of client and base topic is taken
+		void check_available(const std::string& ns, const std::shared_ptr<shared_connection>& conn, const std::string& base_topic) const {
+			if (members.count(ns) != 0) throw std::invalid_argument("namespace already in use");
+			for (auto& e : members) {
+				if (e.second->connection == conn && e.second->base_topic == base_topic) throw std::invalid_argument("base topic already in use on this client");
+			}
+		}
+
+		// Removes mb from its connection and releases the client if it was the last member
+		void detach(const member_ptr& mb) {
+			std::lock_guard<std::mutex> lck(registry_lock);
+			if (!mb->connection->detach(mb.get())) return;
+			mb->connection->close();
+			auto it = connections.find(&mb->connection->get_client());
+			if (it != connections.end() && it->second.lock() == mb->connection) connections.erase(it);
+		}
+	public:
+		federated_master()
+			: next_watch(1)
+		{}
+
+		federated_master(const federated_master&) = delete;
+		federated_master& operator=(const federated_master&) = delete;
+
+		static std::string make_id(const std::string& ns, const std::string& device) {
+			return ns + "/" + device;
+		}
+
+		static bool split_id(const std::string& id, std::string& ns, std::string& device) {
+			auto pos = id.find('/');
+			if (pos == std::string::npos) return false;
+			ns = id.substr(0, pos);
+			device = id.substr(pos + 1);
+			return true;
+		}
+
+		// Adds a connection under namespace ns (which must not contain '/'). The client has to
+		// outlive the member. A client can be shared by members with different base topics.
+		void add_member(const std::string& ns, mqtt_client& client, const std::string& base_topic = "homie/") {
+			if (ns.empty() || ns.find('/') != std::string::npos) throw std::invalid_argument("invalid namespace");
+			member_ptr mb;
+			{
+				std::lock_guard<std::mutex> lck(registry_lock);
+				auto conn = connections[&client].lock();
+				if (!conn) {
+					conn = std::make_shared<shared_connection>(client);
+					connections[&client] = conn;
+				}
+				check_available(ns, conn, base_topic);
+				mb = std::make_shared<member>(ns, base_topic, conn);
+				conn->attach(mb);
+			}
+			{
+				member_lock lck(mb->lock);
+				mb->master.reset(new homie::master(mb->client, base_topic));
+			}
+			std::vector<std::pair<watch_token, std::shared_ptr<federated_watch>>> pending;
+			try {
+				std::lock_guard<std::mutex> lck(registry_lock);
+				// Checked again, a concurrent add_member might have taken it meanwhile
+				check_available(ns, mb->connection, base_topic);
+				members.emplace(ns, mb);
+				for (auto& w : watches) {
+					if (watch_entry::match(w.second->ns, ns)) pending.emplace_back(w.first, w.second);
+				}
+			}
+			catch (...) {
+				detach(mb);
+				member_lock lck(mb->lock);
+				mb->master.reset();
+				throw;
+			}
+			for (auto& w : pending) store_token(w.first, mb, bind_watch(*mb, w.second));
+		}
+
+		void remove_member(const std::string& ns) {
+			member_ptr mb;
+			{
+				std::lock_guard<std::mutex> lck(registry_lock);
+				auto it = members.find(ns);
+				if (it == members.end()) return;
+				mb = it->second;
+				members.erase(it);
+				for (auto& w : watches) {
+					auto& t = w.second->tokens;
+					t.erase(std::remove_if(t.begin(), t.end(), [&](const std::pair<member_ptr, watch_token>& e) { return e.first == mb; }), t.end());
+				}
+			}
+			// Other members on the same client keep receiving its events
+			detach(mb);
+			member_lock lck(mb->lock);
+			mb->master.reset();
+		}
+
+		std::vector<std::string> get_namespaces() const {
+			std::vector<std::string> res;
+			for (auto& mb : snapshot()) res.push_back(mb->ns);
+			return res;
+		}
+
+		// Runs f(master&) with the member locked, false if there is no such member.
+		// f must not access other members, watch callbacks it triggers run after it returned.
+		template<typename F>
+		bool visit(const std::string& ns, F&& f) {
+			auto mb = find_member(ns);
+			if (!mb) return false;
+			member_lock lck(mb->lock);
+			if (!mb->master) return false;
+			f(*mb->master);
+			return true;
+		}
+
+		std::vector<std::string> get_device_ids() const {
+			std::vector<std::string> res;
+			for (auto& mb : snapshot()) {
+				member_lock lck(mb->lock);
+				if (!mb->master) continue;
+				for (auto& d : mb->master->get_discovered_devices()) res.push_back(make_id(mb->ns, d->get_id()));
+			}
+			return res;
+		}
+
+		std::vector<std::string> get_device_ids(device_state state) const {
+			std::vector<std::string> res;
+			for (auto& mb : snapshot()) {
+				member_lock lck(mb->lock);
+				if (!mb->master) continue;
+				for (auto& d : mb->master->get_devices_by_state(state)) res.push_back(make_id(mb->ns, d->get_id()));
+			}
+			return res;
+		}
+
+		size_t get_device_count(device_state state) const {
+			size_t res = 0;
+			for (auto& mb : snapshot()) {
+				member_lock lck(mb->lock);
+				if (mb->master) res += mb->master->get_device_count(state);
+			}
+			return res;
+		}
+
+		// Copy of the current value, empty if unknown
+		std::string get_value(const std::string& device, const std::string& node, const std::string& property) const {
+			return with_device(device, [&](homie::master& m, const std::string& id) {
+				return m.value(m.find_property(id, node, property));
+			});
+		}
+
+		std::string get_value(const std::string& device, const std::string& node, int64_t idx, const std::string& property) const {
+			return with_device(device, [&](homie::master& m, const std::string& id) {
+				return m.value(m.find_property(id, node, property), idx);
+			});
+		}
+
+		// Publishes to the set topic through the connection of the device, false if it is unknown
+		bool set_value(const std::string& device, const std::string& node, const std::string& property, const std::string& value) {
+			return with_device(device, [&](homie::master& m, const std::string& id) {
+				auto prop = m.get_property(m.find_property(id, node, property));
+				if (prop) prop->set_value(value);
+				return prop != nullptr;
+			});
+		}
+
+		bool set_value(const std::string& device, const std::string& node, int64_t idx, const std::string& property, const std::string& value) {
+			return with_device(device, [&](homie::master& m, const std::string& id) {
+				auto prop = m.get_property(m.find_property(id, node, property));
+				if (prop) prop->set_value(idx, value);
+				return prop != nullptr;
+			});
+		}
+
+		// Like master::watch. device is "<namespace>/<device>", both parts being glob patterns,
+		// a pattern without '/' matches devices of every namespace. Applies to members added later.
+		watch_token watch(const std::string& device, const std::string& node, const std::string& property, federated_watch_callback callback) {
+			auto w = std::make_shared<federated_watch>();
+			if (!split_id(device, w->ns, w->device)) {
+				w->ns = "*";
+				w->device = device;
+			}
+			w->node = node;
+			w->property = property;
+			w->callback = std::move(callback);
+			watch_token id;
+			std::vector<member_ptr> matching;
+			{
+				std::lock_guard<std::mutex> lck(registry_lock);
+				id = next_watch++;
+				watches.emplace(id, w);
+				for (auto& e : members) {
+					if (watch_entry::match(w->ns, e.first)) matching.push_back(e.second);
+				}
+			}
+			for (auto& mb : matching) store_token(id, mb, bind_watch(*mb, w));
+			return id;
+		}
+
+		void unwatch(watch_token token) {
+			std::shared_ptr<federated_watch> w;
+			{
+				std::lock_guard<std::mutex> lck(registry_lock);
+				auto it = watches.find(token);
+				if (it == watches.end()) return;
+				w = it->second;
+				watches.erase(it);
+			}
+			for (auto& t : w->tokens) unbind_watch(*t.first, t.second);
+		}
+	};
+}
@@ -0,0 +1,115 @@
+#pragma once
+#include <map>
+#include <set>
+#include <vector>
+#include <cstdint>
+#include <utility>
+#include <limits>
+
+namespace homie {
+	typedef uint32_t aggregate_id;
+
+	enum class aggregate_field {
+		count,
+		sum,
+		min,
+		max,
+		mean
+	};
+
+	// Incrementally maintained count/sum/min/max over a set of keyed values.
+	// Updates are O(log n), all reads are O(1).
+	class fleet_aggregate {
+	public:
+		// (handle index, array index)
+		typedef std::pair<uint32_t, int64_t> key;
+	private:
+		struct threshold {
+			aggregate_field field;
+			double value;
+			bool above;
+		};
+
+		aggregate_id id;
+		std::map<key, double> values;
+		std::multiset<double> ordered;
+		double total;
+		std::vector<threshold> thresholds;
+
+		void remove_value(double v) {
+			ordered.erase(ordered.find(v));
+			total -= v;
+		}
+	public:
+		explicit fleet_aggregate(aggregate_id i)
+			: id(i), total(0)
+		{}
+
+		aggregate_id get_id() const { return id; }
+		size_t count() const { return values.size(); }
+		double sum() const { return total; }
+		double min() const { return ordered.empty() ? 0 : *ordered.begin(); }
+		double max() const { return ordered.empty() ? 0 : *ordered.rbegin(); }
+		double mean() const { return values.empty() ? 0 : total / static_cast<double>(values.size()); }
+
+		double get(aggregate_field field) const {
+			switch (field) {
+			case aggregate_field::count: return static_cast<double>(count());
+			case aggregate_field::sum: return sum();
+			case aggregate_field::min: return min();
+			case aggregate_field::max: return max();
+			case aggregate_field::mean: return mean();
+			}
+			return 0;
+		}
+
+		void set(const key& k, double v) {
+			auto it = values.find(k);
+			if (it != values.end()) {
+				if (it->second == v) return;
+				remove_value(it->second);
+				it->second = v;
+			}
+			else values.emplace(k, v);
+			ordered.insert(v);
+			total += v;
+		}
+
+		void erase(const key& k) {
+			auto it = values.find(k);
+			if (it == values.end()) return;
+			remove_value(it->second);
+			values.erase(it);
+		}
+
+		// Remove the values of all array indices of a handle
+		void erase(uint32_t index) {
+			auto it = values.lower_bound({ index, std::numeric_limits<int64_t>::min() });
+			while (it != values.end() && it->first.first == index) {
+				remove_value(it->second);
+				it = values.erase(it);
+			}
+		}
+
+		void clear() {
+			values.clear();
+			ordered.clear();
+			total = 0;
+		}
+
+		// Report whenever field moves above or back below (or onto) value
+		void add_threshold(aggregate_field field, double value) {
+			thresholds.push_back({ field, value, get(field) > value });
+		}
+
+		template<typename Func>
+		void check_thresholds(Func notify) {
+			for (auto& t : thresholds) {
+				bool above = get(t.field) > t.value;
+				if (above == t.above) continue;
+				t.above = above;
+				notify(t.field, t.value, above);
+			}
+		}
+	};
+}
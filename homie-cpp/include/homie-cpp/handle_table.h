@@ -0,0 +1,74 @@
+#pragma once
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+namespace homie {
+	// Compact reference to an object owned by a master.
+	// Handles stay valid as long as the object exists and are never
+	// reused for a different object (slots carry a generation counter).
+	template<typename Tag>
+	struct basic_handle {
+		uint32_t index;
+		// Generation 0 is never assigned, so a default handle is invalid
+		uint32_t generation;
+
+		basic_handle()
+			: index(0), generation(0)
+		{}
+		basic_handle(uint32_t idx, uint32_t gen)
+			: index(idx), generation(gen)
+		{}
+
+		bool valid() const { return generation != 0; }
+		bool operator==(const basic_handle& other) const { return index == other.index && generation == other.generation; }
+		bool operator!=(const basic_handle& other) const { return !(*this == other); }
+		bool operator<(const basic_handle& other) const { return index < other.index || (index == other.index && generation < other.generation); }
+	};
+
+	struct device_handle_tag;
+	struct node_handle_tag;
+	struct property_handle_tag;
+	typedef basic_handle<device_handle_tag> device_handle;
+	typedef basic_handle<node_handle_tag> node_handle;
+	typedef basic_handle<property_handle_tag> property_handle;
+
+	// Maps handles to raw pointers, freed slots are reused with a new generation
+	template<typename Tag, typename T>
+	class handle_table {
+		struct slot {
+			T* ptr;
+			uint32_t generation;
+		};
+		std::vector<slot> slots;
+		std::vector<uint32_t> free_slots;
+	public:
+		typedef basic_handle<Tag> handle;
+
+		handle insert(T* ptr) {
+			if (!free_slots.empty()) {
+				auto idx = free_slots.back();
+				free_slots.pop_back();
+				slots[idx].ptr = ptr;
+				return handle(idx, slots[idx].generation);
+			}
+			slots.push_back({ ptr, 1 });
+			return handle(static_cast<uint32_t>(slots.size() - 1), 1);
+		}
+
+		void erase(handle h) {
+			if (get(h) == nullptr) return;
+			auto& s = slots[h.index];
+			s.ptr = nullptr;
+			if (++s.generation == 0) s.generation = 1;
+			free_slots.push_back(h.index);
+		}
+
+		T* get(handle h) const {
+			if (h.index >= slots.size() || slots[h.index].generation != h.generation) return nullptr;
+			return slots[h.index].ptr;
+		}
+
+		size_t size() const { return slots.size() - free_slots.size(); }
+	};
+}
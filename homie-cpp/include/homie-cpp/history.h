@@ -0,0 +1,228 @@
+#pragma once
+#include "datatype.h"
+#include "utils.h"
+#include <chrono>
+#include <map>
+#include <memory>
+#include <set>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <limits>
+
+namespace homie {
+	template<typename T>
+	struct history_sample {
+		std::chrono::steady_clock::time_point time;
+		T value;
+	};
+
+	namespace detail {
+		// Heap memory owned by a sample value
+		inline size_t payload_bytes(double) { return 0; }
+		inline size_t payload_bytes(const std::string& s) { return s.capacity(); }
+	}
+
+	// Fixed capacity ring of samples, the storage is allocated up front.
+	// Samples are expected in time order, the oldest one is overwritten when full.
+	template<typename T>
+	class history_ring {
+		std::vector<history_sample<T>> samples;
+		size_t cap;
+		// Next write position once full
+		size_t head;
+		size_t extra_bytes;
+	public:
+		typedef std::chrono::steady_clock::time_point time_point;
+
+		explicit history_ring(size_t capacity)
+			: cap(capacity), head(0), extra_bytes(0)
+		{
+			samples.reserve(cap);
+		}
+
+		void push(time_point time, T value) {
+			if (cap == 0) return;
+			extra_bytes += detail::payload_bytes(value);
+			if (samples.size() < cap) {
+				samples.push_back({ time, std::move(value) });
+				return;
+			}
+			extra_bytes -= detail::payload_bytes(samples[head].value);
+			samples[head] = { time, std::move(value) };
+			head = (head + 1) % cap;
+		}
+
+		// Heap bytes released by the next push, non zero once full
+		size_t evicted_bytes() const {
+			return samples.size() < cap ? 0 : detail::payload_bytes(samples[head].value);
+		}
+
+		size_t size() const { return samples.size(); }
+		size_t capacity() const { return cap; }
+		bool empty() const { return samples.empty(); }
+
+		// 0 is the oldest sample
+		const history_sample<T>& at(size_t i) const {
+			return samples.size() < cap ? samples[i] : samples[(head + i) % cap];
+		}
+		const history_sample<T>& back() const { return at(samples.size() - 1); }
+
+		// All samples with from <= time <= to, oldest first
+		std::vector<history_sample<T>> range(time_point from, time_point to) const {
+			std::vector<history_sample<T>> res;
+			size_t lo = 0, hi = samples.size();
+			while (lo < hi) {
+				auto mid = lo + (hi - lo) / 2;
+				if (at(mid).time < from) lo = mid + 1;
+				else hi = mid;
+			}
+			for (; lo < samples.size() && at(lo).time <= to; lo++) res.push_back(at(lo));
+			return res;
+		}
+
+		size_t memory() const { return cap * sizeof(history_sample<T>) + extra_bytes; }
+		size_t payload_memory() const { return extra_bytes; }
+		static size_t reserved_bytes(size_t capacity) { return capacity * sizeof(history_sample<T>); }
+	};
+
+	struct history_policy {
+		// Samples kept per property (and array index), 0 disables history
+		size_t default_capacity = 0;
+		// Overrides the default for a datatype
+		std::map<datatype, size_t> datatype_capacity;
+		// Glob patterns matched against "device/node/property", the first match wins over everything else
+		std::vector<std::pair<std::string, size_t>> pattern_capacity;
+		// Bound for all history memory (preallocated storage and text payloads), 0 is unlimited.
+		// Properties which would exceed it get no history, text samples which would exceed it are dropped.
+		size_t max_bytes = 0;
+
+		bool enabled() const {
+			if (default_capacity != 0) return true;
+			for (auto& e : datatype_capacity) if (e.second != 0) return true;
+			for (auto& e : pattern_capacity) if (e.second != 0) return true;
+			return false;
+		}
+
+		size_t capacity(const std::string& path, datatype type) const {
+			for (auto& e : pattern_capacity) {
+				if (utils::glob_match(e.first.data(), e.first.size(), path.data(), path.size())) return e.second;
+			}
+			auto it = datatype_capacity.find(type);
+			return it != datatype_capacity.end() ? it->second : default_capacity;
+		}
+	};
+
+	// History buffers keyed by (handle index, array index).
+	// Integer and float properties are stored as doubles, everything else as strings.
+	class history_store {
+	public:
+		typedef std::pair<uint32_t, int64_t> key;
+		struct buffer {
+			bool numeric;
+			history_ring<double> numbers;
+			history_ring<std::string> texts;
+
+			buffer(bool is_numeric, size_t capacity)
+				: numeric(is_numeric), numbers(is_numeric ? capacity : 0), texts(is_numeric ? 0 : capacity)
+			{}
+
+			size_t memory() const { return numbers.memory() + texts.memory(); }
+			size_t reserved() const { return numeric ? numbers.reserved_bytes(numbers.capacity()) : texts.reserved_bytes(texts.capacity()); }
+		};
+	private:
+		std::map<key, std::unique_ptr<buffer>> buffers;
+		// Keys without a buffer (capacity 0 or over the bound), not retried until erased
+		std::set<key> skipped;
+		size_t max_bytes;
+		size_t reserved_bytes;
+		size_t payload_bytes;
+		uint64_t rejected;
+		uint64_t dropped;
+	public:
+		history_store()
+			: max_bytes(0), reserved_bytes(0), payload_bytes(0), rejected(0), dropped(0)
+		{}
+
+		static bool is_numeric(datatype type) { return type == datatype::integer || type == datatype::number; }
+
+		void set_max_bytes(size_t max) { max_bytes = max; }
+
+		buffer* find(const key& k) {
+			auto it = buffers.find(k);
+			return it != buffers.end() ? it->second.get() : nullptr;
+		}
+		const buffer* find(const key& k) const {
+			auto it = buffers.find(k);
+			return it != buffers.end() ? it->second.get() : nullptr;
+		}
+
+		// True if create returned nullptr for k before
+		bool is_skipped(const key& k) const { return skipped.count(k) != 0; }
+
+		// Returns nullptr if capacity is 0 or the buffer would exceed the memory bound
+		buffer* create(const key& k, datatype type, size_t capacity) {
+			if (capacity == 0) {
+				skipped.insert(k);
+				return nullptr;
+			}
+			auto numeric = is_numeric(type);
+			auto bytes = numeric ? history_ring<double>::reserved_bytes(capacity) : history_ring<std::string>::reserved_bytes(capacity);
+			if (max_bytes != 0 && memory() + bytes > max_bytes) {
+				if (skipped.insert(k).second) rejected++;
+				return nullptr;
+			}
+			auto& b = buffers[k];
+			b.reset(new buffer(numeric, capacity));
+			reserved_bytes += bytes;
+			return b.get();
+		}
+
+		// Unparsable numeric values are skipped, text samples exceeding the memory bound are dropped
+		void record(buffer& b, std::chrono::steady_clock::time_point time, const std::string& payload) {
+			if (!b.numeric) {
+				std::string value(payload);
+				auto added = detail::payload_bytes(value);
+				auto released = b.texts.evicted_bytes();
+				if (max_bytes != 0 && memory() - released + added > max_bytes) {
+					dropped++;
+					return;
+				}
+				payload_bytes = payload_bytes - released + added;
+				b.texts.push(time, std::move(value));
+				return;
+			}
+			double v = 0;
+			if (utils::parse_double(payload, v)) b.numbers.push(time, v);
+		}
+
+		// Drop the buffers of all array indices of a handle
+		void erase(uint32_t index) {
+			auto it = buffers.lower_bound({ index, std::numeric_limits<int64_t>::min() });
+			while (it != buffers.end() && it->first.first == index) {
+				reserved_bytes -= it->second->reserved();
+				payload_bytes -= it->second->texts.payload_memory();
+				it = buffers.erase(it);
+			}
+			auto sk = skipped.lower_bound({ index, std::numeric_limits<int64_t>::min() });
+			while (sk != skipped.end() && sk->first == index) sk = skipped.erase(sk);
+		}
+
+		void clear() {
+			buffers.clear();
+			skipped.clear();
+			reserved_bytes = 0;
+			payload_bytes = 0;
+		}
+
+		size_t size() const { return buffers.size(); }
+		// Preallocated storage
+		size_t reserved_memory() const { return reserved_bytes; }
+		// Preallocated storage plus string payloads, never exceeds the configured bound
+		size_t memory() const { return reserved_bytes + payload_bytes; }
+		// Buffers not created because of the memory bound, each property (and index) counts once
+		uint64_t rejected_count() const { return rejected; }
+		// Text samples not stored because of the memory bound
+		uint64_t dropped_count() const { return dropped; }
+	};
+}
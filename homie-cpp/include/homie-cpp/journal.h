@@ -0,0 +1,259 @@
+#pragma once
+#include "mapped_file.h"
+#include "utils.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <string>
+
+namespace homie {
+	enum class change_kind : uint8_t {
+		device_attribute = 1,
+		node_attribute,
+		property_attribute,
+		property_value
+	};
+
+	struct change_record {
+		uint64_t seq = 0;
+		change_kind kind = change_kind::property_value;
+		// Milliseconds since the unix epoch
+		int64_t time = 0;
+		std::string device;
+		std::string node;
+		std::string property;
+		// Array index, only valid if indexed is set
+		bool indexed = false;
+		int64_t idx = 0;
+		// Attribute name without the leading $, empty for values
+		std::string id;
+		std::string value;
+	};
+
+	namespace journal {
+		// Segment layout: magic, version, 3 bytes padding, first sequence number (u64 le),
+		// followed by records. A record is a u32 le length and the encoded change_record,
+		// padded to 4 bytes. A zero length marks the end of the written data.
+		// Segments are named <base>.<n> with n counting up from 0.
+		constexpr size_t header_size = 16;
+		constexpr uint8_t format_version = 1;
+		constexpr size_t default_segment_size = 16 * 1024 * 1024;
+		inline const char* magic() { return "HJNL"; }
+
+		inline std::string segment_path(const std::string& base, size_t n) {
+			return base + "." + std::to_string(n);
+		}
+
+		inline void store_u32(uint8_t* p, uint32_t v) {
+			for (int i = 0; i < 4; i++) p[i] = static_cast<uint8_t>(v >> (i * 8));
+		}
+		inline uint32_t load_u32(const uint8_t* p) {
+			uint32_t v = 0;
+			for (int i = 0; i < 4; i++) v |= static_cast<uint32_t>(p[i]) << (i * 8);
+			return v;
+		}
+		inline void store_u64(uint8_t* p, uint64_t v) {
+			for (int i = 0; i < 8; i++) p[i] = static_cast<uint8_t>(v >> (i * 8));
+		}
+		inline uint64_t load_u64(const uint8_t* p) {
+			uint64_t v = 0;
+			for (int i = 0; i < 8; i++) v |= static_cast<uint64_t>(p[i]) << (i * 8);
+			return v;
+		}
+
+		inline size_t align(size_t len) { return (len + 3) & ~static_cast<size_t>(3); }
+
+		inline void encode(const change_record& rec, std::string& out) {
+			utils::binary_writer wr(out);
+			wr.write_varint(rec.seq);
+			wr.write_byte(static_cast<uint8_t>(rec.kind));
+			wr.write_signed(rec.time);
+			wr.write_string(rec.device);
+			wr.write_string(rec.node);
+			wr.write_string(rec.property);
+			wr.write_byte(rec.indexed ? 1 : 0);
+			if (rec.indexed) wr.write_signed(rec.idx);
+			wr.write_string(rec.id);
+			wr.write_string(rec.value);
+		}
+
+		inline void decode(const uint8_t* data, size_t len, change_record& rec) {
+			utils::binary_reader rd(data, len);
+			rec.seq = rd.read_varint();
+			rec.kind = static_cast<change_kind>(rd.read_byte());
+			rec.time = rd.read_signed();
+			rd.read_string(rec.device);
+			rd.read_string(rec.node);
+			rd.read_string(rec.property);
+			rec.indexed = rd.read_byte() != 0;
+			rec.idx = rec.indexed ? rd.read_signed() : 0;
+			rd.read_string(rec.id);
+			rd.read_string(rec.value);
+		}
+
+		// False for a segment the writer just created but did not initialize yet
+		inline bool is_initialized(const mapped_file& f) {
+			return f.size() >= header_size && f.data()[0] != 0;
+		}
+
+		// Sequence number of the first record, throws if the segment is not a journal segment
+		inline uint64_t check_header(const mapped_file& f) {
+			if (f.size() < header_size || std::memcmp(f.data(), magic(), 4) != 0)
+				throw std::runtime_error("not a journal segment");
+			if (f.data()[4] != format_version)
+				throw std::runtime_error("unsupported journal version");
+			return load_u64(f.data() + 8);
+		}
+
+		// Offset of the record following the one at pos, 0 if there is none (yet)
+		inline size_t next_record(const mapped_file& f, size_t pos) {
+			if (pos + 4 > f.size()) return 0;
+			auto len = load_u32(f.data() + pos);
+			std::atomic_thread_fence(std::memory_order_acquire);
+			if (len == 0 || pos + 4 + len > f.size()) return 0;
+			return align(pos + 4 + len);
+		}
+	}
+
+	// Appends records to the current segment and starts a new one once it is full.
+	// Reopening an existing journal continues after its last record.
+	class journal_writer {
+		std::string base;
+		size_t segment_size;
+		size_t segment;
+		mapped_file file;
+		size_t offset;
+		uint64_t seq;
+		std::string scratch;
+		change_record rec;
+
+		void start_segment(size_t n, size_t min_size) {
+			if (file.data() != nullptr) file.sync();
+			segment = n;
+			file = mapped_file::create(journal::segment_path(base, n), std::max(segment_size, min_size + journal::header_size));
+			std::memcpy(file.data(), journal::magic(), 4);
+			file.data()[4] = journal::format_version;
+			journal::store_u64(file.data() + 8, seq + 1);
+			offset = journal::header_size;
+		}
+
+		void resume() {
+			size_t n = 0;
+			while (file_exists(journal::segment_path(base, n + 1))) n++;
+			segment = n;
+			file = mapped_file::open_write(journal::segment_path(base, n));
+			seq = journal::check_header(file) - 1;
+			offset = journal::header_size;
+			while (true) {
+				auto next = journal::next_record(file, offset);
+				if (next == 0) break;
+				offset = next;
+				seq++;
+			}
+		}
+	public:
+		explicit journal_writer(const std::string& base_path, size_t seg_size = journal::default_segment_size)
+			: base(base_path), segment_size(seg_size), segment(0), offset(0), seq(0)
+		{
+			if (file_exists(journal::segment_path(base, 0))) resume();
+			else start_segment(0, 0);
+		}
+
+		~journal_writer() {
+			file.sync();
+		}
+
+		// Returns the sequence number of the new record
+		uint64_t append(change_kind kind, const std::string& device, const std::string& node, const std::string& property, const int64_t* idx, const std::string& id, const std::string& value) {
+			rec.seq = seq + 1;
+			rec.kind = kind;
+			rec.time = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+			rec.device = device;
+			rec.node = node;
+			rec.property = property;
+			rec.indexed = idx != nullptr;
+			rec.idx = idx != nullptr ? *idx : 0;
+			rec.id = id;
+			rec.value = value;
+			scratch.clear();
+			journal::encode(rec, scratch);
+
+			auto needed = journal::align(4 + scratch.size());
+			// Keep room for the terminating zero length
+			if (offset + needed + 4 > file.size()) start_segment(segment + 1, needed + 4);
+			auto p = file.data() + offset;
+			std::memcpy(p + 4, scratch.data(), scratch.size());
+			// Publish the length last, readers stop at a zero length
+			std::atomic_thread_fence(std::memory_order_release);
+			journal::store_u32(p, static_cast<uint32_t>(scratch.size()));
+			offset += needed;
+			return ++seq;
+		}
+
+		// Last written sequence number, 0 for an empty journal
+		uint64_t last_sequence() const { return seq; }
+		size_t current_segment() const { return segment; }
+
+		void sync() { file.sync(); }
+	};
+
+	// Tails a journal from a sequence number. next() returns false once all written
+	// records were read and can be called again later to pick up new ones.
+	class journal_reader {
+		std::string base;
+		size_t segment;
+		mapped_file file;
+		size_t offset;
+		uint64_t position;
+
+		bool open_segment(size_t n) {
+			auto path = journal::segment_path(base, n);
+			if (!file_exists(path)) return false;
+			auto f = mapped_file::open_read(path);
+			if (!journal::is_initialized(f)) return false;
+			journal::check_header(f);
+			file = std::move(f);
+			segment = n;
+			offset = journal::header_size;
+			return true;
+		}
+	public:
+		// Start at the first record with a sequence number >= from
+		explicit journal_reader(const std::string& base_path, uint64_t from = 1)
+			: base(base_path), segment(0), offset(0), position(from)
+		{
+			// Find the last segment starting at or before from
+			size_t n = 0;
+			while (file_exists(journal::segment_path(base, n + 1))) {
+				auto f = mapped_file::open_read(journal::segment_path(base, n + 1));
+				if (!journal::is_initialized(f) || journal::check_header(f) > from) break;
+				n++;
+			}
+			open_segment(n);
+		}
+
+		bool next(change_record& rec) {
+			while (true) {
+				if (file.data() == nullptr && !open_segment(segment)) return false;
+				auto next = journal::next_record(file, offset);
+				if (next == 0) {
+					// The writer moved on if there is a following segment
+					if (!file_exists(journal::segment_path(base, segment + 1))) return false;
+					// Records appended before the writer switched
+					if (journal::next_record(file, offset) != 0) continue;
+					if (!open_segment(segment + 1)) return false;
+					continue;
+				}
+				journal::decode(file.data() + offset + 4, journal::load_u32(file.data() + offset), rec);
+				offset = next;
+				if (rec.seq < position) continue;
+				position = rec.seq + 1;
+				return true;
+			}
+		}
+
+		// Sequence number the next record is expected to have
+		uint64_t next_sequence() const { return position; }
+	};
+}
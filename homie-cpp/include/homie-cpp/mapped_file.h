@@ -0,0 +1,174 @@
+#pragma once
+#include <string>
+#include <stdexcept>
+#include <cstdint>
+#include <cstddef>
+#include <utility>
+#include <cstdio>
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+namespace homie {
+	// Minimal RAII wrapper around a memory mapped file.
+	class mapped_file {
+		uint8_t* ptr;
+		size_t len;
+		bool writable;
+#ifdef _WIN32
+		HANDLE file;
+		HANDLE mapping;
+#else
+		int fd;
+#endif
+
+		void reset() {
+			ptr = nullptr;
+			len = 0;
+			writable = false;
+#ifdef _WIN32
+			file = INVALID_HANDLE_VALUE;
+			mapping = NULL;
+#else
+			fd = -1;
+#endif
+		}
+
+		// write maps an existing file writable, create implies write
+		void map(const std::string& path, size_t size, bool create, bool write) {
+			write = write || create;
+#ifdef _WIN32
+			file = CreateFileA(path.c_str(), write ? (GENERIC_READ | GENERIC_WRITE) : GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, create ? CREATE_ALWAYS : OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+			if (file == INVALID_HANDLE_VALUE) throw std::runtime_error("failed to open " + path);
+			if (!create) {
+				LARGE_INTEGER fsize;
+				if (!GetFileSizeEx(file, &fsize)) { close(); throw std::runtime_error("failed to stat " + path); }
+				size = static_cast<size_t>(fsize.QuadPart);
+			}
+			len = size;
+			writable = write;
+			if (len == 0) return;
+			mapping = CreateFileMappingA(file, NULL, write ? PAGE_READWRITE : PAGE_READONLY,
+				static_cast<DWORD>(static_cast<uint64_t>(len) >> 32), static_cast<DWORD>(len & 0xffffffff), NULL);
+			if (mapping == NULL) { close(); throw std::runtime_error("failed to map " + path); }
+			ptr = static_cast<uint8_t*>(MapViewOfFile(mapping, write ? FILE_MAP_WRITE : FILE_MAP_READ, 0, 0, len));
+			if (ptr == nullptr) { close(); throw std::runtime_error("failed to map " + path); }
+#else
+			fd = ::open(path.c_str(), create ? (O_RDWR | O_CREAT | O_TRUNC) : (write ? O_RDWR : O_RDONLY), 0644);
+			if (fd < 0) throw std::runtime_error("failed to open " + path);
+			if (create) {
+				if (::ftruncate(fd, static_cast<off_t>(size)) != 0) { close(); throw std::runtime_error("failed to resize " + path); }
+			}
+			else {
+				struct stat st;
+				if (::fstat(fd, &st) != 0) { close(); throw std::runtime_error("failed to stat " + path); }
+				size = static_cast<size_t>(st.st_size);
+			}
+			len = size;
+			writable = write;
+			if (len == 0) return;
+			void* p = ::mmap(nullptr, len, write ? (PROT_READ | PROT_WRITE) : PROT_READ, MAP_SHARED, fd, 0);
+			if (p == MAP_FAILED) { close(); throw std::runtime_error("failed to map " + path); }
+			ptr = static_cast<uint8_t*>(p);
+#endif
+		}
+	public:
+		mapped_file() { reset(); }
+		mapped_file(const mapped_file&) = delete;
+		mapped_file& operator=(const mapped_file&) = delete;
+		mapped_file(mapped_file&& other) : mapped_file() { *this = std::move(other); }
+		mapped_file& operator=(mapped_file&& other) {
+			if (this != &other) {
+				close();
+				ptr = other.ptr;
+				len = other.len;
+				writable = other.writable;
+#ifdef _WIN32
+				file = other.file;
+				mapping = other.mapping;
+#else
+				fd = other.fd;
+#endif
+				other.reset();
+			}
+			return *this;
+		}
+		~mapped_file() { close(); }
+
+		// Map an existing file read only
+		static mapped_file open_read(const std::string& path) {
+			mapped_file res;
+			res.map(path, 0, false, false);
+			return res;
+		}
+
+		// Map an existing file writable, keeping its size and content
+		static mapped_file open_write(const std::string& path) {
+			mapped_file res;
+			res.map(path, 0, false, true);
+			return res;
+		}
+
+		// Create (or truncate) a file of the given size and map it writable
+		static mapped_file create(const std::string& path, size_t size) {
+			mapped_file res;
+			res.map(path, size, true, true);
+			return res;
+		}
+
+		// Flush dirty pages to disk
+		void sync() {
+			if (ptr == nullptr || !writable) return;
+#ifdef _WIN32
+			FlushViewOfFile(ptr, len);
+			FlushFileBuffers(file);
+#else
+			::msync(ptr, len, MS_SYNC);
+#endif
+		}
+
+		void close() {
+#ifdef _WIN32
+			if (ptr != nullptr) UnmapViewOfFile(ptr);
+			if (mapping != NULL) CloseHandle(mapping);
+			if (file != INVALID_HANDLE_VALUE) CloseHandle(file);
+#else
+			if (ptr != nullptr) ::munmap(ptr, len);
+			if (fd >= 0) ::close(fd);
+#endif
+			reset();
+		}
+
+		const uint8_t* data() const { return ptr; }
+		uint8_t* data() { return ptr; }
+		size_t size() const { return len; }
+	};
+
+	inline bool file_exists(const std::string& path) {
+#ifdef _WIN32
+		return GetFileAttributesA(path.c_str()) != INVALID_FILE_ATTRIBUTES;
+#else
+		struct stat st;
+		return ::stat(path.c_str(), &st) == 0;
+#endif
+	}
+
+	// Atomically replace "to" with "from"
+	inline void replace_file(const std::string& from, const std::string& to) {
+#ifdef _WIN32
+		if (!MoveFileExA(from.c_str(), to.c_str(), MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH))
+			throw std::runtime_error("failed to replace " + to);
+#else
+		if (::rename(from.c_str(), to.c_str()) != 0)
+			throw std::runtime_error("failed to replace " + to);
+#endif
+	}
+}
\ No newline at end of file
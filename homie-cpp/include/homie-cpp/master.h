@@ -3,11 +3,74 @@
 #include "device.h"
 #include "utils.h"
 #include "master_event_handler.h"
+#include "mapped_file.h"
+#include "serialization.h"
+#include "attribute_index.h"
+#include "discovery_filter.h"
+#include "handle_table.h"
+#include "column_store.h"
+#include "fleet_aggregate.h"
+#include "history.h"
+#include "journal.h"
+#include "change_log.h"
+#include "value_filter.h"
+#include "watch.h"
+#include "set_confirmation.h"
+#include "timer_wheel.h"
+#include <cstring>
 #include <set>
 #include <map>
+#include <algorithm>
+#include <iterator>
+#include <chrono>
+#include <list>
+#include <array>
+#include <future>
 
 namespace homie {
+	enum class discovery_mode {
+		// Subscribe to and keep the whole tree of every device
+		full,
+		// Follow only $state, fetch subtrees on demand
+		lazy
+	};
+
+	// Rules for removing devices from a master, zero values disable a rule
+	struct eviction_policy {
+		// Remove devices that are lost or disconnected for longer than this
+		std::chrono::steady_clock::duration offline_ttl = std::chrono::steady_clock::duration::zero();
+		// Remove devices that never left init (including junk topics) after this time
+		std::chrono::steady_clock::duration init_ttl = std::chrono::steady_clock::duration::zero();
+		// Keep at most this many devices, evicting the least recently updated ones
+		size_t max_devices = 0;
+	};
+
+	// Hard resource limits of a master, zero values disable a limit
+	struct master_limits {
+		size_t max_devices = 0;
+		size_t max_nodes_per_device = 0;
+		size_t max_properties_per_node = 0;
+		// Maximum payload size of a single $attribute message
+		size_t max_attribute_bytes = 0;
+		// Maximum number of indices of an array node
+		int64_t max_array_span = 0;
+	};
+
+	enum class rejection_reason {
+		device_limit,
+		node_limit,
+		property_limit,
+		attribute_size,
+		array_span,
+		// Unparseable array index
+		malformed,
+		count
+	};
+
 	class master : private mqtt_event_handler {
+	public:
+		typedef std::chrono::steady_clock clock;
+	private:
 		struct remote_property : public homie::basic_property, public std::enable_shared_from_this<remote_property> {
 			master* parent;
 			std::string value;
@@ -15,6 +78,16 @@ namespace homie {
 			std::string id;
 			std::map<std::string, std::string> attributes;
 			std::weak_ptr<homie::node> node;
+			property_handle handle;
+			// Device owning the node, resolved without locking the weak pointers
+			device_handle dev_handle;
+			// Value filters matching this property
+			std::vector<value_filter_binding> filters;
+			// Watchers matching this property
+			std::vector<std::shared_ptr<watch_entry>> watchers;
+			// "<base>/<device>/<node>/<property>/set", array indices are inserted as "_<idx>" at set_node_end
+			std::string set_topic;
+			size_t set_node_end = 0;
 
 			remote_property(master* p, std::weak_ptr<homie::node> ptr, const std::string& mid)
 				: parent(p), node(ptr), id(mid)
@@ -53,6 +126,16 @@ namespace homie {
 			std::map<std::string, std::string> attributes;
 			std::map<std::pair<int64_t, std::string>, std::string> attributes_array;
 			std::weak_ptr<homie::device> device;
+			node_handle handle;
+			device_handle dev_handle;
+			// Ids listed in $properties, only enforced once properties_declared
+			std::set<std::string> declared_properties;
+			bool properties_declared = false;
+			// Declared properties with a $datatype
+			size_t typed_properties = 0;
+			// Contribution to the completeness counters of the device, see update_completeness
+			size_t counted_declared = 0;
+			size_t counted_present = 0;
 
 			remote_node(master* p, std::weak_ptr<homie::device> dev, const std::string& mid)
 				: parent(p), id(mid), device(dev)
@@ -61,7 +144,9 @@ namespace homie {
 			std::shared_ptr<remote_property> get_add_property(const std::string& id) {
 				if (properties.count(id)) return properties.at(id);
 				auto prop = std::make_shared<remote_property>(parent, this->shared_from_this(), id);
+				prop->dev_handle = dev_handle;
 				properties.insert({ id, prop });
+				parent->property_added(prop);
 				return prop;
 			}
 
@@ -103,6 +188,15 @@ namespace homie {
 						res.insert(e.first.second);
 				return res;
 			}
+			// Only the received indices, the declared $array is controlled by the device
+			virtual std::set<int64_t> get_indices() const override {
+				std::set<int64_t> res;
+				for (auto& e : attributes_array) res.insert(e.first.first);
+				for (auto& p : properties) {
+					for (auto& e : p.second->value_array) res.insert(e.first);
+				}
+				return res;
+			}
 			virtual std::string get_attribute(const std::string& id) const override {
 				auto it = attributes.find(id);
 				if (it != attributes.cend()) return it->second;
@@ -125,15 +219,49 @@ namespace homie {
 			std::string id;
 			std::map<std::string, std::shared_ptr<remote_node>> nodes;
 			std::map<std::string, std::string> attributes;
+			// Restored from cache and not yet confirmed by a live message
+			bool from_cache;
+			// Nodes dropped by the node type filter
+			std::set<std::string> filtered_nodes;
+			// Time of the last $state change (or creation)
+			clock::time_point state_since;
+			// Position in the least recently updated list
+			std::list<remote_device*>::iterator lru_position;
+			device_handle handle;
+			// Sets held back while sleeping, by topic (last value wins)
+			std::map<std::string, std::string> queued_sets;
+			// $state is sleeping, maintained by state_changed
+			bool sleeping = false;
+			// Ids listed in $nodes, only enforced once nodes_declared
+			std::set<std::string> declared_nodes;
+			bool nodes_declared = false;
+			// Declared nodes listed as "id[]"
+			std::set<std::string> declared_arrays;
+			// Completeness counters: declared nodes that are not filtered (arrays count twice)
+			// and the sums of the node contributions
+			size_t structure_declared = 0;
+			size_t node_declared = 0;
+			size_t node_present = 0;
+			// on_device_complete was called and the device did not become incomplete since
+			bool complete_reported = false;
+			// $stats/interval, zero if unknown
+			clock::duration stats_interval = clock::duration::zero();
+			// Liveness monitor: deadline for the next message and the pending timer (if scheduled)
+			clock::time_point live_deadline;
+			clock::time_point live_timer;
+			bool live_scheduled = false;
+			bool stale = false;
 
 			remote_device(master* p, const std::string& mid)
-				: parent(p), id(mid)
+				: parent(p), id(mid), from_cache(false), state_since(clock::now())
 			{}
 
 			std::shared_ptr<remote_node> get_add_node(const std::string& id) {
 				if (nodes.count(id)) return nodes.at(id);
 				auto node = std::make_shared<remote_node>(parent, this->shared_from_this(), id);
+				node->dev_handle = handle;
 				nodes.insert({ id, node });
+				parent->node_added(node);
 				return node;
 			}
 
@@ -172,16 +300,97 @@ namespace homie {
 		mqtt_client& mqtt;
 		master_event_handler* handler;
 		std::string base_topic;
-		std::map<std::string, std::shared_ptr<remote_device>> devices;
+		typedef std::map<std::string, std::shared_ptr<remote_device>, utils::slice_less> device_map;
+		device_map devices;
+		discovery_filter filter;
+		// Topics currently subscribed (or to subscribe on connect)
+		std::set<std::string> subscriptions;
+
+		// Lazy discovery: states of all devices, subtrees only for materialized ones
+		struct lazy_entry {
+			clock::time_point last_access;
+			size_t interest;
+		};
+		discovery_mode mode;
+		clock::duration lazy_idle_timeout;
+		std::map<std::string, device_state> device_states;
+		std::map<std::string, lazy_entry, utils::slice_less> materialized;
+
+		eviction_policy eviction;
+		master_limits limits;
+		std::array<uint64_t, static_cast<size_t>(rejection_reason::count)> rejections;
+		// Devices ordered from least to most recently updated
+		std::list<remote_device*> lru;
+
+		// Stable integer handles, assigned on creation and released on removal
+		handle_table<device_handle_tag, remote_device> device_handles;
+		handle_table<node_handle_tag, remote_node> node_handles;
+		handle_table<property_handle_tag, remote_property> property_handles;
+
+		// Secondary indexes, maintained by the update_* functions
+		attribute_index<device_state, device_ptr> index_device_state;
+		attribute_index<std::string, node_ptr> index_node_type;
+		attribute_index<datatype, property_ptr> index_property_datatype;
+		attribute_index<std::string, property_ptr> index_property_unit;
+		attribute_index<bool, property_ptr> index_property_settable;
+
+		// Optional columnar copy of all numeric values
+		bool columns_enabled;
+		column_store columns;
+
+		// Registered fleet aggregates, grouped by what they observe
+		aggregate_id next_aggregate;
+		std::map<aggregate_id, fleet_aggregate> aggregates;
+		std::map<std::pair<std::string, std::string>, std::vector<fleet_aggregate*>> property_aggregates;
+		std::map<device_state, std::vector<fleet_aggregate*>> state_aggregates;
+
+		// Optional per property value history
+		history_policy history_config;
+		bool history_enabled;
+		history_store history;
+
+		// Optional append only log of all changes
+		std::unique_ptr<journal_writer> change_journal;
+		// Optional in memory ring of recent changes for polling consumers
+		std::unique_ptr<change_log> changes;
+
+		// Updates repeating the stored payload are dropped, counted per change_kind
+		bool suppress_duplicates;
+		// Hold sets for sleeping devices until they are ready again
+		bool queue_sleeping;
+		// Liveness monitor, a device is stale after liveness_factor * $stats/interval without a message
+		struct liveness_timer {
+			device_handle device;
+			clock::time_point deadline;
+		};
+		std::unique_ptr<timer_wheel<liveness_timer>> liveness;
+		double liveness_factor;
+		std::array<uint64_t, 5> duplicates;
+
+		// Deadband and threshold filters, compiled into the filter list of every matching property
+		filter_id next_filter;
+		std::map<filter_id, value_filter> value_filters;
+
+		// Set requests waiting for the device to report the requested value
+		set_tracker sets;
+
+		// Watchers, bound to the dispatch table of every matching property.
+		// Removal of watchers and value filters during dispatch is deferred until the outermost
+		// dispatch finished.
+		watch_token next_watch;
+		std::map<watch_token, std::shared_ptr<watch_entry>> watches;
+		size_t dispatch_depth;
+		std::vector<std::shared_ptr<watch_entry>> unwatched;
+		std::vector<filter_id> removed_filters;
 
 		// Inherited by mqtt_event_handler
 		virtual void on_connect(bool session_present, bool reconnected) override {
 			if (!session_present) {
-				mqtt.subscribe(base_topic + "#", 1);
+				for (auto& t : subscriptions) mqtt.subscribe(t, 1);
 			}
 		}
 		virtual void on_closing() override {
-			mqtt.unsubscribe(base_topic + "#");
+			for (auto& t : subscriptions) mqtt.unsubscribe(t);
 		}
 		virtual void on_closed() override {}
 		virtual void on_offline() override {}
@@ -191,6 +400,36 @@ namespace homie {
 				return;
 			if (topic.compare(0, base_topic.size(), base_topic) != 0)
 				return;
+			// Drop filtered devices before splitting the topic
+			auto level_end = topic.find('/', base_topic.size());
+			if (level_end == std::string::npos)
+				return;
+			if (topic.compare(base_topic.size(), 1, "$") != 0) {
+				auto len = level_end - base_topic.size();
+				if (!filter.match_device(topic, base_topic.size(), len))
+					return;
+				if (limits.max_attribute_bytes != 0 && payload.size() > limits.max_attribute_bytes && topic.find("/$", base_topic.size()) != std::string::npos) {
+					reject(rejection_reason::attribute_size);
+					return;
+				}
+				if (mode == discovery_mode::lazy) {
+					if (topic.compare(level_end, std::string::npos, "/$state") == 0) {
+						auto id = topic.substr(base_topic.size(), len);
+						// The registry is what grows in lazy mode, materialized devices are part of it
+						if (limits.max_devices != 0 && device_states.size() >= limits.max_devices && device_states.count(id) == 0) {
+							reject(rejection_reason::device_limit);
+							return;
+						}
+						handle_lazy_state(id, payload);
+					}
+					if (materialized.find(utils::string_slice{ topic, base_topic.size(), len }) == materialized.end())
+						return;
+				}
+				else if (limits.max_devices != 0 && devices.size() >= limits.max_devices && devices.find(utils::string_slice{ topic, base_topic.size(), len }) == devices.end()) {
+					reject(rejection_reason::device_limit);
+					return;
+				}
+			}
 
 			auto parts = utils::split<std::string>(topic, "/", base_topic.size());
 			if (parts.size() < 2)
@@ -211,38 +450,158 @@ namespace homie {
 				handler->on_broadcast(level, payload);
 		}
 
+		void reject(rejection_reason reason) {
+			rejections[static_cast<size_t>(reason)]++;
+		}
+
+		static const std::string& empty_string() {
+			static const std::string empty;
+			return empty;
+		}
+
+		static bool parse_array_range(const std::string& value, std::pair<int64_t, int64_t>& range) {
+			auto pos = value.find('-');
+			if (pos == std::string::npos) return false;
+			return utils::parse_int(value, 0, pos, range.first)
+				&& utils::parse_int(value, pos + 1, value.size(), range.second)
+				&& range.first <= range.second;
+		}
+
+		// Indices have to be within the declared $array, or within the span limit if not declared yet
+		bool index_in_span(const remote_node& node, int64_t idx) const {
+			std::pair<int64_t, int64_t> range;
+			auto it = node.attributes.find("array");
+			if (it != node.attributes.end() && parse_array_range(it->second, range))
+				return idx >= range.first && idx <= range.second;
+			return idx >= 0 && idx < limits.max_array_span;
+		}
+
+		void handle_lazy_state(const std::string& id, const std::string& payload) {
+			device_state state = device_state::init;
+			try {
+				state = enum_from_string<device_state>(payload);
+			}
+			catch (const std::exception&) {}
+			device_states[id] = state;
+			if (handler)
+				handler->on_device_state(id, state);
+		}
+
+		std::set<std::string> compute_subscriptions() const {
+			if (mode == discovery_mode::full) {
+				auto subs = filter.subscriptions(base_topic);
+				return std::set<std::string>(subs.begin(), subs.end());
+			}
+			auto subs = filter.state_subscriptions(base_topic);
+			std::set<std::string> res(subs.begin(), subs.end());
+			for (auto& e : materialized) res.insert(base_topic + e.first + "/#");
+			return res;
+		}
+
+		void update_subscriptions() {
+			auto subs = compute_subscriptions();
+			if (mqtt.is_connected()) {
+				for (auto& t : subs)
+					if (subscriptions.count(t) == 0) mqtt.subscribe(t, 1);
+				for (auto& t : subscriptions)
+					if (subs.count(t) == 0) mqtt.unsubscribe(t);
+			}
+			subscriptions = std::move(subs);
+		}
+
+		// Subscribe to the subtree of a device only known by its $state
+		std::shared_ptr<remote_device> materialize(const std::string& id) {
+			auto it = materialized.find(id);
+			if (it != materialized.end()) {
+				it->second.last_access = clock::now();
+				auto dev = devices.find(id);
+				if (dev != devices.end()) return dev->second;
+			}
+			auto state = device_states.find(id);
+			if (state == device_states.end()) return nullptr;
+			bool subscribed = it != materialized.end();
+			auto dev = get_add_device(id);
+			// The device stays in init (its state is in get_device_states) until the retained
+			// $state arrives with the subtree, which signals discovery like in full mode
+			if (subscribed) {
+				// Still subscribed with interest held, subscribing again redelivers the retained subtree
+				if (mqtt.is_connected()) mqtt.subscribe(base_topic + id + "/#", 1);
+				return dev;
+			}
+			materialized[id] = lazy_entry{ clock::now(), 0 };
+			update_subscriptions();
+			return dev;
+		}
+
+		// Devices someone registered interest in are never evicted
+		bool has_interest(const std::string& id) const {
+			auto it = materialized.find(id);
+			return it != materialized.end() && it->second.interest != 0;
+		}
+
 		void handle_device_message(const std::vector<std::string>& parts, const std::string& payload) {
+			// Validate the array index before anything gets created
+			bool is_array = false;
+			int64_t idx = 0;
+			std::string node_id;
+			if (parts[1][0] != '$' && parts.size() >= 3) {
+				node_id = parts[1];
+				auto pos = parts[1].find('_');
+				if (pos != std::string::npos) {
+					if (!utils::parse_int(parts[1], pos + 1, parts[1].size(), idx)) {
+						reject(rejection_reason::malformed);
+						return;
+					}
+					node_id.resize(pos);
+					is_array = true;
+				}
+			}
+
 			auto dev = get_add_device(parts[0]);
+			dev->from_cache = false;
+			touch_device(*dev);
+			if (liveness) refresh_liveness(*dev, clock::now());
 			if (parts[1][0] == '$') {
 				std::string id = parts[1].substr(1);
 				for (size_t i = 2; i < parts.size(); i++) {
 					id += "/" + parts[i];
 				}
-				if (id == "state" && payload != "init" && (dev->get_attribute("state") == "" || dev->get_state() == device_state::init)) {
-					dev->set_attribute(id, payload);
-					if (handler)
-						handler->on_device_discovered(dev);
-				}
-				else {
-					dev->set_attribute(id, payload);
-					if (handler && dev->get_state() != device_state::init) {
-						handler->on_device_changed(dev, id);
-					}
-				}
+				update_device_attribute(dev, id, payload);
 			}
 			else if (parts.size() >= 3) {
-				bool is_array = false;
-				int64_t idx = 0;
-				std::shared_ptr<remote_node> node;
-				{
-					auto pos = parts[1].find('_');
-					if (pos != std::string::npos) {
-						node = dev->get_add_node(parts[1].substr(0, pos));
-						is_array = true;
-						idx = std::stoll(parts[1].substr(pos + 1));
+				if (!filter.node_types.empty()) {
+					if (!is_array && parts.size() == 3 && parts[2] == "$type") {
+						if (!filter.match_node_type(payload)) {
+							filter_node(dev, node_id);
+							return;
+						}
+						auto weight = node_weight(*dev, node_id);
+						dev->filtered_nodes.erase(node_id);
+						dev->structure_declared += node_weight(*dev, node_id) - weight;
+					}
+					else if (dev->filtered_nodes.count(node_id) != 0) return;
+				}
+				if (limits.max_array_span != 0 && !is_array && parts.size() == 3 && parts[2] == "$array") {
+					std::pair<int64_t, int64_t> range;
+					// Computed unsigned and before adding one, the span of a full int64_t range overflows
+					if (!parse_array_range(payload, range)
+						|| static_cast<uint64_t>(range.second) - static_cast<uint64_t>(range.first) >= static_cast<uint64_t>(limits.max_array_span)) {
+						reject(rejection_reason::array_span);
+						return;
 					}
-					else
-						node = dev->get_add_node(parts[1]);
+				}
+				auto nit = dev->nodes.find(node_id);
+				if (nit == dev->nodes.end() && limits.max_nodes_per_device != 0 && dev->nodes.size() >= limits.max_nodes_per_device) {
+					reject(rejection_reason::node_limit);
+					return;
+				}
+				// Stale retained topics of nodes the device no longer declares
+				if (nit == dev->nodes.end() && dev->nodes_declared && dev->declared_nodes.count(node_id) == 0)
+					return;
+				auto node = nit != dev->nodes.end() ? nit->second : dev->get_add_node(node_id);
+				if (is_array && limits.max_array_span != 0 && !index_in_span(*node, idx)) {
+					reject(rejection_reason::array_span);
+					return;
 				}
 
 				if (parts[2][0] == '$') {
@@ -250,67 +609,854 @@ namespace homie {
 					for (size_t i = 3; i < parts.size(); i++) {
 						id += "/" + parts[i];
 					}
-					if (is_array) node->set_attribute(id, payload, idx);
-					else node->set_attribute(id, payload);
-					if (handler && dev->get_state() != device_state::init) {
-						if (is_array) handler->on_node_changed(node, idx, id);
-						else handler->on_node_changed(node, id);
-					}
+					update_node_attribute(dev, node, is_array ? &idx : nullptr, id, payload);
 				}
 				else {
-					auto prop = node->get_add_property(parts[2]);
+					auto pit = node->properties.find(parts[2]);
+					if (pit == node->properties.end() && limits.max_properties_per_node != 0 && node->properties.size() >= limits.max_properties_per_node) {
+						reject(rejection_reason::property_limit);
+						return;
+					}
+					if (pit == node->properties.end() && node->properties_declared && node->declared_properties.count(parts[2]) == 0)
+						return;
+					auto prop = pit != node->properties.end() ? pit->second : node->get_add_property(parts[2]);
 					if (parts.size() == 3) {
-						if (is_array) prop->value_array[idx] = payload;
-						else prop->value = payload;
-
-						if (handler && dev->get_state() != device_state::init) {
-							if (is_array) handler->on_property_value_changed(prop, idx, payload);
-							else handler->on_property_value_changed(prop, payload);
-						}
+						update_property_value(dev, prop, is_array ? &idx : nullptr, payload);
 					}
 					else {
 						std::string id = parts[3].substr(1);
 						for (size_t i = 4; i < parts.size(); i++) {
 							id += "/" + parts[i];
 						}
-						prop->set_attribute(id, payload);
-						if (handler && dev->get_state() != device_state::init) {
-							if (is_array) handler->on_property_changed(prop, idx, id);
-							else handler->on_property_changed(prop, id);
-						}
+						update_property_attribute(dev, prop, is_array ? &idx : nullptr, id, payload);
+					}
+				}
+			}
+		}
+
+		template<typename Map, typename Key>
+		static const std::string* find_stored(const Map& map, const Key& key) {
+			auto it = map.find(key);
+			return it != map.end() ? &it->second : nullptr;
+		}
+
+		// True if payload equals the stored value and the update should be dropped
+		bool is_duplicate(change_kind kind, const std::string* stored, const std::string& payload) {
+			if (!suppress_duplicates || stored == nullptr || *stored != payload) return false;
+			duplicates[static_cast<size_t>(kind)]++;
+			return true;
+		}
+
+		void update_device_attribute(const std::shared_ptr<remote_device>& dev, const std::string& id, const std::string& payload) {
+			if (is_duplicate(change_kind::device_attribute, find_stored(dev->attributes, id), payload)) return;
+			auto old_state = dev->get_state();
+			if (records_changes()) record_change(change_kind::device_attribute, dev->id, "", "", nullptr, id, payload);
+			if (id == "state") dev->state_since = clock::now();
+			if (id == "stats/interval") {
+				int64_t interval = 0;
+				utils::parse_int(payload, 0, payload.size(), interval);
+				dev->stats_interval = interval > 0 ? std::chrono::seconds(interval) : clock::duration::zero();
+				if (liveness) refresh_liveness(*dev, clock::now());
+			}
+			if (id == "state" && payload != "init" && (dev->get_attribute("state") == "" || old_state == device_state::init)) {
+				dev->set_attribute(id, payload);
+				state_changed(dev, old_state);
+				if (handler)
+					handler->on_device_discovered(dev);
+			}
+			else {
+				dev->set_attribute(id, payload);
+				if (id == "state") state_changed(dev, old_state);
+				if (handler && dev->get_state() != device_state::init) {
+					handler->on_device_changed(dev, id);
+				}
+			}
+			if (id == "nodes") reconcile_nodes(dev, payload);
+			if (id == "nodes" || id == "state") check_complete(dev);
+		}
+
+		// Ids of a $nodes or $properties list without the array ("[]") and Homie 2 (":settable") suffixes
+		static std::set<std::string> declared_ids(const std::string& list) {
+			std::set<std::string> res;
+			for (auto& e : utils::split(list, std::string(","))) {
+				auto end = e.find_first_of("[:");
+				if (end != 0 && !e.empty()) res.insert(e.substr(0, end));
+			}
+			return res;
+		}
+
+		typedef std::map<std::string, std::shared_ptr<remote_node>>::iterator node_iterator;
+		typedef std::map<std::string, std::shared_ptr<remote_property>>::iterator property_iterator;
+
+		node_iterator drop_node(const std::shared_ptr<remote_device>& dev, node_iterator it) {
+			auto node = it->second;
+			node_removed(node);
+			it = dev->nodes.erase(it);
+			if (handler && dev->get_state() != device_state::init) handler->on_node_removed(node);
+			return it;
+		}
+
+		property_iterator drop_property(const std::shared_ptr<remote_device>& dev, remote_node& node, property_iterator it) {
+			auto prop = it->second;
+			property_removed(prop);
+			it = node.properties.erase(it);
+			if (handler && dev->get_state() != device_state::init) handler->on_property_removed(prop);
+			return it;
+		}
+
+		// Removes nodes not listed in $nodes. The first $nodes sweeps all nodes, including ones
+		// created from stale retained topics, later ones only touch the ids that changed.
+		// Undeclared nodes arriving later are dropped on arrival.
+		void reconcile_nodes(const std::shared_ptr<remote_device>& dev, const std::string& list) {
+			auto declared = declared_ids(list);
+			std::set<std::string> arrays;
+			for (auto& e : utils::split(list, std::string(","))) {
+				if (e.size() > 2 && e.compare(e.size() - 2, 2, "[]") == 0) arrays.insert(e.substr(0, e.size() - 2));
+			}
+			if (!dev->nodes_declared) {
+				dev->declared_nodes = std::move(declared);
+				dev->declared_arrays = std::move(arrays);
+				dev->nodes_declared = true;
+				for (auto it = dev->filtered_nodes.begin(); it != dev->filtered_nodes.end();) {
+					if (dev->declared_nodes.count(*it) == 0) it = dev->filtered_nodes.erase(it);
+					else it++;
+				}
+				for (auto it = dev->nodes.begin(); it != dev->nodes.end();) {
+					if (dev->declared_nodes.count(it->first) == 0) it = drop_node(dev, it);
+					else it++;
+				}
+				for (auto& id : dev->declared_nodes) dev->structure_declared += node_weight(*dev, id);
+				for (auto& e : dev->nodes) update_completeness(*dev, *e.second);
+				return;
+			}
+			// Ids added, removed or changed between array and plain node
+			std::set<std::string> changed;
+			std::set_symmetric_difference(dev->declared_nodes.begin(), dev->declared_nodes.end(), declared.begin(), declared.end(), std::inserter(changed, changed.end()));
+			std::set_symmetric_difference(dev->declared_arrays.begin(), dev->declared_arrays.end(), arrays.begin(), arrays.end(), std::inserter(changed, changed.end()));
+			for (auto& id : changed) dev->structure_declared -= node_weight(*dev, id);
+			dev->declared_nodes = std::move(declared);
+			dev->declared_arrays = std::move(arrays);
+			for (auto& id : changed) {
+				dev->structure_declared += node_weight(*dev, id);
+				auto it = dev->nodes.find(id);
+				if (dev->declared_nodes.count(id) == 0) {
+					dev->filtered_nodes.erase(id);
+					if (it != dev->nodes.end()) drop_node(dev, it);
+				}
+				else if (it != dev->nodes.end()) update_completeness(*dev, *it->second);
+			}
+		}
+
+		// Same for the properties of a node listed in its $properties
+		void reconcile_properties(const std::shared_ptr<remote_device>& dev, const std::shared_ptr<remote_node>& node, const std::string& list) {
+			auto declared = declared_ids(list);
+			if (!node->properties_declared) {
+				node->declared_properties = std::move(declared);
+				node->properties_declared = true;
+				for (auto it = node->properties.begin(); it != node->properties.end();) {
+					if (node->declared_properties.count(it->first) == 0) it = drop_property(dev, *node, it);
+					else {
+						if (it->second->attributes.count("datatype") != 0) node->typed_properties++;
+						it++;
 					}
 				}
+				update_completeness(*dev, *node);
+				return;
+			}
+			std::vector<std::string> removed;
+			std::vector<std::string> added;
+			std::set_difference(node->declared_properties.begin(), node->declared_properties.end(), declared.begin(), declared.end(), std::back_inserter(removed));
+			std::set_difference(declared.begin(), declared.end(), node->declared_properties.begin(), node->declared_properties.end(), std::back_inserter(added));
+			node->declared_properties = std::move(declared);
+			for (auto& id : removed) {
+				auto it = node->properties.find(id);
+				if (it == node->properties.end()) continue;
+				if (it->second->attributes.count("datatype") != 0) node->typed_properties--;
+				drop_property(dev, *node, it);
+			}
+			for (auto& id : added) {
+				auto it = node->properties.find(id);
+				if (it != node->properties.end() && it->second->attributes.count("datatype") != 0) node->typed_properties++;
+			}
+			update_completeness(*dev, *node);
+		}
+
+		static device_completeness completeness(const remote_device& dev) {
+			device_completeness res;
+			res.declared = 1;
+			if (!dev.nodes_declared) return res;
+			res.declared += dev.structure_declared + dev.node_declared;
+			res.present = 1 + dev.node_present;
+			return res;
+		}
+
+		// Counted for a node listed in $nodes: $array for arrays and $properties
+		static size_t node_weight(const remote_device& dev, const std::string& id) {
+			if (dev.declared_nodes.count(id) == 0 || dev.filtered_nodes.count(id) != 0) return 0;
+			return dev.declared_arrays.count(id) != 0 ? 2 : 1;
+		}
+
+		// Recomputes what node adds to the counters of dev in O(1): its declared properties,
+		// and as present its $properties, $array and the properties with $datatype
+		static void update_completeness(remote_device& dev, remote_node& node) {
+			size_t declared = 0;
+			size_t present = 0;
+			if (dev.nodes_declared) {
+				if (node.properties_declared) {
+					declared = node.declared_properties.size();
+					present = 1 + node.typed_properties;
+				}
+				if (dev.declared_arrays.count(node.id) != 0 && node.attributes.count("array") != 0) present++;
+			}
+			dev.node_declared = dev.node_declared - node.counted_declared + declared;
+			dev.node_present = dev.node_present - node.counted_present + present;
+			node.counted_declared = declared;
+			node.counted_present = present;
+		}
+
+		// Reports a device once everything it declared arrived and it left init
+		void check_complete(const std::shared_ptr<remote_device>& dev) {
+			if (dev->get_state() == device_state::init) return;
+			if (!completeness(*dev).is_complete()) {
+				dev->complete_reported = false;
+				return;
+			}
+			if (dev->complete_reported) return;
+			dev->complete_reported = true;
+			if (handler) handler->on_device_complete(dev, completeness(*dev));
+		}
+
+		void update_node_attribute(const std::shared_ptr<remote_device>& dev, const std::shared_ptr<remote_node>& node, const int64_t* idx, const std::string& id, const std::string& payload) {
+			auto stored = idx != nullptr ? find_stored(node->attributes_array, std::make_pair(*idx, id)) : find_stored(node->attributes, id);
+			if (is_duplicate(change_kind::node_attribute, stored, payload)) return;
+			if (records_changes()) record_change(change_kind::node_attribute, dev->id, node->id, "", idx, id, payload);
+			if (idx != nullptr) node->set_attribute(id, payload, *idx);
+			else if (id == "type") {
+				auto old_type = node->get_type();
+				node->set_attribute(id, payload);
+				index_node_type.update(old_type, payload, node);
+				for (auto& e : node->properties) reindex_numeric(e.second);
+				if (!value_filters.empty()) {
+					for (auto& e : node->properties) bind_filters(*e.second);
+				}
+			}
+			else if (id == "properties") {
+				node->set_attribute(id, payload);
+				reconcile_properties(dev, node, payload);
+			}
+			else if (id == "array") {
+				node->set_attribute(id, payload);
+				update_completeness(*dev, *node);
+			}
+			else node->set_attribute(id, payload);
+			if (handler && dev->get_state() != device_state::init) {
+				if (idx != nullptr) handler->on_node_changed(node, *idx, id);
+				else handler->on_node_changed(node, id);
+			}
+			if (idx == nullptr && (id == "properties" || id == "array")) check_complete(dev);
+		}
+
+		void update_property_value(const std::shared_ptr<remote_device>& dev, const std::shared_ptr<remote_property>& prop, const int64_t* idx, const std::string& payload) {
+			auto stored = idx != nullptr ? find_stored(prop->value_array, *idx) : &prop->value;
+			if (is_duplicate(change_kind::property_value, stored, payload)) return;
+			if (idx != nullptr) prop->value_array[*idx] = payload;
+			else prop->value = payload;
+			if (records_changes()) record_property_change(change_kind::property_value, *dev, *prop, idx, "", payload);
+			numeric_value_changed(*prop, idx != nullptr ? *idx : no_index, payload);
+			if (history_enabled) record_history(*prop, idx != nullptr ? *idx : no_index, payload);
+			if (!prop->filters.empty()) apply_filters(*dev, *prop, idx, payload);
+			if (!prop->watchers.empty() && dev->get_state() != device_state::init) dispatch_watchers(prop, idx, payload);
+
+			if (handler && dev->get_state() != device_state::init) {
+				if (idx != nullptr) {
+					handler->on_value_changed(prop->handle, *idx, payload);
+					handler->on_property_value_changed(prop, *idx, payload);
+				}
+				else {
+					handler->on_value_changed(prop->handle, payload);
+					handler->on_property_value_changed(prop, payload);
+				}
+			}
+			if (sets.pending() != 0) sets.value_received({ prop->handle.index, idx != nullptr ? *idx : no_index }, payload);
+		}
+
+		void update_property_attribute(const std::shared_ptr<remote_device>& dev, const std::shared_ptr<remote_property>& prop, const int64_t* idx, const std::string& id, const std::string& payload) {
+			if (is_duplicate(change_kind::property_attribute, find_stored(prop->attributes, id), payload)) return;
+			if (records_changes()) record_property_change(change_kind::property_attribute, *dev, *prop, idx, id, payload);
+			if (id == "datatype") {
+				auto old_type = property_datatype(*prop);
+				auto typed = prop->attributes.count(id) != 0;
+				prop->set_attribute(id, payload);
+				if (!typed) typed_changed(*dev, *prop, true);
+				index_property_datatype.update(old_type, property_datatype(*prop), prop);
+				if (old_type != property_datatype(*prop)) {
+					reindex_numeric(prop);
+					// Samples are typed, restart the history
+					if (history_enabled) history.erase(prop->handle.index);
+				}
+			}
+			else if (id == "unit") {
+				auto old_unit = prop->get_unit();
+				prop->set_attribute(id, payload);
+				index_property_unit.update(old_unit, payload, prop);
+			}
+			else if (id == "settable") {
+				auto old_settable = prop->is_settable();
+				prop->set_attribute(id, payload);
+				index_property_settable.update(old_settable, prop->is_settable(), prop);
+			}
+			else prop->set_attribute(id, payload);
+			if (handler && dev->get_state() != device_state::init) {
+				if (idx != nullptr) handler->on_property_changed(prop, *idx, id);
+				else handler->on_property_changed(prop, id);
 			}
+			if (id == "datatype") check_complete(dev);
 		}
 
 		std::shared_ptr<remote_device> get_add_device(const std::string& id) {
 			if (devices.count(id)) return devices.at(id);
 			auto dev = std::make_shared<remote_device>(this, id);
 			devices.insert({ id, dev });
+			dev->lru_position = lru.insert(lru.end(), dev.get());
+			device_added(dev);
+			enforce_max_devices(dev.get());
 			return dev;
 		}
 
-		void publish_set_property(const homie::property* prop, const std::string& value) {
-			auto node = prop->get_node();
-			auto dev = node->get_device();
-			mqtt.publish(base_topic + dev->get_id() + "/" + node->get_id() + "/" + prop->get_id() + "/set", value, 1, true);
+		void device_added(const std::shared_ptr<remote_device>& dev) {
+			dev->handle = device_handles.insert(dev.get());
+			index_device_state.insert(device_state::init, dev);
+			update_state_aggregates(dev->handle, device_state::init, true);
+		}
+
+		void node_added(const std::shared_ptr<remote_node>& node) {
+			node->handle = node_handles.insert(node.get());
+			index_node_type.insert("", node);
+		}
+
+		void property_added(const std::shared_ptr<remote_property>& prop) {
+			prop->handle = property_handles.insert(prop.get());
+			cache_set_topic(*prop);
+			index_property_datatype.insert(datatype::string, prop);
+			index_property_unit.insert("", prop);
+			index_property_settable.insert(false, prop);
+			if (!value_filters.empty()) bind_filters(*prop);
+			if (!watches.empty()) bind_watchers(*prop);
+		}
+
+		void property_removed(const std::shared_ptr<remote_property>& prop) {
+			if (prop->attributes.count("datatype") != 0) {
+				if (auto dev = device_handles.get(prop->dev_handle)) typed_changed(*dev, *prop, false);
+			}
+			for (auto& w : prop->watchers) w->bound.erase(prop->handle);
+			index_property_datatype.erase(property_datatype(*prop), prop);
+			index_property_unit.erase(prop->get_unit(), prop);
+			index_property_settable.erase(prop->is_settable(), prop);
+			numeric_removed(*prop, true);
+			if (history_enabled) history.erase(prop->handle.index);
+			if (sets.pending() != 0) sets.fail(prop->handle.index, set_status::removed);
+			property_handles.erase(prop->handle);
+		}
+
+		// Adjusts the count of declared properties with $datatype of the node of prop
+		void typed_changed(remote_device& dev, const remote_property& prop, bool added) {
+			auto node = prop.node.lock();
+			if (!node) return;
+			auto& n = static_cast<remote_node&>(*node);
+			if (!n.properties_declared || n.declared_properties.count(prop.id) == 0) return;
+			if (added) n.typed_properties++;
+			else n.typed_properties--;
+			update_completeness(dev, n);
+		}
+
+		void node_removed(const std::shared_ptr<remote_node>& node) {
+			for (auto& e : node->properties) property_removed(e.second);
+			if (auto dev = device_handles.get(node->dev_handle)) {
+				dev->node_declared -= node->counted_declared;
+				dev->node_present -= node->counted_present;
+				node->counted_declared = node->counted_present = 0;
+			}
+			index_node_type.erase(node->get_type(), node);
+			node_handles.erase(node->handle);
+		}
+
+		void device_removed(const std::shared_ptr<remote_device>& dev) {
+			for (auto& e : dev->nodes) node_removed(e.second);
+			index_device_state.erase(dev->get_state(), dev);
+			update_state_aggregates(dev->handle, dev->get_state(), false);
+			device_handles.erase(dev->handle);
+		}
+
+		void state_changed(const std::shared_ptr<remote_device>& dev, device_state old_state) {
+			auto state = dev->get_state();
+			if (state == old_state) return;
+			dev->sleeping = state == device_state::sleeping;
+			index_device_state.update(old_state, state, dev);
+			update_state_aggregates(dev->handle, old_state, false);
+			update_state_aggregates(dev->handle, state, true);
+			if (state == device_state::ready && !dev->queued_sets.empty()) flush_queued_sets(*dev);
+		}
+
+		void flush_queued_sets(remote_device& dev) {
+			mqtt_batch batch;
+			for (auto& e : dev.queued_sets) batch.add(e.first, e.second);
+			dev.queued_sets.clear();
+			mqtt.publish_batch(batch);
+		}
+
+		// Device of prop if sets to it have to be queued, nullptr otherwise
+		remote_device* sleeping_device(const remote_property& prop) const {
+			if (!queue_sleeping) return nullptr;
+			auto dev = device_handles.get(prop.dev_handle);
+			return dev != nullptr && dev->sleeping ? dev : nullptr;
+		}
+
+		void update_state_aggregates(device_handle dev, device_state state, bool member) {
+			auto it = state_aggregates.find(state);
+			if (it == state_aggregates.end()) return;
+			for (auto agg : it->second) {
+				if (member) agg->set({ dev.index, no_index }, 1);
+				else agg->erase(fleet_aggregate::key{ dev.index, no_index });
+				check_thresholds(*agg);
+			}
+		}
+
+		void check_thresholds(fleet_aggregate& agg) {
+			agg.check_thresholds([&](aggregate_field field, double threshold, bool above) {
+				if (handler) handler->on_aggregate_threshold(agg.get_id(), field, threshold, above);
+			});
+		}
+
+		bool has_numeric_observers() const {
+			return columns_enabled || !property_aggregates.empty();
+		}
+
+		static void aggregate_value(fleet_aggregate& agg, const remote_property& prop, int64_t idx, const std::string& payload) {
+			auto type = property_datatype(prop);
+			double v = 0;
+			if ((type == datatype::integer || type == datatype::number) && utils::parse_double(payload, v))
+				agg.set({ prop.handle.index, idx }, v);
+			else agg.erase(fleet_aggregate::key{ prop.handle.index, idx });
+		}
+
+		// Feeds the column store and property aggregates
+		void numeric_value_changed(const remote_property& prop, int64_t idx, const std::string& payload) {
+			if (!has_numeric_observers()) return;
+			auto node = prop.node.lock();
+			auto type = node ? node->get_type() : "";
+			if (columns_enabled) columns.set(prop.handle, idx, type, prop.id, property_datatype(prop), payload);
+			auto it = property_aggregates.find({ type, prop.id });
+			if (it == property_aggregates.end()) return;
+			for (auto agg : it->second) {
+				aggregate_value(*agg, prop, idx, payload);
+				check_thresholds(*agg);
+			}
+		}
+
+		void numeric_removed(const remote_property& prop, bool notify) {
+			if (columns_enabled) columns.erase(prop.handle);
+			for (auto& e : property_aggregates) {
+				for (auto agg : e.second) {
+					agg->erase(prop.handle.index);
+					if (notify) check_thresholds(*agg);
+				}
+			}
+		}
+
+		bool records_changes() const {
+			return change_journal || changes;
 		}
 
-		void publish_set_property(const homie::property* prop, const std::string& value, int64_t idx) {
+		void record_change(change_kind kind, const std::string& dev, const std::string& node, const std::string& prop, const int64_t* idx, const std::string& id, const std::string& payload) {
+			if (change_journal) change_journal->append(kind, dev, node, prop, idx, id, payload);
+			if (changes) changes->append(kind, dev, node, prop, idx, id, payload);
+		}
+
+		void record_property_change(change_kind kind, const remote_device& dev, const remote_property& prop, const int64_t* idx, const std::string& id, const std::string& payload) {
+			auto node = prop.node.lock();
+			record_change(kind, dev.id, node ? node->get_id() : "", prop.id, idx, id, payload);
+		}
+
+		// "device/node/property", empty if the property is detached
+		static std::string property_path(const remote_property& prop) {
+			auto node = prop.node.lock();
+			auto dev = node ? node->get_device() : nullptr;
+			if (!dev) return "";
+			return dev->get_id() + "/" + node->get_id() + "/" + prop.id;
+		}
+
+		void bind_filters(remote_property& prop) {
+			prop.filters.clear();
+			auto node = prop.node.lock();
+			auto path = property_path(prop);
+			if (path.empty()) return;
+			auto type = node->get_type();
+			for (auto& e : value_filters) {
+				if (e.second.matches(path, type)) prop.filters.emplace_back(e.first, &e.second);
+			}
+		}
+
+		void apply_filters(const remote_device& dev, remote_property& prop, const int64_t* idx, const std::string& payload) {
+			double v = 0;
+			if (!utils::parse_double(payload, v)) return;
+			dispatch_depth++;
+			// Callbacks may add or remove filters, so no references into the list
+			for (size_t n = 0; n < prop.filters.size(); n++) {
+				auto id = prop.filters[n].id;
+				if (is_removed(id) || !prop.filters[n].update(idx != nullptr, idx != nullptr ? *idx : 0, v)) continue;
+				if (!handler || dev.get_state() == device_state::init) continue;
+				if (idx != nullptr) handler->on_filtered_value(id, prop.handle, *idx, v);
+				else handler->on_filtered_value(id, prop.handle, v);
+			}
+			end_dispatch();
+		}
+
+		bool is_removed(filter_id id) const {
+			return std::find(removed_filters.begin(), removed_filters.end(), id) != removed_filters.end();
+		}
+
+		// Drops removed filters from the value filter lists and the registry
+		void purge_filters() {
+			auto pending = std::move(removed_filters);
+			removed_filters.clear();
+			for (auto& d : devices) {
+				for (auto& n : d.second->nodes) {
+					for (auto& p : n.second->properties) {
+						auto& list = p.second->filters;
+						list.erase(std::remove_if(list.begin(), list.end(), [&pending](const value_filter_binding& b) {
+							return std::find(pending.begin(), pending.end(), b.id) != pending.end();
+						}), list.end());
+					}
+				}
+			}
+			for (auto id : pending) value_filters.erase(id);
+		}
+
+		void end_dispatch() {
+			if (--dispatch_depth != 0) return;
+			if (!unwatched.empty()) purge_watchers();
+			if (!removed_filters.empty()) purge_filters();
+		}
+
+		void bind_watchers(remote_property& prop) {
+			auto node = prop.node.lock();
+			auto dev = node ? node->get_device() : nullptr;
+			if (!dev) return;
+			auto dev_id = dev->get_id();
+			auto node_id = node->get_id();
+			for (auto& e : watches) {
+				if (e.second->matches(dev_id, node_id, prop.id)) bind_watcher(prop, e.second);
+			}
+		}
+
+		static void bind_watcher(remote_property& prop, const std::shared_ptr<watch_entry>& w) {
+			prop.watchers.push_back(w);
+			w->bound.insert(prop.handle);
+		}
+
+		void dispatch_watchers(const std::shared_ptr<remote_property>& prop, const int64_t* idx, const std::string& payload) {
+			property_ptr ptr = prop;
+			auto i = idx != nullptr ? *idx : no_index;
+			dispatch_depth++;
+			// Callbacks may add watchers to this property, so no references into the table
+			for (size_t n = 0; n < prop->watchers.size(); n++) {
+				auto w = prop->watchers[n];
+				if (w->active) w->callback(ptr, i, payload);
+			}
+			end_dispatch();
+		}
+
+		// Removes unwatched entries from the dispatch tables they are bound to
+		void purge_watchers() {
+			auto pending = std::move(unwatched);
+			unwatched.clear();
+			for (auto& w : pending) {
+				for (auto h : w->bound) {
+					auto prop = property_handles.get(h);
+					if (prop == nullptr) continue;
+					auto& list = prop->watchers;
+					list.erase(std::remove(list.begin(), list.end(), w), list.end());
+				}
+				w->bound.clear();
+			}
+		}
+
+		void record_history(const remote_property& prop, int64_t idx, const std::string& payload) {
+			history_store::key k{ prop.handle.index, idx };
+			auto b = history.find(k);
+			if (b == nullptr) {
+				// Excluded or rejected before, skip the path and pattern matching
+				if (history.is_skipped(k)) return;
+				auto type = property_datatype(prop);
+				auto path = property_path(prop);
+				if (path.empty()) return;
+				b = history.create(k, type, history_config.capacity(path, type));
+				if (b == nullptr) return;
+			}
+			history.record(*b, clock::now(), payload);
+		}
+
+		// (Re)insert all values of a property, needed when its node type or datatype changes
+		void reindex_numeric(const std::shared_ptr<remote_property>& prop) {
+			if (!has_numeric_observers()) return;
+			numeric_removed(*prop, false);
+			if (!prop->value.empty()) numeric_value_changed(*prop, no_index, prop->value);
+			for (auto& e : prop->value_array) numeric_value_changed(*prop, e.first, e.second);
+			// Aggregates the property left
+			for (auto& e : property_aggregates) {
+				for (auto agg : e.second) check_thresholds(*agg);
+			}
+		}
+
+		void filter_node(const std::shared_ptr<remote_device>& dev, const std::string& id) {
+			auto weight = node_weight(*dev, id);
+			dev->filtered_nodes.insert(id);
+			dev->structure_declared -= weight - node_weight(*dev, id);
+			auto it = dev->nodes.find(id);
+			if (it != dev->nodes.end()) {
+				node_removed(it->second);
+				dev->nodes.erase(it);
+			}
+		}
+
+		device_map::iterator remove_device(device_map::iterator it) {
+			auto dev = it->second;
+			device_removed(dev);
+			lru.erase(dev->lru_position);
+			it = devices.erase(it);
+			// The interest count survives, the subtree comes back on the next access
+			auto entry = materialized.find(dev->id);
+			if (entry != materialized.end() && entry->second.interest == 0) {
+				materialized.erase(entry);
+				update_subscriptions();
+			}
+			if (handler)
+				handler->on_device_removed(dev);
+			return it;
+		}
+
+		// Mark a device as most recently updated
+		void touch_device(remote_device& dev) {
+			lru.splice(lru.end(), lru, dev.lru_position);
+		}
+
+		void schedule_liveness(remote_device& dev) {
+			liveness->schedule({ dev.handle, dev.live_deadline }, dev.live_deadline);
+			dev.live_timer = dev.live_deadline;
+			dev.live_scheduled = true;
+		}
+
+		// Constant time: moves the deadline, a timer is only added if none is pending before it
+		void refresh_liveness(remote_device& dev, clock::time_point now) {
+			if (dev.stats_interval == clock::duration::zero()) return;
+			dev.live_deadline = now + std::chrono::duration_cast<clock::duration>(dev.stats_interval * liveness_factor);
+			dev.stale = false;
+			if (!dev.live_scheduled || dev.live_deadline < dev.live_timer) schedule_liveness(dev);
+		}
+
+		void liveness_expired(const liveness_timer& timer, clock::time_point now) {
+			auto dev = device_handles.get(timer.device);
+			// Removed device or replaced by an earlier timer
+			if (dev == nullptr || !dev->live_scheduled || timer.deadline != dev->live_timer) return;
+			dev->live_scheduled = false;
+			if (dev->stats_interval == clock::duration::zero()) return;
+			if (dev->live_deadline > now) {
+				schedule_liveness(*dev);
+				return;
+			}
+			// Sleeping or offline devices are not expected to talk
+			auto state = dev->get_state();
+			if (dev->stale || (state != device_state::init && state != device_state::ready && state != device_state::alert)) return;
+			dev->stale = true;
+			if (handler) handler->on_device_stale(dev->shared_from_this());
+		}
+
+		// Evict least recently updated devices until the limit is met
+		void enforce_max_devices(const remote_device* keep) {
+			if (eviction.max_devices == 0) return;
+			auto victim = lru.begin();
+			while (devices.size() > eviction.max_devices && victim != lru.end()) {
+				auto dev = *victim++;
+				if (dev == keep || has_interest(dev->id)) continue;
+				remove_device(devices.find(dev->id));
+			}
+		}
+
+		// Unknown datatypes are indexed as string, like get_datatype does for a missing one
+		static datatype property_datatype(const remote_property& prop) {
+			try {
+				return prop.get_datatype();
+			}
+			catch (const std::exception&) {
+				return datatype::string;
+			}
+		}
+
+		static void write_device(serialization::tree_writer& wr, const remote_device& dev) {
+			wr.begin_device(dev.id);
+			wr.begin_list(dev.attributes.size());
+			for (auto& e : dev.attributes) wr.attribute(e.first, e.second);
+			wr.begin_list(dev.nodes.size());
+			for (auto& n : dev.nodes) {
+				auto& node = *n.second;
+				wr.begin_node(node.id);
+				wr.begin_list(node.attributes.size());
+				for (auto& e : node.attributes) wr.attribute(e.first, e.second);
+				wr.begin_list(node.attributes_array.size());
+				for (auto& e : node.attributes_array) wr.indexed_attribute(e.first.first, e.first.second, e.second);
+				wr.begin_list(node.properties.size());
+				for (auto& p : node.properties) {
+					auto& prop = *p.second;
+					wr.begin_property(prop.id);
+					wr.begin_list(prop.attributes.size());
+					for (auto& e : prop.attributes) wr.attribute(e.first, e.second);
+					wr.value(prop.value);
+					wr.begin_list(prop.value_array.size());
+					for (auto& e : prop.value_array) wr.indexed_value(e.first, e.second);
+				}
+			}
+		}
+
+		void write_devices(serialization::tree_writer& wr) const {
+			for (auto& e : devices) write_device(wr, *e.second);
+		}
+
+		// Applies a decoded tree through the regular update path
+		struct tree_loader : serialization::tree_visitor {
+			master& m;
+			std::shared_ptr<remote_device> dev;
+			std::shared_ptr<remote_node> node;
+			std::shared_ptr<remote_property> prop;
+			std::string device_id;
+			std::string state;
+
+			tree_loader(master& pm)
+				: m(pm)
+			{}
+
+			virtual void on_device(const std::string& id) override {
+				// Devices already received live are newer than the snapshot
+				dev = nullptr;
+				device_id = id;
+				state.clear();
+				// In lazy mode only the state is restored
+				if (m.devices.count(id) == 0 && m.filter.match_device(id) && m.mode == discovery_mode::full) {
+					dev = m.get_add_device(id);
+					dev->from_cache = true;
+				}
+			}
+			virtual void on_device_attribute(const std::string& id, const std::string& value) override {
+				// $state is applied last so discovery fires on a complete tree
+				if (id == "state") state = value;
+				else if (dev) m.update_device_attribute(dev, id, value);
+			}
+			virtual void on_node(const std::string& id) override {
+				node = dev ? dev->get_add_node(id) : nullptr;
+			}
+			virtual void on_node_attribute(const std::string& id, const std::string& value) override {
+				if (node && id == "type" && !m.filter.match_node_type(value)) {
+					m.filter_node(dev, node->id);
+					node = nullptr;
+				}
+				if (node) m.update_node_attribute(dev, node, nullptr, id, value);
+			}
+			virtual void on_node_attribute(int64_t idx, const std::string& id, const std::string& value) override {
+				if (node) m.update_node_attribute(dev, node, &idx, id, value);
+			}
+			virtual void on_property(const std::string& id) override {
+				prop = node ? node->get_add_property(id) : nullptr;
+			}
+			virtual void on_property_attribute(const std::string& id, const std::string& value) override {
+				if (prop) m.update_property_attribute(dev, prop, nullptr, id, value);
+			}
+			virtual void on_property_value(const std::string& value) override {
+				if (prop && !value.empty()) m.update_property_value(dev, prop, nullptr, value);
+			}
+			virtual void on_property_value(int64_t idx, const std::string& value) override {
+				if (prop) m.update_property_value(dev, prop, &idx, value);
+			}
+			virtual void on_device_end() override {
+				if (dev && !state.empty())
+					m.update_device_attribute(dev, "state", state);
+				if (m.mode == discovery_mode::lazy && !state.empty() && m.filter.match_device(device_id) && m.device_states.count(device_id) == 0)
+					m.handle_lazy_state(device_id, state);
+				dev = nullptr;
+				node = nullptr;
+				prop = nullptr;
+			}
+		};
+
+		void cache_set_topic(remote_property& prop) {
+			auto node = prop.get_node();
+			auto dev = node ? node->get_device() : nullptr;
+			if (!dev) return;
+			auto& topic = prop.set_topic;
+			topic.reserve(base_topic.size() + dev->get_id().size() + node->get_id().size() + prop.id.size() + 6);
+			topic = base_topic;
+			topic += dev->get_id();
+			topic += '/';
+			topic += node->get_id();
+			prop.set_node_end = topic.size();
+			topic += '/';
+			topic += prop.id;
+			topic += "/set";
+		}
+
+		void publish_set_property(const remote_property* prop, const std::string& value) {
+			if (auto dev = sleeping_device(*prop)) dev->queued_sets[prop->set_topic] = value;
+			else mqtt.publish(prop->set_topic, value, 1, true);
+		}
+
+		void publish_set_property(const remote_property* prop, const std::string& value, int64_t idx) {
+			// Local and sized up front, may be called from several threads at once
+			auto index = std::to_string(idx);
+			std::string topic;
+			topic.reserve(prop->set_topic.size() + index.size() + 1);
+			topic.assign(prop->set_topic, 0, prop->set_node_end);
+			topic += '_';
+			topic += index;
+			topic.append(prop->set_topic, prop->set_node_end, std::string::npos);
+			if (auto dev = sleeping_device(*prop)) dev->queued_sets[topic] = value;
+			else mqtt.publish(topic, value, 1, true);
+		}
+
+		void start_set(property_handle h, const int64_t* idx, const std::string& value, clock::duration timeout, set_callback done) {
+			auto prop = property_handles.get(h);
+			if (prop == nullptr) {
+				if (done) done(set_status::removed);
+				return;
+			}
 			auto node = prop->get_node();
-			auto dev = node->get_device();
-			mqtt.publish(base_topic + dev->get_id() + "/" + node->get_id() + "_" + std::to_string(idx) + "/" + prop->get_id() + "/set", value, 1, true);
+			set_tracker::key_type key{ h.index, idx != nullptr ? *idx : no_index };
+			// Registered before publishing, a loopback client might deliver the echo right away
+			sets.add(key, value, node ? node->get_type() : "", prop->id, timeout, std::move(done));
+			if (idx != nullptr) publish_set_property(prop, value, *idx);
+			else publish_set_property(prop, value);
+			// The device will not publish a value it already reports (or it is dropped as duplicate)
+			auto current = idx != nullptr ? find_stored(prop->value_array, *idx) : &prop->value;
+			if (current != nullptr && *current == value) sets.value_received(key, value);
+		}
+
+		static set_callback fulfill(const std::shared_ptr<std::promise<void>>& promise) {
+			return [promise](set_status s) {
+				if (s == set_status::confirmed) promise->set_value();
+				else promise->set_exception(std::make_exception_ptr(set_error(s)));
+			};
 		}
 	public:
 		master(mqtt_client& con, std::string basetopic = "homie/")
-			: mqtt(con), handler(nullptr), base_topic(basetopic)
+			: mqtt(con), handler(nullptr), base_topic(basetopic), mode(discovery_mode::full), lazy_idle_timeout(std::chrono::minutes(5)), columns_enabled(false), next_aggregate(1), history_enabled(false), suppress_duplicates(true), queue_sleeping(false), liveness_factor(0), next_filter(1), next_watch(1), dispatch_depth(0)
 		{
+			rejections.fill(0);
+			duplicates.fill(0);
+			subscriptions = compute_subscriptions();
 			mqtt.set_event_handler(this);
 			mqtt.open();
 		}
 
 		~master() {
-			this->mqtt.unsubscribe(base_topic + "#");
+			sets.fail_all(set_status::cancelled);
+			for (auto& t : subscriptions) this->mqtt.unsubscribe(t);
 			mqtt.set_event_handler(nullptr);
 		}
 
@@ -326,7 +1472,9 @@ namespace homie {
 			return res;
 		}
 
+		// In lazy mode this materializes the device, its subtree fills in as the retained messages arrive
 		device_ptr get_discovered_device(const std::string& id) {
+			if (mode == discovery_mode::lazy) return materialize(id);
 			return devices.count(id) ? devices.at(id) : nullptr;
 		}
 
@@ -334,10 +1482,712 @@ namespace homie {
 			return devices.count(id) ? devices.at(id) : nullptr;
 		}
 
+		// Persist all discovered devices to a memory mapped cache file.
+		// The file is written next to the target and renamed into place.
+		void save_cache(const std::string& path) const {
+			// A counting pass sizes the file, the second pass encodes straight into the mapping
+			serialization::tree_writer counter;
+			write_devices(counter);
+
+			auto tmp = path + ".tmp";
+			{
+				auto file = mapped_file::create(tmp, counter.size());
+				serialization::tree_writer wr(file.data(), file.size());
+				write_devices(wr);
+				file.sync();
+			}
+			replace_file(tmp, path);
+		}
+
+		// Restore devices from a cache file written by save_cache.
+		// Devices already received from the broker are not overwritten, restored devices
+		// are updated by the live retained messages as they arrive.
+		void load_cache(const std::string& path) {
+			auto file = mapped_file::open_read(path);
+			deserialize(file.data(), file.size());
+		}
+
+		// Append a snapshot of all discovered devices to out (see serialization.h)
+		void serialize(std::string& out) const {
+			serialization::tree_writer wr(out);
+			write_devices(wr);
+		}
+
+		// Restore devices from a snapshot, with the same semantics as load_cache.
+		// The whole stream is checked first, a truncated or corrupt snapshot changes nothing.
+		void deserialize(const void* data, size_t len) {
+			serialization::tree_reader::validate(data, len);
+			serialization::tree_reader rd(data, len);
+			tree_loader loader(*this);
+			rd.read_all(loader);
+		}
+
+		// Remove restored devices which have not been confirmed by the broker since load_cache.
+		// Call once the retained messages had a chance to arrive.
+		void drop_unconfirmed_devices() {
+			for (auto it = devices.begin(); it != devices.end();) {
+				if (it->second->from_cache) it = remove_device(it);
+				else it++;
+			}
+		}
+
+		// Handle based access, avoids string lookups and shared_ptr copies in hot loops
+		device_handle find_device(const std::string& id) const {
+			auto it = devices.find(id);
+			return it != devices.end() ? it->second->handle : device_handle();
+		}
+
+		node_handle find_node(device_handle dev, const std::string& id) const {
+			auto d = device_handles.get(dev);
+			if (d == nullptr) return node_handle();
+			auto it = d->nodes.find(id);
+			return it != d->nodes.end() ? it->second->handle : node_handle();
+		}
+
+		property_handle find_property(node_handle node, const std::string& id) const {
+			auto n = node_handles.get(node);
+			if (n == nullptr) return property_handle();
+			auto it = n->properties.find(id);
+			return it != n->properties.end() ? it->second->handle : property_handle();
+		}
+
+		property_handle find_property(const std::string& dev, const std::string& node, const std::string& id) const {
+			return find_property(find_node(find_device(dev), node), id);
+		}
+
+		// Handle of a property returned by this master, invalid for foreign properties
+		property_handle get_handle(const const_property_ptr& prop) const {
+			auto p = dynamic_cast<const remote_property*>(prop.get());
+			return p != nullptr && p->parent == this ? p->handle : property_handle();
+		}
+
+		bool is_valid(device_handle h) const { return device_handles.get(h) != nullptr; }
+		bool is_valid(node_handle h) const { return node_handles.get(h) != nullptr; }
+		bool is_valid(property_handle h) const { return property_handles.get(h) != nullptr; }
+
+		device_ptr get_device(device_handle h) const {
+			auto d = device_handles.get(h);
+			return d != nullptr ? d->shared_from_this() : nullptr;
+		}
+
+		node_ptr get_node(node_handle h) const {
+			auto n = node_handles.get(h);
+			return n != nullptr ? n->shared_from_this() : nullptr;
+		}
+
+		property_ptr get_property(property_handle h) const {
+			auto p = property_handles.get(h);
+			return p != nullptr ? p->shared_from_this() : nullptr;
+		}
+
+		// Publishes value to the set topic of the property and calls done once the device reported
+		// it back, or with a failure once timeout passed (checked by tick). done runs from within
+		// message processing or tick.
+		void set_value_async(property_handle h, const std::string& value, clock::duration timeout, set_callback done) {
+			start_set(h, nullptr, value, timeout, std::move(done));
+		}
+
+		void set_value_async(property_handle h, int64_t idx, const std::string& value, clock::duration timeout, set_callback done) {
+			start_set(h, &idx, value, timeout, std::move(done));
+		}
+
+		// The future throws set_error if the value was not confirmed
+		std::future<void> set_value_async(property_handle h, const std::string& value, clock::duration timeout) {
+			auto promise = std::make_shared<std::promise<void>>();
+			auto res = promise->get_future();
+			start_set(h, nullptr, value, timeout, fulfill(promise));
+			return res;
+		}
+
+		std::future<void> set_value_async(property_handle h, int64_t idx, const std::string& value, clock::duration timeout) {
+			auto promise = std::make_shared<std::promise<void>>();
+			auto res = promise->get_future();
+			start_set(h, &idx, value, timeout, fulfill(promise));
+			return res;
+		}
+
+#ifdef HOMIE_HAS_COROUTINES
+		// co_await master.set_value_awaitable(...) resumes on the thread processing messages or calling tick
+		set_awaitable set_value_awaitable(property_handle h, const std::string& value, clock::duration timeout) {
+			return set_awaitable([this, h, value, timeout](set_callback done) { start_set(h, nullptr, value, timeout, std::move(done)); });
+		}
+
+		set_awaitable set_value_awaitable(property_handle h, int64_t idx, const std::string& value, clock::duration timeout) {
+			return set_awaitable([this, h, idx, value, timeout](set_callback done) { start_set(h, &idx, value, timeout, std::move(done)); });
+		}
+#endif
+
+		// Bulk sets, each published as a single batch through mqtt_client::publish_batch.
+		// They return the number of messages published (not counting queued ones).
+
+		// Indices first to last (inclusive) of an array node property, limited to its $array
+		size_t set_values(property_handle h, int64_t first, int64_t last, const std::string& value) {
+			auto prop = property_handles.get(h);
+			if (prop == nullptr) return 0;
+			// Clamped to the declared $array, nothing for non array nodes
+			auto node = prop->node.lock();
+			std::pair<int64_t, int64_t> range;
+			if (!node || !parse_array_range(node->get_attribute("array"), range)) return 0;
+			first = std::max(first, range.first);
+			last = std::min(last, range.second);
+			if (last < first) return 0;
+			auto prefix = prop->set_topic.substr(0, prop->set_node_end) + "_";
+			auto suffix = prop->set_topic.substr(prop->set_node_end);
+			// Computed unsigned, the difference of two int64_t may overflow
+			auto span = static_cast<uint64_t>(last) - static_cast<uint64_t>(first);
+			auto count = static_cast<size_t>(std::min<uint64_t>(span, 4095)) + 1;
+			if (auto dev = sleeping_device(*prop)) {
+				for (uint64_t n = 0; n <= span; n++) dev->queued_sets[prefix + std::to_string(first + static_cast<int64_t>(n)) + suffix] = value;
+				return 0;
+			}
+			mqtt_batch batch;
+			batch.reserve(count, count * (prefix.size() + suffix.size() + value.size() + 4));
+			for (uint64_t n = 0; n <= span; n++) batch.add(prefix, first + static_cast<int64_t>(n), suffix, value);
+			mqtt.publish_batch(batch);
+			return batch.size();
+		}
+
+		// The same value on several properties, stale handles are skipped
+		size_t set_values(const std::vector<property_handle>& props, const std::string& value) {
+			mqtt_batch batch;
+			for (auto h : props) {
+				auto prop = property_handles.get(h);
+				if (prop == nullptr) continue;
+				if (auto dev = sleeping_device(*prop)) dev->queued_sets[prop->set_topic] = value;
+				else batch.add(prop->set_topic, value);
+			}
+			if (!batch.empty()) mqtt.publish_batch(batch);
+			return batch.size();
+		}
+
+		// Individual values for several properties, stale handles are skipped
+		size_t set_values(const std::vector<std::pair<property_handle, std::string>>& values) {
+			mqtt_batch batch;
+			for (auto& e : values) {
+				auto prop = property_handles.get(e.first);
+				if (prop == nullptr) continue;
+				if (auto dev = sleeping_device(*prop)) dev->queued_sets[prop->set_topic] = e.second;
+				else batch.add(prop->set_topic, e.second);
+			}
+			if (!batch.empty()) mqtt.publish_batch(batch);
+			return batch.size();
+		}
+
+		// One property on several devices by id, the devices do not have to be discovered
+		size_t set_values(const std::vector<std::string>& device_ids, const std::string& node, const std::string& property, const std::string& value) {
+			auto suffix = "/" + node + "/" + property + "/set";
+			mqtt_batch batch;
+			batch.reserve(device_ids.size(), device_ids.size() * (base_topic.size() + suffix.size() + value.size() + 16));
+			std::string topic;
+			for (auto& id : device_ids) {
+				topic.assign(base_topic);
+				topic += id;
+				topic += suffix;
+				auto dev = queue_sleeping ? devices.find(id) : devices.end();
+				if (dev != devices.end() && dev->second->get_state() == device_state::sleeping) dev->second->queued_sets[topic] = value;
+				else batch.add(topic, value);
+			}
+			if (!batch.empty()) mqtt.publish_batch(batch);
+			return batch.size();
+		}
+
+		size_t get_pending_set_count() const { return sets.pending(); }
+		uint64_t get_set_count(set_status status) const { return sets.count(status); }
+		// Latency between set_value_async and the confirming value
+		const latency_histogram& get_set_latency() const { return sets.latency(); }
+		// nullptr if no set of this node type and property was confirmed yet
+		const latency_histogram* get_set_latency(const std::string& node_type, const std::string& property) const { return sets.latency(node_type, property); }
+
+		// Current value, empty for stale handles. The reference is valid until the next message.
+		const std::string& value(property_handle h) const {
+			auto p = property_handles.get(h);
+			return p != nullptr ? p->value : empty_string();
+		}
+
+		const std::string& value(property_handle h, int64_t idx) const {
+			auto p = property_handles.get(h);
+			if (p == nullptr) return empty_string();
+			auto it = p->value_array.find(idx);
+			return it != p->value_array.end() ? it->second : empty_string();
+		}
+
+		const std::string& attribute(property_handle h, const std::string& id) const {
+			auto p = property_handles.get(h);
+			if (p == nullptr) return empty_string();
+			auto it = p->attributes.find(id);
+			return it != p->attributes.end() ? it->second : empty_string();
+		}
+
+		typedef attribute_index<device_state, device_ptr>::range device_range;
+		typedef attribute_index<std::string, node_ptr>::range node_range;
+		typedef attribute_index<datatype, property_ptr>::range property_range;
+
+		// Indexed lookups, the returned ranges are invalidated by the next message
+		device_range get_devices_by_state(device_state state) const {
+			return index_device_state.find(state);
+		}
+
+		node_range get_nodes_by_type(const std::string& type) const {
+			return index_node_type.find(type);
+		}
+
+		property_range get_properties_by_datatype(datatype type) const {
+			return index_property_datatype.find(type);
+		}
+
+		property_range get_properties_by_unit(const std::string& unit) const {
+			return index_property_unit.find(unit);
+		}
+
+		property_range get_properties_by_settable(bool settable) const {
+			return index_property_settable.find(settable);
+		}
+
 		void publish_broadcast(const std::string& level, const std::string& payload) {
 			mqtt.publish(base_topic + "$broadcast/" + level, payload, 1, false);
 		}
 
+		// In lazy mode only $state is subscribed for all devices, subtrees are
+		// materialized by get_discovered_device or register_interest and evicted by tick
+		// once they were not accessed for the idle timeout.
+		void set_discovery_mode(discovery_mode m) {
+			if (m == mode) return;
+			mode = m;
+			materialized.clear();
+			device_states.clear();
+			if (mode == discovery_mode::lazy) {
+				for (auto it = devices.begin(); it != devices.end();) {
+					device_states[it->first] = it->second->get_state();
+					it = remove_device(it);
+				}
+			}
+			update_subscriptions();
+		}
+
+		discovery_mode get_discovery_mode() const {
+			return mode;
+		}
+
+		void set_lazy_idle_timeout(clock::duration timeout) {
+			lazy_idle_timeout = timeout;
+		}
+
+		// Device states known in lazy mode, including devices not materialized
+		const std::map<std::string, device_state>& get_device_states() const {
+			return device_states;
+		}
+
+		// Keep a device materialized until release_interest is called
+		device_ptr register_interest(const std::string& id) {
+			auto dev = materialize(id);
+			if (dev) materialized.find(id)->second.interest++;
+			return dev;
+		}
+
+		void release_interest(const std::string& id) {
+			auto it = materialized.find(id);
+			if (it == materialized.end() || it->second.interest == 0) return;
+			it->second.interest--;
+			it->second.last_access = clock::now();
+		}
+
+		// Time based housekeeping, call periodically
+		void tick(clock::time_point now = clock::now()) {
+			sets.expire(now);
+			if (liveness) liveness->advance(now, [this, now](const liveness_timer& t) { liveness_expired(t, now); });
+			if (mode == discovery_mode::lazy) {
+				bool changed = false;
+				for (auto it = materialized.begin(); it != materialized.end();) {
+					if (it->second.interest == 0 && now - it->second.last_access >= lazy_idle_timeout) {
+						auto dev = devices.find(it->first);
+						it = materialized.erase(it);
+						if (dev != devices.end()) remove_device(dev);
+						changed = true;
+					}
+					else it++;
+				}
+				if (changed) update_subscriptions();
+			}
+			if (eviction.offline_ttl != clock::duration::zero() || eviction.init_ttl != clock::duration::zero()) {
+				for (auto it = devices.begin(); it != devices.end();) {
+					auto& dev = *it->second;
+					auto state = dev.get_state();
+					auto age = now - dev.state_since;
+					if (has_interest(dev.id))
+						it++;
+					else if (eviction.offline_ttl != clock::duration::zero() && (state == device_state::lost || state == device_state::disconnected) && age >= eviction.offline_ttl)
+						it = remove_device(it);
+					else if (eviction.init_ttl != clock::duration::zero() && state == device_state::init && age >= eviction.init_ttl)
+						it = remove_device(it);
+					else it++;
+				}
+			}
+		}
+
+		void set_eviction_policy(const eviction_policy& policy) {
+			eviction = policy;
+			enforce_max_devices(nullptr);
+		}
+
+		const eviction_policy& get_eviction_policy() const {
+			return eviction;
+		}
+
+		// Maintain a columnar copy of all integer and number values, keyed by (node type, property id, datatype)
+		void set_column_store_enabled(bool enable) {
+			if (enable == columns_enabled) return;
+			columns_enabled = enable;
+			columns.clear();
+			if (!enable) return;
+			for (auto& d : devices) {
+				for (auto& n : d.second->nodes) {
+					auto type = n.second->get_type();
+					for (auto& p : n.second->properties) {
+						auto& prop = *p.second;
+						auto dt = property_datatype(prop);
+						if (!prop.value.empty()) columns.set(prop.handle, no_index, type, prop.id, dt, prop.value);
+						for (auto& e : prop.value_array) columns.set(prop.handle, e.first, type, prop.id, dt, e.second);
+					}
+				}
+			}
+		}
+
+		bool is_column_store_enabled() const {
+			return columns_enabled;
+		}
+
+		const column_store& get_column_store() const {
+			return columns;
+		}
+
+		// Column of a property id across all nodes of a type, nullptr if there is none.
+		// Without datatype the integer column is preferred over the number column.
+		const numeric_column* get_column(const std::string& node_type, const std::string& property) const {
+			return columns.find(node_type, property);
+		}
+
+		const numeric_column* get_column(const std::string& node_type, const std::string& property, datatype type) const {
+			return columns.find(node_type, property, type);
+		}
+
+		// Keep the last values of properties, existing history is dropped
+		void set_history_policy(const history_policy& policy) {
+			history_config = policy;
+			history_enabled = policy.enabled();
+			history.clear();
+			history.set_max_bytes(policy.max_bytes);
+		}
+
+		const history_policy& get_history_policy() const {
+			return history_config;
+		}
+
+		// Samples of integer and float properties within [from, to], oldest first
+		std::vector<history_sample<double>> get_history(property_handle prop, clock::time_point from, clock::time_point to, int64_t idx = no_index) const {
+			auto b = is_valid(prop) ? history.find({ prop.index, idx }) : nullptr;
+			if (b == nullptr) return {};
+			return b->numbers.range(from, to);
+		}
+
+		// Samples of all other properties within [from, to], oldest first
+		std::vector<history_sample<std::string>> get_text_history(property_handle prop, clock::time_point from, clock::time_point to, int64_t idx = no_index) const {
+			auto b = is_valid(prop) ? history.find({ prop.index, idx }) : nullptr;
+			if (b == nullptr) return {};
+			return b->texts.range(from, to);
+		}
+
+		// Memory usage and rejected buffers
+		const history_store& get_history_store() const {
+			return history;
+		}
+
+		// Append every value and attribute change to a segmented, memory mapped journal at path.
+		// An existing journal is continued, read it with journal_reader.
+		void open_journal(const std::string& path, size_t segment_size = journal::default_segment_size) {
+			change_journal.reset();
+			change_journal.reset(new journal_writer(path, segment_size));
+		}
+
+		void close_journal() {
+			change_journal.reset();
+		}
+
+		// Flush written records to disk
+		void sync_journal() {
+			if (change_journal) change_journal->sync();
+		}
+
+		// Sequence number of the last journaled change, 0 if none
+		uint64_t get_journal_sequence() const {
+			return change_journal ? change_journal->last_sequence() : 0;
+		}
+
+		// Keep the most recent changes (bounded by count and encoded size) for changes_since
+		void enable_change_log(size_t records = 4096, size_t bytes = 1024 * 1024) {
+			changes.reset(new change_log(records, bytes));
+		}
+
+		void disable_change_log() {
+			changes.reset();
+		}
+
+		// Changes after seq, may be called from any thread while messages are processed.
+		// Start with 0, continue with the returned sequence and rescan all devices on resync.
+		change_delta changes_since(uint64_t seq, size_t max = std::numeric_limits<size_t>::max()) const {
+			if (!changes) {
+				change_delta res;
+				res.resync = true;
+				return res;
+			}
+			return changes->changes_since(seq, max);
+		}
+
+		// Report devices silent for longer than factor * $stats/interval through on_device_stale.
+		// Any message of a device resets its deadline, expiry is checked by tick with the given
+		// resolution. Devices without $stats/interval are not monitored.
+		void enable_liveness_monitor(double factor = 2.5, clock::duration resolution = std::chrono::seconds(1)) {
+			liveness.reset(new timer_wheel<liveness_timer>(resolution));
+			liveness_factor = factor;
+			auto now = clock::now();
+			for (auto& d : devices) {
+				d.second->live_scheduled = false;
+				refresh_liveness(*d.second, now);
+			}
+		}
+
+		void disable_liveness_monitor() {
+			liveness.reset();
+			for (auto& d : devices) {
+				d.second->live_scheduled = false;
+				d.second->stale = false;
+			}
+		}
+
+		// True if the device was reported stale and did not send anything since
+		bool is_device_stale(const std::string& device) const {
+			auto it = devices.find(device);
+			return it != devices.end() && it->second->stale;
+		}
+
+		// Queue sets to sleeping devices (last value per topic wins) and publish them as one batch
+		// once the device is ready again. Disabling publishes everything queued so far.
+		void set_sleep_queue(bool enable) {
+			queue_sleeping = enable;
+			if (enable) return;
+			for (auto& d : devices) {
+				if (!d.second->queued_sets.empty()) flush_queued_sets(*d.second);
+			}
+		}
+
+		bool get_sleep_queue() const {
+			return queue_sleeping;
+		}
+
+		// Declared versus received structure of a device, see device_completeness
+		device_completeness get_completeness(const std::string& device) const {
+			auto it = devices.find(device);
+			return it != devices.end() ? completeness(*it->second) : device_completeness();
+		}
+
+		size_t get_queued_set_count(const std::string& device) const {
+			auto it = devices.find(device);
+			return it != devices.end() ? it->second->queued_sets.size() : 0;
+		}
+
+		// Drops the queued sets of a device without publishing them
+		void clear_queued_sets(const std::string& device) {
+			auto it = devices.find(device);
+			if (it != devices.end()) it->second->queued_sets.clear();
+		}
+
+		// Drop updates which repeat the stored payload (no callbacks, journal records, ...). Enabled by default.
+		void set_duplicate_suppression(bool enable) {
+			suppress_duplicates = enable;
+		}
+
+		bool get_duplicate_suppression() const {
+			return suppress_duplicates;
+		}
+
+		uint64_t get_suppressed_count(change_kind kind) const {
+			return duplicates[static_cast<size_t>(kind)];
+		}
+
+		uint64_t get_suppressed_count() const {
+			uint64_t res = 0;
+			for (auto c : duplicates) res += c;
+			return res;
+		}
+
+		// Report numeric values of matching properties through on_filtered_value,
+		// but only if they pass the deadband or cross the threshold
+		filter_id add_value_filter(const value_filter& filter) {
+			auto id = next_filter++;
+			auto& f = value_filters.emplace(id, filter).first->second;
+			// Append only, existing bindings keep their state
+			for (auto& d : devices) {
+				for (auto& n : d.second->nodes) {
+					auto type = n.second->get_type();
+					for (auto& p : n.second->properties) {
+						if (f.matches(d.first + "/" + n.first + "/" + p.first, type)) p.second->filters.emplace_back(id, &f);
+					}
+				}
+			}
+			return id;
+		}
+
+		// Safe to call from within on_filtered_value
+		void remove_value_filter(filter_id id) {
+			if (value_filters.count(id) == 0 || is_removed(id)) return;
+			removed_filters.push_back(id);
+			if (dispatch_depth == 0) purge_filters();
+		}
+
+		// Call callback for value changes of matching properties. device, node and property
+		// are glob patterns ("*" matches everything), array nodes are matched without index.
+		watch_token watch(const std::string& device, const std::string& node, const std::string& property, watch_callback callback) {
+			auto entry = std::make_shared<watch_entry>();
+			entry->token = next_watch++;
+			entry->device = device;
+			entry->node = node;
+			entry->property = property;
+			entry->callback = std::move(callback);
+			entry->active = true;
+			watches.emplace(entry->token, entry);
+			for (auto& d : devices) {
+				if (!watch_entry::match(device, d.first)) continue;
+				for (auto& n : d.second->nodes) {
+					if (!watch_entry::match(node, n.first)) continue;
+					for (auto& p : n.second->properties) {
+						if (watch_entry::match(property, p.first)) bind_watcher(*p.second, entry);
+					}
+				}
+			}
+			return entry->token;
+		}
+
+		// Safe to call from within a watch callback
+		void unwatch(watch_token token) {
+			auto it = watches.find(token);
+			if (it == watches.end()) return;
+			it->second->active = false;
+			unwatched.push_back(it->second);
+			watches.erase(it);
+			if (dispatch_depth == 0) purge_watchers();
+		}
+
+		// Number of devices currently in a state
+		size_t get_device_count(device_state state) const {
+			return index_device_state.count(state);
+		}
+
+		// Maintain count/sum/min/max/mean of a property over all nodes of a type.
+		// Only integer and float values are included.
+		aggregate_id add_aggregate(const std::string& node_type, const std::string& property) {
+			auto id = next_aggregate++;
+			auto& agg = aggregates.emplace(id, fleet_aggregate(id)).first->second;
+			property_aggregates[{ node_type, property }].push_back(&agg);
+			for (auto& n : index_node_type.find(node_type)) {
+				auto& node = static_cast<const remote_node&>(*n);
+				auto it = node.properties.find(property);
+				if (it == node.properties.end()) continue;
+				auto& prop = *it->second;
+				if (!prop.value.empty()) aggregate_value(agg, prop, no_index, prop.value);
+				for (auto& e : prop.value_array) aggregate_value(agg, prop, e.first, e.second);
+			}
+			return id;
+		}
+
+		// Maintain the number of devices in a state (count, each device contributes 1)
+		aggregate_id add_state_aggregate(device_state state) {
+			auto id = next_aggregate++;
+			auto& agg = aggregates.emplace(id, fleet_aggregate(id)).first->second;
+			state_aggregates[state].push_back(&agg);
+			for (auto& d : index_device_state.find(state))
+				agg.set({ static_cast<const remote_device&>(*d).handle.index, no_index }, 1);
+			return id;
+		}
+
+		void remove_aggregate(aggregate_id id) {
+			auto it = aggregates.find(id);
+			if (it == aggregates.end()) return;
+			auto unlink = [&](std::vector<fleet_aggregate*>& list) {
+				list.erase(std::remove(list.begin(), list.end(), &it->second), list.end());
+				return list.empty();
+			};
+			for (auto e = property_aggregates.begin(); e != property_aggregates.end();) {
+				if (unlink(e->second)) e = property_aggregates.erase(e);
+				else ++e;
+			}
+			for (auto e = state_aggregates.begin(); e != state_aggregates.end();) {
+				if (unlink(e->second)) e = state_aggregates.erase(e);
+				else ++e;
+			}
+			aggregates.erase(it);
+		}
+
+		// nullptr if there is no such aggregate
+		const fleet_aggregate* get_aggregate(aggregate_id id) const {
+			auto it = aggregates.find(id);
+			return it != aggregates.end() ? &it->second : nullptr;
+		}
+
+		// Calls on_aggregate_threshold whenever the field crosses the threshold
+		void add_aggregate_threshold(aggregate_id id, aggregate_field field, double threshold) {
+			auto it = aggregates.find(id);
+			if (it != aggregates.end()) it->second.add_threshold(field, threshold);
+		}
+
+		// Hard resource limits, violating messages are dropped and counted
+		void set_limits(const master_limits& l) {
+			limits = l;
+		}
+
+		const master_limits& get_limits() const {
+			return limits;
+		}
+
+		uint64_t get_rejection_count(rejection_reason reason) const {
+			return rejections[static_cast<size_t>(reason)];
+		}
+
+		// Restrict discovery to matching devices and node types.
+		// Subscriptions are narrowed where possible and already discovered
+		// devices and nodes not matching the new filter are dropped.
+		void set_discovery_filter(const discovery_filter& f) {
+			filter = f;
+			for (auto it = materialized.begin(); it != materialized.end();) {
+				if (!filter.match_device(it->first)) it = materialized.erase(it);
+				else it++;
+			}
+			for (auto it = device_states.begin(); it != device_states.end();) {
+				if (!filter.match_device(it->first)) it = device_states.erase(it);
+				else it++;
+			}
+			update_subscriptions();
+
+			for (auto it = devices.begin(); it != devices.end();) {
+				if (!filter.match_device(it->first)) {
+					it = remove_device(it);
+					continue;
+				}
+				auto dev = it->second;
+				if (!filter.node_types.empty()) {
+					std::vector<std::string> drop;
+					for (auto& n : dev->nodes) {
+						auto type = n.second->get_type();
+						if (!type.empty() && !filter.match_node_type(type)) drop.push_back(n.first);
+					}
+					for (auto& n : drop) filter_node(dev, n);
+				}
+				it++;
+			}
+		}
+
+		const discovery_filter& get_discovery_filter() const {
+			return filter;
+		}
+
 		void set_event_handler(master_event_handler* hdl) {
 			handler = hdl;
 		}
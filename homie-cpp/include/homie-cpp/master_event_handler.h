@@ -1,8 +1,22 @@
 #pragma once
 #include <string>
 #include "device.h"
+#include "handle_table.h"
+#include "fleet_aggregate.h"
+#include "value_filter.h"
 
 namespace homie {
+	// How much of the tree a device declared ($nodes, $properties, $array) has been received.
+	// Counted are $nodes itself, $properties of every declared node, $array of declared
+	// array nodes and $datatype of every declared property.
+	struct device_completeness {
+		size_t declared = 0;
+		size_t present = 0;
+
+		bool is_complete() const { return declared != 0 && present == declared; }
+		double ratio() const { return declared == 0 ? 0.0 : static_cast<double>(present) / static_cast<double>(declared); }
+	};
+
 	struct master_event_handler {
 		virtual void on_broadcast(const std::string& level, const std::string& payload) = 0;
 		// Called when device state changes from init to something else
@@ -14,5 +28,28 @@ namespace homie {
 		virtual void on_property_changed(property_ptr prop, int64_t idx, const std::string& attribute) = 0;
 		virtual void on_property_value_changed(property_ptr prop, const std::string& value) = 0;
 		virtual void on_property_value_changed(property_ptr prop, int64_t idx, const std::string& value) = 0;
+
+		// Optional events, default to doing nothing
+
+		// Called on every $state change while in lazy discovery mode, including devices not materialized
+		virtual void on_device_state(const std::string& id, device_state state) {}
+		// Same as on_property_value_changed, carrying the handle of the property
+		virtual void on_value_changed(property_handle prop, const std::string& value) {}
+		virtual void on_value_changed(property_handle prop, int64_t idx, const std::string& value) {}
+		// Called when a registered aggregate crosses one of its thresholds
+		virtual void on_aggregate_threshold(aggregate_id id, aggregate_field field, double threshold, bool above) {}
+		// Called for values passing a filter registered with add_value_filter
+		virtual void on_filtered_value(filter_id id, property_handle prop, double value) {}
+		virtual void on_filtered_value(filter_id id, property_handle prop, int64_t idx, double value) {}
+		// Called once everything a device declared in $nodes, $properties and $array was received
+		// and it left init. Called again if the device declares more and that arrives as well.
+		virtual void on_device_complete(device_ptr dev, const device_completeness& completeness) {}
+		// Called after a node or property was dropped because the device no longer declares it
+		virtual void on_node_removed(node_ptr node) {}
+		virtual void on_property_removed(property_ptr prop) {}
+		// Called when a device monitored by the liveness monitor missed its deadline
+		virtual void on_device_stale(device_ptr dev) {}
+		// Called after a device was removed (evicted, filtered or not confirmed after load_cache)
+		virtual void on_device_removed(device_ptr dev) {}
 	};
 }
\ No newline at end of file
@@ -0,0 +1,75 @@
+#pragma once
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace homie {
+	// Messages published together with the same qos and retain flag. Topics and payloads
+	// are stored back to back in a single buffer.
+	class mqtt_batch {
+		struct entry {
+			size_t topic;
+			size_t topic_len;
+			size_t payload;
+			size_t payload_len;
+		};
+
+		std::string buffer;
+		std::vector<entry> entries;
+		int qos_level;
+		bool retain_flag;
+	public:
+		mqtt_batch(int qos = 1, bool retain = true)
+			: qos_level(qos), retain_flag(retain)
+		{}
+
+		void reserve(size_t messages, size_t bytes) {
+			entries.reserve(messages);
+			buffer.reserve(bytes);
+		}
+
+		void add(const std::string& topic, const std::string& payload) {
+			entry e;
+			e.topic = buffer.size();
+			e.topic_len = topic.size();
+			buffer += topic;
+			e.payload = buffer.size();
+			e.payload_len = payload.size();
+			buffer += payload;
+			entries.push_back(e);
+		}
+
+		// Adds a message with the topic prefix + idx + suffix, used for array node topics
+		void add(const std::string& prefix, int64_t idx, const std::string& suffix, const std::string& payload) {
+			entry e;
+			e.topic = buffer.size();
+			buffer += prefix;
+			buffer += std::to_string(idx);
+			buffer += suffix;
+			e.topic_len = buffer.size() - e.topic;
+			e.payload = buffer.size();
+			e.payload_len = payload.size();
+			buffer += payload;
+			entries.push_back(e);
+		}
+
+		void clear() {
+			buffer.clear();
+			entries.clear();
+		}
+
+		size_t size() const { return entries.size(); }
+		bool empty() const { return entries.empty(); }
+		int qos() const { return qos_level; }
+		bool retain() const { return retain_flag; }
+
+		// Pointer and length access for transports that do not need std::string
+		const char* topic_data(size_t i) const { return buffer.data() + entries[i].topic; }
+		size_t topic_size(size_t i) const { return entries[i].topic_len; }
+		const char* payload_data(size_t i) const { return buffer.data() + entries[i].payload; }
+		size_t payload_size(size_t i) const { return entries[i].payload_len; }
+
+		std::string topic(size_t i) const { return buffer.substr(entries[i].topic, entries[i].topic_len); }
+		std::string payload(size_t i) const { return buffer.substr(entries[i].payload, entries[i].payload_len); }
+	};
+}
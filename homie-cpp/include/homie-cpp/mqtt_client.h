@@ -1,5 +1,6 @@
 #pragma once
 #include "mqtt_event_handler.h"
+#include "mqtt_batch.h"
 
 namespace homie {
 	struct mqtt_client {
@@ -10,5 +11,11 @@ namespace homie {
 		virtual void subscribe(const std::string& topic, int qos) = 0;
 		virtual void unsubscribe(const std::string& topic) = 0;
 		virtual bool is_connected() const = 0;
+		// Publish several messages at once. Clients able to send them in one go (one lock,
+		// one write) should override this, the default publishes them one by one.
+		virtual void publish_batch(const mqtt_batch& batch) {
+			for (size_t i = 0; i < batch.size(); i++)
+				publish(batch.topic(i), batch.payload(i), batch.qos(), batch.retain());
+		}
 	};
 }
\ No newline at end of file
@@ -19,6 +19,8 @@ namespace homie {
 		virtual std::string get_type() const = 0;
 		virtual bool is_array() const = 0;
 		virtual std::pair<int64_t, int64_t> array_range() const = 0;
+		// Array indices with attributes or values
+		virtual std::set<int64_t> get_indices() const = 0;
 		virtual std::set<std::string> get_properties() const = 0;
 		virtual const_property_ptr get_property(const std::string& id) const = 0;
 		virtual property_ptr get_property(const std::string& id) = 0;
@@ -41,6 +43,17 @@ namespace homie {
 			if (pos == std::string::npos || pos == 0 || pos == att.size() - 1) throw std::logic_error("invalid attribute");
 			return{ std::stoll(att.substr(0, pos)), std::stoll(att.substr(pos + 1)) };
 		}
+		// The whole declared range, nodes storing sparse indices should override this
+		virtual std::set<int64_t> get_indices() const {
+			std::set<int64_t> res;
+			if (!is_array()) return res;
+			auto range = array_range();
+			for (auto i = range.first; i <= range.second; i++) {
+				res.insert(i);
+				if (i == range.second) break;
+			}
+			return res;
+		}
 	};
 	typedef std::shared_ptr<node> node_ptr;
 	typedef std::shared_ptr<const node> const_node_ptr;
@@ -0,0 +1,276 @@
+#pragma once
+#include "master.h"
+#include <set>
+#include <string>
+
+namespace homie {
+	struct partition_options {
+		// Unique id of this instance within the group
+		std::string instance_id;
+		// Instances sharing the namespace
+		std::string group = "default";
+		// Number of hash partitions devices are spread over, has to be the same for the whole group
+		uint32_t partitions = 64;
+		// Control topics are <control_root><group>/members/<id> and <control_root><group>/owners/<id>
+		std::string control_root = "homie-partition/";
+		// Additional restrictions applied on top of the partitioning
+		discovery_filter filter;
+	};
+
+	// One instance of a group of masters sharing the devices of a namespace. Device ids are
+	// hashed into a fixed number of partitions, partitions are assigned to the live instances
+	// by rendezvous hashing, so every instance computes the same assignment from the member list
+	// and only a small part moves when an instance joins or leaves. Members announce themselves
+	// (with the will clearing the announcement) and publish the partitions they took over,
+	// both retained on the control topic.
+	//
+	// MQTT can not filter by hash, so every instance still subscribes to the whole namespace
+	// and drops devices it does not own after a prefix compare and a hash of the id. This splits
+	// the device trees and their processing, not the network ingress. Shared subscriptions do
+	// not help, they balance single messages and would spread one device over all instances.
+	// When partitions move, only the devices of the gained partitions (known from their $state)
+	// are subscribed once more to get their retained state, not the whole namespace.
+	class partitioned_master {
+		// Client of the wrapped master, diverts the control topic and sets the will
+		class control_client : public mqtt_client, private mqtt_event_handler {
+			partitioned_master& owner;
+			mqtt_event_handler* handler;
+
+			virtual void on_connect(bool session_present, bool reconnected) override {
+				if (handler) handler->on_connect(session_present, reconnected);
+				owner.connected = true;
+				if (owner.started) owner.announce();
+			}
+			virtual void on_closing() override {
+				if (handler) handler->on_closing();
+			}
+			virtual void on_closed() override {
+				owner.connected = false;
+				if (handler) handler->on_closed();
+			}
+			virtual void on_offline() override {
+				owner.connected = false;
+				if (handler) handler->on_offline();
+			}
+			virtual void on_message(const std::string& topic, const std::string& payload) override {
+				if (topic.compare(0, owner.control_prefix.size(), owner.control_prefix) == 0) {
+					if (owner.started) owner.handle_control(topic, payload);
+					return;
+				}
+				owner.observe(topic, payload);
+				if (handler) handler->on_message(topic, payload);
+			}
+		public:
+			explicit control_client(partitioned_master& o)
+				: owner(o), handler(nullptr)
+			{}
+
+			virtual void set_event_handler(mqtt_event_handler* evt) override {
+				handler = evt;
+				owner.mqtt.set_event_handler(evt != nullptr ? this : nullptr);
+			}
+			virtual void open(const std::string& will_topic, const std::string& will_payload, int will_qos, bool will_retain) override {
+				owner.mqtt.open(will_topic, will_payload, will_qos, will_retain);
+			}
+			// Leaving the group on connection loss is done by the will
+			virtual void open() override { owner.mqtt.open(owner.member_topic(owner.options.instance_id), "", 1, true); }
+			virtual void publish(const std::string& topic, const std::string& payload, int qos, bool retain) override {
+				owner.mqtt.publish(topic, payload, qos, retain);
+			}
+			virtual void publish_batch(const mqtt_batch& batch) override { owner.mqtt.publish_batch(batch); }
+			virtual void subscribe(const std::string& topic, int qos) override { owner.mqtt.subscribe(topic, qos); }
+			virtual void unsubscribe(const std::string& topic) override { owner.mqtt.unsubscribe(topic); }
+			virtual bool is_connected() const override { return owner.mqtt.is_connected(); }
+		};
+
+		mqtt_client& mqtt;
+		partition_options options;
+		std::string base_topic;
+		std::string control_prefix;
+		bool connected;
+		bool started;
+		std::set<std::string> members;
+		std::set<uint32_t> owned;
+		// Partition to instance, as published by the instances
+		std::map<uint32_t, std::string> owners;
+		// Ids of all devices with a retained $state (owned or not) by partition
+		std::map<uint32_t, std::set<std::string>> known;
+		control_client proxy;
+		// Constructed last, it opens the connection
+		homie::master m;
+
+		std::string member_topic(const std::string& id) const { return control_prefix + "members/" + id; }
+		std::string owners_topic(const std::string& id) const { return control_prefix + "owners/" + id; }
+
+		static uint64_t mix(uint64_t x) {
+			x ^= x >> 30;
+			x *= 0xbf58476d1ce4e5b9ull;
+			x ^= x >> 27;
+			x *= 0x94d049bb133111ebull;
+			x ^= x >> 31;
+			return x;
+		}
+
+		static uint64_t score(const std::string& member, uint32_t partition) {
+			return mix((static_cast<uint64_t>(discovery_filter::hash_id(member.data(), member.size())) << 32) | partition);
+		}
+
+		// Records device ids from "<base><id>/$state", a suffix compare for all other topics
+		void observe(const std::string& topic, const std::string& payload) {
+			static const std::string suffix = "/$state";
+			if (topic.size() <= base_topic.size() + suffix.size()) return;
+			if (topic.compare(topic.size() - suffix.size(), suffix.size(), suffix) != 0) return;
+			if (topic.compare(0, base_topic.size(), base_topic) != 0) return;
+			auto len = topic.size() - suffix.size() - base_topic.size();
+			if (topic.find('/', base_topic.size()) != base_topic.size() + len || topic[base_topic.size()] == '$') return;
+			auto id = topic.substr(base_topic.size(), len);
+			auto& ids = known[get_partition(id)];
+			if (payload.empty()) ids.erase(id);
+			else ids.insert(id);
+		}
+
+		// Subscribing again makes the broker resend the retained messages of just these devices.
+		// The overlap with the namespace subscription ends right away, duplicates are suppressed.
+		void replay(const std::set<uint32_t>& partitions) {
+			if (!connected) return;
+			for (auto p : partitions) {
+				auto it = known.find(p);
+				if (it == known.end()) continue;
+				for (auto& id : it->second) {
+					mqtt.subscribe(base_topic + id + "/#", 1);
+					mqtt.unsubscribe(base_topic + id + "/#");
+				}
+			}
+		}
+
+		void announce() {
+			mqtt.subscribe(control_prefix + "#", 1);
+			mqtt.publish(member_topic(options.instance_id), "1", 1, true);
+			members.insert(options.instance_id);
+			rebalance(true);
+		}
+
+		void handle_control(const std::string& topic, const std::string& payload) {
+			auto rest = topic.substr(control_prefix.size());
+			auto pos = rest.find('/');
+			if (pos == std::string::npos) return;
+			auto kind = rest.substr(0, pos);
+			auto id = rest.substr(pos + 1);
+			if (kind == "members") {
+				// Our own announcement can only be cleared by a will of an earlier connection
+				if (id == options.instance_id && payload.empty()) {
+					if (connected) mqtt.publish(member_topic(id), "1", 1, true);
+					return;
+				}
+				bool changed = payload.empty() ? members.erase(id) != 0 : members.insert(id).second;
+				if (changed) rebalance(false);
+			}
+			else if (kind == "owners") {
+				for (auto it = owners.begin(); it != owners.end();) {
+					if (it->second == id) it = owners.erase(it);
+					else it++;
+				}
+				for (auto& p : utils::split(payload, std::string(","))) {
+					int64_t v = 0;
+					if (!p.empty() && utils::parse_int(p, 0, p.size(), v) && v >= 0 && v < static_cast<int64_t>(options.partitions)) owners[static_cast<uint32_t>(v)] = id;
+				}
+			}
+		}
+
+		// Takes the partitions this instance scores highest for
+		void rebalance(bool force) {
+			std::set<uint32_t> now;
+			for (uint32_t p = 0; p < options.partitions; p++) {
+				const std::string* best = nullptr;
+				uint64_t best_score = 0;
+				for (auto& id : members) {
+					auto s = score(id, p);
+					if (best == nullptr || s > best_score) {
+						best = &id;
+						best_score = s;
+					}
+				}
+				if (best != nullptr && *best == options.instance_id) now.insert(p);
+			}
+			if (!force && now == owned) return;
+			std::set<uint32_t> gained;
+			for (auto p : now) {
+				if (owned.count(p) == 0) gained.insert(p);
+			}
+			owned = std::move(now);
+			apply_filter();
+			// Retained state of the new devices is only sent on subscribe
+			replay(gained);
+			if (connected) mqtt.publish(owners_topic(options.instance_id), join(owned), 1, true);
+		}
+
+		void apply_filter() {
+			auto f = options.filter;
+			f.partition_count = options.partitions;
+			f.partitions = owned;
+			m.set_discovery_filter(f);
+		}
+
+		static std::string join(const std::set<uint32_t>& values) {
+			std::string res;
+			for (auto v : values) {
+				if (!res.empty()) res += ',';
+				res += std::to_string(v);
+			}
+			return res;
+		}
+	public:
+		partitioned_master(mqtt_client& con, const partition_options& opts, const std::string& basetopic = "homie/")
+			: mqtt(con), options(opts), base_topic(basetopic), control_prefix(opts.control_root + opts.group + "/"), connected(false), started(false), proxy(*this), m(proxy, basetopic)
+		{
+			if (options.partitions == 0) options.partitions = 1;
+			// Owns nothing until the connection is up and the group is known
+			apply_filter();
+			started = true;
+			if (connected) announce();
+		}
+
+		~partitioned_master() {
+			leave();
+		}
+
+		partitioned_master(const partitioned_master&) = delete;
+		partitioned_master& operator=(const partitioned_master&) = delete;
+
+		homie::master& get_master() { return m; }
+		const homie::master& get_master() const { return m; }
+
+		const std::string& get_instance_id() const { return options.instance_id; }
+		const std::set<std::string>& get_members() const { return members; }
+		const std::set<uint32_t>& get_owned_partitions() const { return owned; }
+
+		uint32_t get_partition(const std::string& device) const {
+			return discovery_filter::hash_id(device.data(), device.size()) % options.partitions;
+		}
+
+		bool owns(const std::string& device) const {
+			return owned.count(get_partition(device)) != 0;
+		}
+
+		// Instance that published ownership of the partition of device, empty if none did (yet)
+		std::string get_owner(const std::string& device) const {
+			auto it = owners.find(get_partition(device));
+			return it != owners.end() ? it->second : "";
+		}
+
+		// Hands all partitions to the remaining instances. The instance stays idle afterwards.
+		void leave() {
+			if (!started) return;
+			started = false;
+			if (connected) {
+				mqtt.unsubscribe(control_prefix + "#");
+				mqtt.publish(owners_topic(options.instance_id), "", 1, true);
+				mqtt.publish(member_topic(options.instance_id), "", 1, true);
+			}
+			members.clear();
+			owners.clear();
+			owned.clear();
+			apply_filter();
+		}
+	};
+}
@@ -0,0 +1,227 @@
+#pragma once
+#include "device.h"
+#include "utils.h"
+#include <cstring>
+
+namespace homie {
+	namespace serialization {
+		// Stream layout: magic, version byte and one record per device.
+		// A record is the device tag followed by
+		//   id, [attributes], [nodes]
+		// node: id, [attributes], [indexed attributes], [properties]
+		// property: id, [attributes], value, [indexed values]
+		// where [] denotes a varint count followed by the entries.
+		constexpr size_t magic_size = 4;
+		constexpr uint8_t format_version = 1;
+		constexpr uint8_t tag_device = 'D';
+		inline const char* magic() { return "HDTF"; }
+
+		// Receives the decoded tree in stream order
+		struct tree_visitor {
+			virtual void on_device(const std::string& id) = 0;
+			virtual void on_device_attribute(const std::string& id, const std::string& value) = 0;
+			virtual void on_node(const std::string& id) = 0;
+			virtual void on_node_attribute(const std::string& id, const std::string& value) = 0;
+			virtual void on_node_attribute(int64_t idx, const std::string& id, const std::string& value) = 0;
+			virtual void on_property(const std::string& id) = 0;
+			virtual void on_property_attribute(const std::string& id, const std::string& value) = 0;
+			virtual void on_property_value(const std::string& value) = 0;
+			virtual void on_property_value(int64_t idx, const std::string& value) = 0;
+			virtual void on_device_end() = 0;
+		};
+
+		class tree_writer {
+			utils::binary_writer wr;
+
+			void write_header() {
+				wr.write_raw(magic(), magic_size);
+				wr.write_byte(format_version);
+			}
+		public:
+			explicit tree_writer(std::string& out)
+				: wr(out)
+			{
+				write_header();
+			}
+			// Writes into a fixed buffer, throws if it is too small
+			tree_writer(void* data, size_t len)
+				: wr(data, len)
+			{
+				write_header();
+			}
+			// Only counts the bytes, used to size a buffer before writing into it
+			tree_writer()
+			{
+				write_header();
+			}
+
+			size_t size() const { return wr.size(); }
+
+			// Low level interface, entries have to follow the layout described above
+			// and every list has to contain exactly the announced number of entries.
+			void begin_device(const std::string& id) {
+				wr.write_byte(tag_device);
+				wr.write_string(id);
+			}
+			void begin_list(size_t count) { wr.write_varint(count); }
+			void begin_node(const std::string& id) { wr.write_string(id); }
+			void begin_property(const std::string& id) { wr.write_string(id); }
+			void attribute(const std::string& id, const std::string& value) {
+				wr.write_string(id);
+				wr.write_string(value);
+			}
+			void indexed_attribute(int64_t idx, const std::string& id, const std::string& value) {
+				wr.write_signed(idx);
+				attribute(id, value);
+			}
+			void value(const std::string& value) { wr.write_string(value); }
+			void indexed_value(int64_t idx, const std::string& value) {
+				wr.write_signed(idx);
+				wr.write_string(value);
+			}
+
+			// Write a complete device using only the public device interface
+			void write(const device& dev) {
+				begin_device(dev.get_id());
+				auto attributes = dev.get_attributes();
+				begin_list(attributes.size());
+				for (auto& a : attributes) attribute(a, dev.get_attribute(a));
+
+				auto nodes = dev.get_nodes();
+				begin_list(nodes.size());
+				for (auto& n : nodes) {
+					auto node = dev.get_node(n);
+					begin_node(n);
+					attributes = node->get_attributes();
+					begin_list(attributes.size());
+					for (auto& a : attributes) attribute(a, node->get_attribute(a));
+
+					// Stored indices only, the declared range may be huge or malformed
+					auto indices = node->get_indices();
+					std::vector<std::pair<int64_t, std::set<std::string>>> indexed;
+					size_t nindexed = 0;
+					for (auto i : indices) {
+						indexed.push_back({ i, node->get_attributes(i) });
+						nindexed += indexed.back().second.size();
+					}
+					begin_list(nindexed);
+					for (auto& e : indexed) {
+						for (auto& a : e.second) indexed_attribute(e.first, a, node->get_attribute(a, e.first));
+					}
+
+					auto properties = node->get_properties();
+					begin_list(properties.size());
+					for (auto& p : properties) {
+						auto prop = node->get_property(p);
+						begin_property(p);
+						attributes = prop->get_attributes();
+						begin_list(attributes.size());
+						for (auto& a : attributes) attribute(a, prop->get_attribute(a));
+						if (node->is_array()) {
+							value("");
+							std::vector<std::pair<int64_t, std::string>> values;
+							for (auto i : indices) {
+								auto v = prop->get_value(i);
+								if (!v.empty()) values.push_back({ i, std::move(v) });
+							}
+							begin_list(values.size());
+							for (auto& e : values) indexed_value(e.first, e.second);
+						}
+						else {
+							value(prop->get_value());
+							begin_list(0);
+						}
+					}
+				}
+			}
+		};
+
+		class tree_reader {
+			utils::binary_reader rd;
+			// Reused between entries to avoid allocations
+			std::string id;
+			std::string value;
+
+			void read_attribute(int64_t* idx) {
+				if (idx != nullptr) *idx = rd.read_signed();
+				rd.read_string(id);
+				rd.read_string(value);
+			}
+		public:
+			tree_reader(const void* data, size_t len)
+				: rd(data, len)
+			{
+				auto m = rd.read_raw(magic_size);
+				if (std::memcmp(m, magic(), magic_size) != 0)
+					throw std::runtime_error("not a device tree stream");
+				if (rd.read_byte() != format_version)
+					throw std::runtime_error("unsupported device tree version");
+			}
+
+			// Decode the next device, returns false at the end of the stream
+			bool next(tree_visitor& visitor) {
+				if (rd.at_end()) return false;
+				if (rd.read_byte() != tag_device)
+					throw std::runtime_error("invalid device tree record");
+
+				int64_t idx = 0;
+				rd.read_string(id);
+				visitor.on_device(id);
+				for (auto n = rd.read_varint(); n > 0; n--) {
+					read_attribute(nullptr);
+					visitor.on_device_attribute(id, value);
+				}
+				for (auto nnodes = rd.read_varint(); nnodes > 0; nnodes--) {
+					rd.read_string(id);
+					visitor.on_node(id);
+					for (auto n = rd.read_varint(); n > 0; n--) {
+						read_attribute(nullptr);
+						visitor.on_node_attribute(id, value);
+					}
+					for (auto n = rd.read_varint(); n > 0; n--) {
+						read_attribute(&idx);
+						visitor.on_node_attribute(idx, id, value);
+					}
+					for (auto nproperties = rd.read_varint(); nproperties > 0; nproperties--) {
+						rd.read_string(id);
+						visitor.on_property(id);
+						for (auto n = rd.read_varint(); n > 0; n--) {
+							read_attribute(nullptr);
+							visitor.on_property_attribute(id, value);
+						}
+						rd.read_string(value);
+						visitor.on_property_value(value);
+						for (auto n = rd.read_varint(); n > 0; n--) {
+							idx = rd.read_signed();
+							rd.read_string(value);
+							visitor.on_property_value(idx, value);
+						}
+					}
+				}
+				visitor.on_device_end();
+				return true;
+			}
+
+			void read_all(tree_visitor& visitor) {
+				while (next(visitor));
+			}
+
+			// Decode the whole stream without applying it, throws on the first error
+			static void validate(const void* data, size_t len) {
+				struct : tree_visitor {
+					void on_device(const std::string&) override {}
+					void on_device_attribute(const std::string&, const std::string&) override {}
+					void on_node(const std::string&) override {}
+					void on_node_attribute(const std::string&, const std::string&) override {}
+					void on_node_attribute(int64_t, const std::string&, const std::string&) override {}
+					void on_property(const std::string&) override {}
+					void on_property_attribute(const std::string&, const std::string&) override {}
+					void on_property_value(const std::string&) override {}
+					void on_property_value(int64_t, const std::string&) override {}
+					void on_device_end() override {}
+				} ignore;
+				tree_reader(data, len).read_all(ignore);
+			}
+		};
+	}
+}
\ No newline at end of file
@@ -0,0 +1,272 @@
+#pragma once
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <limits>
+#include <map>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#if defined(__cpp_impl_coroutine) && defined(__has_include)
+#if __has_include(<coroutine>)
+#include <coroutine>
+#define HOMIE_HAS_COROUTINES 1
+#endif
+#endif
+
+namespace homie {
+	enum class set_status {
+		// The device published the requested value
+		confirmed,
+		// No matching value arrived in time
+		timeout,
+		// The property (or its device) was removed while waiting
+		removed,
+		// The master was destroyed while waiting
+		cancelled
+	};
+
+	inline const char* to_string(set_status s) {
+		switch (s) {
+		case set_status::confirmed: return "confirmed";
+		case set_status::timeout: return "timeout";
+		case set_status::removed: return "removed";
+		case set_status::cancelled: return "cancelled";
+		}
+		return "unknown";
+	}
+
+	class set_error : public std::runtime_error {
+		set_status st;
+	public:
+		explicit set_error(set_status s)
+			: std::runtime_error(std::string("set not confirmed: ") + to_string(s)), st(s)
+		{}
+
+		set_status status() const { return st; }
+	};
+
+	typedef std::function<void(set_status)> set_callback;
+
+#ifdef HOMIE_HAS_COROUTINES
+	// Awaitable form of a set request, throws set_error from co_await if it was not confirmed
+	class set_awaitable {
+		std::function<void(set_callback)> start;
+		std::coroutine_handle<> waiter;
+		set_status result = set_status::cancelled;
+		bool completed = false;
+		bool suspended = false;
+	public:
+		explicit set_awaitable(std::function<void(set_callback)> fn)
+			: start(std::move(fn))
+		{}
+
+		bool await_ready() const noexcept { return false; }
+
+		bool await_suspend(std::coroutine_handle<> h) {
+			waiter = h;
+			start([this](set_status s) {
+				result = s;
+				completed = true;
+				if (suspended) waiter.resume();
+			});
+			// Completed synchronously, continue without suspending
+			if (completed) return false;
+			suspended = true;
+			return true;
+		}
+
+		void await_resume() const {
+			if (result != set_status::confirmed) throw set_error(result);
+		}
+	};
+#endif
+
+	// Latency distribution in power of two microsecond buckets. Bucket i counts
+	// latencies below 2^i us (and at least 2^(i-1) us).
+	class latency_histogram {
+	public:
+		typedef std::chrono::microseconds duration;
+		static constexpr size_t bucket_count = 40;
+	private:
+		std::array<uint64_t, bucket_count> buckets;
+		uint64_t total;
+		duration sum;
+		duration lowest;
+		duration highest;
+	public:
+		latency_histogram()
+			: total(0), sum(0), lowest(duration::max()), highest(0)
+		{
+			buckets.fill(0);
+		}
+
+		void record(duration d) {
+			if (d < duration::zero()) d = duration::zero();
+			size_t b = 0;
+			auto v = static_cast<uint64_t>(d.count());
+			while (v != 0 && b < bucket_count - 1) {
+				v >>= 1;
+				b++;
+			}
+			buckets[b]++;
+			total++;
+			sum += d;
+			lowest = std::min(lowest, d);
+			highest = std::max(highest, d);
+		}
+
+		uint64_t count() const { return total; }
+		uint64_t bucket(size_t i) const { return buckets.at(i); }
+		static duration bucket_limit(size_t i) { return duration(static_cast<int64_t>(1) << i); }
+		duration min() const { return total == 0 ? duration::zero() : lowest; }
+		duration max() const { return highest; }
+		duration mean() const { return total == 0 ? duration::zero() : sum / static_cast<int64_t>(total); }
+
+		// Upper bound of the bucket containing the q quantile (0 <= q <= 1)
+		duration percentile(double q) const {
+			if (total == 0) return duration::zero();
+			auto target = static_cast<uint64_t>(q * static_cast<double>(total) + 0.5);
+			if (target < 1) target = 1;
+			uint64_t seen = 0;
+			for (size_t i = 0; i < bucket_count; i++) {
+				seen += buckets[i];
+				if (seen >= target) return std::min(bucket_limit(i), highest);
+			}
+			return highest;
+		}
+	};
+
+	// Table of set requests waiting for the device to publish the requested value.
+	// Requests are keyed by (property handle index, array index) for confirmation
+	// and by deadline for expiry.
+	class set_tracker {
+	public:
+		typedef std::chrono::steady_clock clock;
+		typedef std::pair<uint32_t, int64_t> key_type;
+	private:
+		struct request {
+			key_type key;
+			std::string value;
+			// Histogram key: node type and property id
+			std::pair<std::string, std::string> kind;
+			clock::time_point start;
+			std::multimap<clock::time_point, uint64_t>::iterator deadline;
+			set_callback done;
+		};
+
+		uint64_t next_id;
+		std::map<uint64_t, request> requests;
+		std::multimap<key_type, uint64_t> by_key;
+		std::multimap<clock::time_point, uint64_t> deadlines;
+		latency_histogram overall;
+		std::map<std::pair<std::string, std::string>, latency_histogram> per_kind;
+		std::array<uint64_t, 4> results;
+
+		void remove(std::map<uint64_t, request>::iterator it) {
+			auto range = by_key.equal_range(it->second.key);
+			for (auto k = range.first; k != range.second; k++) {
+				if (k->second == it->first) {
+					by_key.erase(k);
+					break;
+				}
+			}
+			deadlines.erase(it->second.deadline);
+			requests.erase(it);
+		}
+
+		// Callbacks run after the tables are consistent again, they may start new requests
+		void finish(std::vector<std::pair<set_callback, set_status>>& done) {
+			for (auto& e : done) {
+				results[static_cast<size_t>(e.second)]++;
+				if (e.first) e.first(e.second);
+			}
+		}
+	public:
+		set_tracker()
+			: next_id(1)
+		{
+			results.fill(0);
+		}
+
+		void add(key_type key, const std::string& value, const std::string& node_type, const std::string& property, clock::duration timeout, set_callback done) {
+			auto id = next_id++;
+			auto now = clock::now();
+			auto& req = requests[id];
+			req.key = key;
+			req.value = value;
+			req.kind = { node_type, property };
+			req.start = now;
+			req.deadline = deadlines.emplace(now + timeout, id);
+			req.done = std::move(done);
+			by_key.emplace(key, id);
+		}
+
+		// A value was published for key, completes all requests waiting for it
+		void value_received(key_type key, const std::string& value) {
+			auto range = by_key.equal_range(key);
+			if (range.first == range.second) return;
+			std::vector<uint64_t> matched;
+			for (auto k = range.first; k != range.second; k++) {
+				if (requests.at(k->second).value == value) matched.push_back(k->second);
+			}
+			if (matched.empty()) return;
+			auto now = clock::now();
+			std::vector<std::pair<set_callback, set_status>> done;
+			for (auto id : matched) {
+				auto it = requests.find(id);
+				auto latency = std::chrono::duration_cast<latency_histogram::duration>(now - it->second.start);
+				overall.record(latency);
+				per_kind[it->second.kind].record(latency);
+				done.emplace_back(std::move(it->second.done), set_status::confirmed);
+				remove(it);
+			}
+			finish(done);
+		}
+
+		// Fails all requests of a property, for every array index
+		void fail(uint32_t handle_index, set_status status) {
+			std::vector<std::pair<set_callback, set_status>> done;
+			auto it = by_key.lower_bound({ handle_index, std::numeric_limits<int64_t>::min() });
+			while (it != by_key.end() && it->first.first == handle_index) {
+				auto req = requests.find(it->second);
+				it++;
+				done.emplace_back(std::move(req->second.done), status);
+				remove(req);
+			}
+			finish(done);
+		}
+
+		void fail_all(set_status status) {
+			std::vector<std::pair<set_callback, set_status>> done;
+			for (auto& e : requests) done.emplace_back(std::move(e.second.done), status);
+			requests.clear();
+			by_key.clear();
+			deadlines.clear();
+			finish(done);
+		}
+
+		// Fails requests whose deadline passed
+		void expire(clock::time_point now) {
+			std::vector<std::pair<set_callback, set_status>> done;
+			while (!deadlines.empty() && deadlines.begin()->first <= now) {
+				auto req = requests.find(deadlines.begin()->second);
+				done.emplace_back(std::move(req->second.done), set_status::timeout);
+				remove(req);
+			}
+			finish(done);
+		}
+
+		size_t pending() const { return requests.size(); }
+		uint64_t count(set_status status) const { return results[static_cast<size_t>(status)]; }
+		const latency_histogram& latency() const { return overall; }
+
+		const latency_histogram* latency(const std::string& node_type, const std::string& property) const {
+			auto it = per_kind.find({ node_type, property });
+			return it == per_kind.end() ? nullptr : &it->second;
+		}
+	};
+}
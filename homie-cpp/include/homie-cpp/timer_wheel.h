@@ -0,0 +1,62 @@
+#pragma once
+#include <chrono>
+#include <cstdint>
+#include <vector>
+
+namespace homie {
+	// Hashed timer wheel. Timers are not cancelled or moved, the expiry callback is expected
+	// to check the real deadline of the key and schedule it again if it moved. Deadlines
+	// further away than one revolution fire early for the same reason.
+	template<typename Key>
+	class timer_wheel {
+	public:
+		typedef std::chrono::steady_clock clock;
+	private:
+		clock::duration resolution;
+		std::vector<std::vector<Key>> slots;
+		size_t current;
+		// Start of the current slot
+		clock::time_point current_time;
+		size_t count;
+	public:
+		explicit timer_wheel(clock::duration res = std::chrono::seconds(1), size_t nslots = 512, clock::time_point start = clock::now())
+			: resolution(res), slots(nslots < 2 ? 2 : nslots), current(0), current_time(start), count(0)
+		{}
+
+		void schedule(const Key& key, clock::time_point deadline) {
+			size_t ticks = 0;
+			if (deadline > current_time) {
+				auto t = static_cast<uint64_t>((deadline - current_time) / resolution);
+				ticks = t < slots.size() - 1 ? static_cast<size_t>(t) : slots.size() - 1;
+			}
+			slots[(current + ticks) % slots.size()].push_back(key);
+			count++;
+		}
+
+		// Calls fn(key) for every timer in a slot that ended at or before now
+		template<typename F>
+		void advance(clock::time_point now, F&& fn) {
+			std::vector<Key> expired;
+			size_t steps = 0;
+			while (current_time + resolution <= now) {
+				if (steps < slots.size()) {
+					expired.swap(slots[current]);
+					count -= expired.size();
+				}
+				current = (current + 1) % slots.size();
+				current_time += resolution;
+				// Every slot was visited, skip the remaining revolutions at once
+				if (++steps == slots.size() && current_time + resolution <= now) {
+					auto skip = (now - current_time) / resolution;
+					current = (current + static_cast<size_t>(skip % static_cast<decltype(skip)>(slots.size()))) % slots.size();
+					current_time += skip * resolution;
+				}
+				for (auto& k : expired) fn(k);
+				expired.clear();
+			}
+		}
+
+		size_t size() const { return count; }
+		clock::duration get_resolution() const { return resolution; }
+	};
+}
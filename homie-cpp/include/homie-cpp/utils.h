@@ -1,5 +1,13 @@
 #pragma once
 #include <vector>
+#include <string>
+#include <limits>
+#include <stdexcept>
+#include <cstdint>
+#include <cstdlib>
+#include <cctype>
+#include <cmath>
+#include <cstring>
 
 namespace homie {
 	namespace utils {
@@ -19,5 +27,183 @@ namespace homie {
 			} while (true);
 			return res;
 		}
+
+		// Match a glob pattern supporting '*' and '?' without allocating
+		inline bool glob_match(const char* pattern, size_t plen, const char* str, size_t slen) {
+			size_t p = 0, s = 0;
+			size_t star = std::numeric_limits<size_t>::max(), mark = 0;
+			while (s < slen) {
+				if (p < plen && (pattern[p] == '?' || pattern[p] == str[s])) {
+					p++;
+					s++;
+				}
+				else if (p < plen && pattern[p] == '*') {
+					star = p++;
+					mark = s;
+				}
+				else if (star != std::numeric_limits<size_t>::max()) {
+					p = star + 1;
+					s = ++mark;
+				}
+				else return false;
+			}
+			while (p < plen && pattern[p] == '*') p++;
+			return p == plen;
+		}
+
+		// Parse s[pos, end) as a decimal integer, returns false if it is not one
+		inline bool parse_int(const std::string& s, size_t pos, size_t end, int64_t& out) {
+			if (end > s.size()) end = s.size();
+			bool negative = pos < end && s[pos] == '-';
+			if (negative) pos++;
+			if (pos >= end) return false;
+			uint64_t res = 0;
+			for (; pos < end; pos++) {
+				if (s[pos] < '0' || s[pos] > '9') return false;
+				res = res * 10 + static_cast<uint64_t>(s[pos] - '0');
+				if (res > static_cast<uint64_t>(std::numeric_limits<int64_t>::max())) return false;
+			}
+			out = negative ? -static_cast<int64_t>(res) : static_cast<int64_t>(res);
+			return true;
+		}
+
+		// Parse a complete decimal floating point number, rejects trailing garbage
+		inline bool parse_double(const std::string& s, double& out) {
+			if (s.empty() || std::isspace(static_cast<unsigned char>(s[0]))) return false;
+			char* end = nullptr;
+			auto res = std::strtod(s.c_str(), &end);
+			if (end != s.c_str() + s.size() || !std::isfinite(res)) return false;
+			out = res;
+			return true;
+		}
+
+		// Part of a string, used to look up topic levels without copying them
+		struct string_slice {
+			const std::string& str;
+			size_t pos;
+			size_t len;
+		};
+
+		// Transparent comparator for std::string keyed containers accepting string_slice
+		struct slice_less {
+			typedef void is_transparent;
+			bool operator()(const std::string& a, const std::string& b) const { return a < b; }
+			bool operator()(const std::string& a, const string_slice& b) const { return b.str.compare(b.pos, b.len, a) > 0; }
+			bool operator()(const string_slice& a, const std::string& b) const { return a.str.compare(a.pos, a.len, b) < 0; }
+		};
+
+		// Pair of iterators usable in range based for loops
+		template<typename Iterator>
+		struct range {
+			Iterator first;
+			Iterator last;
+			size_t count;
+
+			range(Iterator b, Iterator e, size_t n)
+				: first(b), last(e), count(n)
+			{}
+
+			Iterator begin() const { return first; }
+			Iterator end() const { return last; }
+			size_t size() const { return count; }
+			bool empty() const { return count == 0; }
+		};
+
+		// Compact binary encoding helpers (LEB128 varints, length prefixed strings)
+		// Appends to a string, fills a fixed buffer or (default constructed) only counts the bytes
+		struct binary_writer {
+			std::string* out;
+			uint8_t* buf;
+			size_t capacity;
+			size_t written;
+
+			binary_writer(std::string& s)
+				: out(&s), buf(nullptr), capacity(0), written(0)
+			{}
+			binary_writer(void* data, size_t len)
+				: out(nullptr), buf(static_cast<uint8_t*>(data)), capacity(len), written(0)
+			{}
+			binary_writer()
+				: out(nullptr), buf(nullptr), capacity(0), written(0)
+			{}
+
+			size_t size() const { return written; }
+			void write_byte(uint8_t b) {
+				if (out != nullptr) {
+					out->push_back(static_cast<char>(b));
+				} else if (buf != nullptr) {
+					if (written == capacity) throw std::runtime_error("buffer too small");
+					buf[written] = b;
+				}
+				written++;
+			}
+			void write_raw(const void* data, size_t len) {
+				if (out != nullptr) {
+					out->append(static_cast<const char*>(data), len);
+				} else if (buf != nullptr) {
+					if (len > capacity - written) throw std::runtime_error("buffer too small");
+					std::memcpy(buf + written, data, len);
+				}
+				written += len;
+			}
+			void write_varint(uint64_t v) {
+				while (v >= 0x80) {
+					write_byte(static_cast<uint8_t>(v | 0x80));
+					v >>= 7;
+				}
+				write_byte(static_cast<uint8_t>(v));
+			}
+			void write_signed(int64_t v) { write_varint((static_cast<uint64_t>(v) << 1) ^ static_cast<uint64_t>(v >> 63)); }
+			void write_string(const std::string& s) {
+				write_varint(s.size());
+				write_raw(s.data(), s.size());
+			}
+		};
+
+		struct binary_reader {
+			const uint8_t* pos;
+			const uint8_t* end;
+
+			binary_reader(const void* data, size_t len)
+				: pos(static_cast<const uint8_t*>(data)), end(static_cast<const uint8_t*>(data) + len)
+			{}
+
+			bool at_end() const { return pos == end; }
+			size_t remaining() const { return static_cast<size_t>(end - pos); }
+			uint8_t read_byte() {
+				if (pos == end) throw std::runtime_error("unexpected end of data");
+				return *pos++;
+			}
+			const uint8_t* read_raw(size_t len) {
+				if (remaining() < len) throw std::runtime_error("unexpected end of data");
+				auto res = pos;
+				pos += len;
+				return res;
+			}
+			uint64_t read_varint() {
+				uint64_t res = 0;
+				for (int shift = 0; shift < 64; shift += 7) {
+					auto b = read_byte();
+					res |= static_cast<uint64_t>(b & 0x7f) << shift;
+					if ((b & 0x80) == 0) return res;
+				}
+				throw std::runtime_error("invalid varint");
+			}
+			int64_t read_signed() {
+				auto v = read_varint();
+				return static_cast<int64_t>(v >> 1) ^ -static_cast<int64_t>(v & 1);
+			}
+			std::string read_string() {
+				std::string res;
+				read_string(res);
+				return res;
+			}
+			void read_string(std::string& out) {
+				auto len = read_varint();
+				if (len > remaining()) throw std::runtime_error("unexpected end of data");
+				auto data = read_raw(static_cast<size_t>(len));
+				out.assign(reinterpret_cast<const char*>(data), static_cast<size_t>(len));
+			}
+		};
 	}
 }
\ No newline at end of file
@@ -0,0 +1,89 @@
+#pragma once
+#include "utils.h"
+#include <cmath>
+#include <cstdint>
+#include <map>
+#include <string>
+
+namespace homie {
+	typedef uint32_t filter_id;
+
+	enum class value_filter_kind {
+		// Report when the value moved more than value away from the last reported one.
+		// The first value is always reported.
+		deadband,
+		// Report when the value crosses value in either direction.
+		// The first value only establishes the side.
+		threshold
+	};
+
+	// Selects properties and the numeric condition under which changes are reported
+	struct value_filter {
+		// Glob matched against "device/node/property", empty matches every property
+		std::string pattern;
+		// Only properties of nodes with this type, empty for any type
+		std::string node_type;
+		value_filter_kind kind = value_filter_kind::deadband;
+		double value = 0;
+
+		static value_filter deadband(const std::string& pattern, double delta, const std::string& node_type = "") {
+			value_filter res;
+			res.pattern = pattern;
+			res.node_type = node_type;
+			res.kind = value_filter_kind::deadband;
+			res.value = delta;
+			return res;
+		}
+
+		static value_filter threshold(const std::string& pattern, double level, const std::string& node_type = "") {
+			value_filter res;
+			res.pattern = pattern;
+			res.node_type = node_type;
+			res.kind = value_filter_kind::threshold;
+			res.value = level;
+			return res;
+		}
+
+		bool matches(const std::string& path, const std::string& type) const {
+			if (!node_type.empty() && node_type != type) return false;
+			return pattern.empty() || utils::glob_match(pattern.data(), pattern.size(), path.data(), path.size());
+		}
+	};
+
+	// A filter compiled into the filter list of one property, holding the last value per array index
+	struct value_filter_binding {
+		filter_id id;
+		const value_filter* filter;
+		bool has_last = false;
+		double last = 0;
+		std::map<int64_t, double> last_indexed;
+
+		value_filter_binding(filter_id i, const value_filter* f)
+			: id(i), filter(f)
+		{}
+
+		// Updates the state, returns true if the value has to be reported
+		bool update(bool indexed, int64_t idx, double v) {
+			bool first;
+			double* prev;
+			if (indexed) {
+				auto r = last_indexed.emplace(idx, v);
+				first = r.second;
+				prev = &r.first->second;
+			}
+			else {
+				first = !has_last;
+				has_last = true;
+				prev = &last;
+			}
+			if (filter->kind == value_filter_kind::deadband) {
+				if (!first && std::abs(v - *prev) <= filter->value) return false;
+				*prev = v;
+				return true;
+			}
+			bool crossed = !first && ((*prev > filter->value) != (v > filter->value));
+			*prev = v;
+			return crossed;
+		}
+	};
+}
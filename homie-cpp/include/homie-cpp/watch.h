@@ -0,0 +1,37 @@
+#pragma once
+#include "property.h"
+#include "handle_table.h"
+#include "utils.h"
+#include <cstdint>
+#include <functional>
+#include <set>
+#include <string>
+
+namespace homie {
+	typedef uint32_t watch_token;
+
+	// Receives value changes of watched properties. idx is no_index (see column_store.h)
+	// for properties of non array nodes.
+	typedef std::function<void(const property_ptr& prop, int64_t idx, const std::string& value)> watch_callback;
+
+	// A registered watcher, shared by the dispatch tables of all properties it matches
+	struct watch_entry {
+		watch_token token;
+		// Glob patterns for the device, node and property id
+		std::string device;
+		std::string node;
+		std::string property;
+		watch_callback callback;
+		bool active;
+		// Properties whose dispatch table holds this entry, unwatch only visits these
+		std::set<property_handle> bound;
+
+		static bool match(const std::string& pattern, const std::string& id) {
+			return utils::glob_match(pattern.data(), pattern.size(), id.data(), id.size());
+		}
+
+		bool matches(const std::string& dev, const std::string& n, const std::string& prop) const {
+			return match(device, dev) && match(node, n) && match(property, prop);
+		}
+	};
+}